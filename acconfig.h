@@ -42,6 +42,9 @@
 /* Define if we want to include rpc/types.h.  Crap BSDs put INADDR_LOOPBACK there. */
 #undef HAVEUSE_RPCTYPES_H
 
+/* Define if we can use io_uring (Linux), with multishot receives.  */
+#undef HAVE_IO_URING
+
 @BOTTOM@
 
 /* Use the definitions: */
@@ -94,6 +94,7 @@ void of_type(const struct optioninfo *oi, const char *arg, const char *arg2) {
     
     /* types with only one version */
     { adns_r_cname,  "cname"  },
+    { adns_r_aaaa,   "aaaa"   },
     { adns_r_hinfo,  "hinfo"  },
     { adns_r_txt,    "txt"    },
     
@@ -31,7 +31,7 @@ int ov_env=1, ov_pipe=0, ov_asynch=0;
 int ov_verbose= 0;
 adns_rrtype ov_type= adns_r_none;
 int ov_search=0, ov_qc_query=0, ov_qc_anshost=0, ov_qc_cname=1;
-int ov_tcp=0, ov_cname=0, ov_format=fmt_default;
+int ov_tcp=0, ov_cname=0, ov_addrfam=0, ov_format=fmt_default;
 char *ov_id= 0;
 struct perqueryflags_remember ov_pqfr = { 1,1,1, tm_none };
 
@@ -114,6 +114,14 @@ static const struct optioninfo perquery_options[]= {
   { ot_value,            "CNAME ok for query domain, but not in RRs (default)",
     "Cs", "cname-ok",      &ov_cname, 0 },
   
+  { ot_desconly, "per-query address family (for addr and +addr types):" },
+  { ot_value,            "IPv4 addresses only (default)",
+    "A4", "addr-ipv4",     &ov_addrfam, 0 },
+  { ot_value,            "IPv6 addresses only",
+    "A6", "addr-ipv6",     &ov_addrfam, adns_qf_want_ipv6 },
+  { ot_value,            "Both IPv4 and IPv6 addresses, looked up in parallel",
+    "Aa", "addr-all",      &ov_addrfam, adns_qf_want_allaf },
+  
   { ot_desconly, "asynchronous/pipe mode options:" },
   { ot_funcarg,          "Set <id>, default is decimal sequence starting 0",
     0, "asynch-id",        0,0, &of_asynch_id, "id" },
@@ -263,7 +271,7 @@ static void printusage(void) {
 	"\n"
 	"Query types (see adns.h; default is addr):\n"
 	"  ns  soa  ptr  mx  rp  srv  addr       - enhanced versions\n"
-	"  cname  hinfo  txt                     - types with only one version\n"
+	"  cname  hinfo  txt  aaaa               - types with only one version\n"
 	"  a  ns-  soa-  ptr-  mx-  rp-  srv-    - _raw versions\n"
 	"  type<number>                          - `unknown' type, RFC3597\n"
 	"Default is addr, or ptr for -i/--ptr queries\n",
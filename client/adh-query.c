@@ -92,24 +92,35 @@ static void prep_query(struct query_node **qun_r, int *quflags_r) {
     (ov_qc_query ? adns_qf_quoteok_query : 0) |
     (ov_qc_anshost ? adns_qf_quoteok_anshost : 0) |
     (ov_qc_cname ? 0 : adns_qf_quoteok_cname) |
-    ov_cname,
+    ov_cname | ov_addrfam,
     
   *qun_r= qun;
 }
   
+static void parse_ipaddr(const char *arg, adns_rr_addr *a) {
+  memset(a,0,sizeof(*a));
+  if (inet_aton(arg,&a->addr.inet.sin_addr)) {
+    a->addr.inet.sin_family= AF_INET;
+    a->len= sizeof(a->addr.inet);
+  } else if (inet_pton(AF_INET6,arg,&a->addr.inet6.sin6_addr) == 1) {
+    a->addr.inet6.sin6_family= AF_INET6;
+    a->len= sizeof(a->addr.inet6);
+  } else {
+    usageerr("invalid IP address %s",arg);
+  }
+}
+
 void of_ptr(const struct optioninfo *oi, const char *arg, const char *arg2) {
   struct query_node *qun;
   int quflags, r;
-  struct sockaddr_in sa;
+  adns_rr_addr sa;
 
-  memset(&sa,0,sizeof(sa));
-  sa.sin_family= AF_INET;
-  if (!inet_aton(arg,&sa.sin_addr)) usageerr("invalid IP address %s",arg);
+  parse_ipaddr(arg,&sa);
 
   prep_query(&qun,&quflags);
   qun->owner= xstrsave(arg);
   r= adns_submit_reverse(ads,
-			 (struct sockaddr*)&sa,
+			 &sa.addr.sa,
 			 ov_type == adns_r_none ? adns_r_ptr : ov_type,
 			 quflags,
 			 qun,
@@ -122,17 +133,15 @@ void of_ptr(const struct optioninfo *oi, const char *arg, const char *arg2) {
 void of_reverse(const struct optioninfo *oi, const char *arg, const char *arg2) {
   struct query_node *qun;
   int quflags, r;
-  struct sockaddr_in sa;
+  adns_rr_addr sa;
 
-  memset(&sa,0,sizeof(sa));
-  sa.sin_family= AF_INET;
-  if (!inet_aton(arg,&sa.sin_addr)) usageerr("invalid IP address %s",arg);
+  parse_ipaddr(arg,&sa);
 
   prep_query(&qun,&quflags);
   qun->owner= xmalloc(strlen(arg) + strlen(arg2) + 2);
   sprintf(qun->owner, "%s %s", arg,arg2);
   r= adns_submit_reverse_any(ads,
-			     (struct sockaddr*)&sa, arg2,
+			     &sa.addr.sa, arg2,
 			     ov_type == adns_r_none ? adns_r_txt : ov_type,
 			     quflags,
 			     qun,
@@ -37,6 +37,8 @@ static const char * const cvsid =
 
 #include <sys/types.h>
 #include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include <unistd.h>
 #include <string.h>
@@ -126,6 +128,27 @@ retry:
   return buf;
 }
 
+/*
+ * Parse an IPv6 address at the start of the line (where Apache and
+ * friends put the client address).
+ */
+static int ipv6addr(char *start, struct sockaddr_in6 *sa,
+		    char **addr, char **rest) {
+  char buf[INET6_ADDRSTRLEN];
+  char *p;
+
+  for (p= start; *p && !sensible_ctype(isspace,*p); p++);
+  if (p-start >= sizeof(buf) || !memchr(start,':',p-start)) return 0;
+  memcpy(buf, start, p-start);
+  buf[p-start]= 0;
+  memset(sa, 0, sizeof(*sa));
+  sa->sin6_family= AF_INET6;
+  if (inet_pton(AF_INET6, buf, &sa->sin6_addr) != 1) return 0;
+  *addr= start;
+  *rest= p;
+  return 1;
+}
+
 static void printline(FILE *outf, char *start, char *addr, char *rest, char *domain) {
   if (domain)
     fprintf(outf, "%.*s%s%s", (int)(addr - start), start, domain, rest);
@@ -144,6 +167,7 @@ static logline *readline(FILE *inf, adns_state adns, int opts) {
   static char buf[MAXLINE];
   char *str;
   logline *line;
+  struct sockaddr_in6 sa;
 
   if (fgets(buf, MAXLINE, inf)) {
     str= malloc(sizeof(*line) + strlen(buf) + 1);
@@ -152,6 +176,15 @@ static logline *readline(FILE *inf, adns_state adns, int opts) {
     line->next= NULL;
     line->start= str+sizeof(logline);
     strcpy(line->start, buf);
+    if (ipv6addr(line->start, &sa, &line->addr, &line->rest)) {
+      if (opts & OPT_DEBUG)
+	msg("submitting %.*s", (int)(line->rest-line->addr), line->addr);
+      if (adns_submit_reverse(adns, (struct sockaddr*)&sa, adns_r_ptr,
+			      adns_qf_quoteok_cname|adns_qf_cname_loose,
+			      NULL, &line->query))
+	aargh("adns_submit_reverse");
+      return line;
+    }
     str= ipaddr2domain(line->start, &line->addr, &line->rest);
     if (opts & OPT_DEBUG)
       msg("submitting %.*s -> %s", (int)(line->rest-line->addr), guard_null(line->addr), str);
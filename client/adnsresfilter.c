@@ -35,6 +35,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "config.h"
 #include "adns.h"
@@ -66,15 +68,20 @@ static struct { struct outqueuenode *head, *tail; } outqueue;
 static int peroutqueuenode, outqueuelen;
 
 static struct sockaddr_in sa;
+static struct sockaddr_in6 sa6;
 static adns_state ads;
 
-static char addrtextbuf[14];
+/* cbyte is the number of the IPv4 byte being read, or CBYTE_V6 if
+ * we are reading what may be an IPv6 address, or -1 if neither. */
+#define CBYTE_V6 4
+static char addrtextbuf[INET6_ADDRSTRLEN+1]; /* [<address>] */
 static int cbyte, inbyte, inbuf;
-static unsigned char bytes[4];
+static unsigned char bytes[16];
 static struct timeval printbefore;
 
 struct treething {
-  unsigned char bytes[4];
+  int af;
+  unsigned char bytes[16];
   adns_query qu;
   adns_answer *ans;
 };
@@ -301,10 +308,13 @@ static void restartbuf(void) {
 }
 
 static int comparer(const void *a, const void *b) {
-  return memcmp(a,b,4);
+  const struct treething *ta= a, *tb= b;
+
+  if (ta->af != tb->af) return ta->af - tb->af;
+  return memcmp(ta->bytes,tb->bytes,16);
 }
 
-static void procaddr(void) {
+static void procaddr(int af) {
   struct treething *foundthing;
   void **searchfound;
   struct outqueuenode *entry;
@@ -316,16 +326,24 @@ static void procaddr(void) {
     newthing->ans= 0;
   }
 
-  memcpy(newthing->bytes,bytes,4);
+  newthing->af= af;
+  memset(newthing->bytes,0,16);
+  memcpy(newthing->bytes,bytes,af==AF_INET ? 4 : 16);
   searchfound= tsearch(newthing,&treeroot,comparer);
   if (!searchfound) sysfail("tsearch");
   foundthing= *searchfound;
 
   if (foundthing == newthing) {
     newthing= 0;
-    memcpy(&sa.sin_addr,bytes,4);
-    r= adns_submit_reverse(ads, (const struct sockaddr*)&sa,
-			   rrt,0,foundthing,&foundthing->qu);
+    if (af == AF_INET) {
+      memcpy(&sa.sin_addr,bytes,4);
+      r= adns_submit_reverse(ads, (const struct sockaddr*)&sa,
+			     rrt,0,foundthing,&foundthing->qu);
+    } else {
+      memcpy(&sa6.sin6_addr,bytes,16);
+      r= adns_submit_reverse(ads, (const struct sockaddr*)&sa6,
+			     rrt,0,foundthing,&foundthing->qu);
+    }
     if (r) adnsfail("submit",r);
   }
   entry= xmalloc(sizeof(*entry));
@@ -346,6 +364,43 @@ static void startaddr(void) {
   inbyte= 0;
 }
 
+static void notaddr(int c) {
+  restartbuf();
+  queueoutchar(c);
+  cbyte= -1;
+  if (!bracket && !isalnum(c)) startaddr();
+}
+
+static void readv6char(int c) {
+  char text[INET6_ADDRSTRLEN];
+  int start, len;
+
+  if ((isxdigit(c) || c==':' || c=='.') && inbuf < sizeof(addrtextbuf)-1) {
+    addrtextbuf[inbuf++]= c;
+    return;
+  }
+  if (bracket ? c==']' : !isalnum(c)) {
+    start= bracket ? 1 : 0;
+    len= inbuf-start;
+    if (len < sizeof(text)) {
+      memcpy(text,addrtextbuf+start,len);
+      text[len]= 0;
+      if (inet_pton(AF_INET6,text,bytes) == 1) {
+	if (bracket) {
+	  addrtextbuf[inbuf++]= c;
+	  procaddr(AF_INET6);
+	} else {
+	  procaddr(AF_INET6);
+	  queueoutchar(c);
+	  startaddr();
+	}
+	return;
+      }
+    }
+  }
+  notaddr(c);
+}
+
 static void readstdin(void) {
   char readbuf[512], *p;
   int r, c, nbyte;
@@ -357,7 +412,9 @@ static void readstdin(void) {
   }
   for (p=readbuf; r>0; r--,p++) {
     c= *p;
-    if (cbyte==-1 && bracket && c=='[') {
+    if (cbyte==CBYTE_V6) {
+      readv6char(c);
+    } else if (cbyte==-1 && bracket && c=='[') {
       addrtextbuf[inbuf++]= c;
       startaddr();
     } else if (cbyte==-1 && !bracket && !isalnum(c)) {
@@ -374,16 +431,17 @@ static void readstdin(void) {
       inbyte= 0;
     } else if (cbyte==3 && inbyte>0 && bracket && c==']') {
       addrtextbuf[inbuf++]= c;
-      procaddr();
+      procaddr(AF_INET);
     } else if (cbyte==3 && inbyte>0 && !bracket && !isalnum(c)) {
-      procaddr();
+      procaddr(AF_INET);
       queueoutchar(c);
       startaddr();
+    } else if (cbyte==0 && (isxdigit(c) || c==':')) {
+      /* Not (yet) a dotted quad, but perhaps IPv6. */
+      addrtextbuf[inbuf++]= c;
+      cbyte= CBYTE_V6;
     } else {
-      restartbuf();
-      queueoutchar(c);
-      cbyte= -1;
-      if (!bracket && !isalnum(c)) startaddr();
+      notaddr(c);
     }
   }
 }
@@ -395,6 +453,8 @@ static void startup(void) {
   if (nonblock(1,1)) sysfail("set stdout to nonblocking mode");
   memset(&sa,0,sizeof(sa));
   sa.sin_family= AF_INET;
+  memset(&sa6,0,sizeof(sa6));
+  sa6.sin6_family= AF_INET6;
   if (config_text) {
     r= adns_init_strcfg(&ads,initflags,stderr,config_text);
   } else {
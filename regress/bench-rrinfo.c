@@ -0,0 +1,109 @@
+/*
+ * bench-rrinfo.c
+ * - benchmark for formatting RRs as text with adns_rr_info
+ *   (part of the test suite, not of the library)
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006  Ian Jackson
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* Prints the time per adns_rr_info call (including freeing the
+ * string) for a few types, and what was formatted.  Only the public
+ * interface is used, so this can be built against older versions of
+ * adns for comparison.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "adns.h"
+
+#define CALLS 1000000
+
+static void bench(const char *name, adns_rrtype type, const void *datap) {
+  clock_t c0;
+  char *data;
+  int i;
+
+  c0= clock();
+  for (i=0; i<CALLS; i++) {
+    if (adns_rr_info(type,0,0,0,datap,&data)) abort();
+    free(data);
+  }
+  if (adns_rr_info(type,0,0,0,datap,&data)) abort();
+  printf("%-10s %8.1f  %s\n", name,
+	 (double)(clock()-c0)/CLOCKS_PER_SEC*1e9/CALLS, data);
+  free(data);
+}
+
+int main(void) {
+  struct in_addr a;
+  adns_rr_addr addr;
+  adns_rr_soa soa;
+  adns_rr_srvraw srv;
+  adns_rr_intstr mx;
+  adns_rr_byteblock opaque;
+  unsigned char bytes[40];
+  int i;
+
+  printf("%-10s %8s  %s\n","type","ns/call","text");
+
+  inet_aton("172.18.45.6",&a);
+  bench("a",adns_r_a,&a);
+
+  memset(&addr,0,sizeof(addr));
+  addr.len= sizeof(addr.addr.inet);
+  addr.addr.inet.sin_family= AF_INET;
+  addr.addr.inet.sin_addr= a;
+  bench("addr",adns_r_addr,&addr);
+
+  soa.mname= (char*)"ns.example.org";
+  soa.rname= (char*)"hostmaster.example.org";
+  soa.serial= 2026101901;
+  soa.refresh= 3600;
+  soa.retry= 900;
+  soa.expire= 604800;
+  soa.minimum= 300;
+  bench("soa",adns_r_soa,&soa);
+
+  srv.priority= 10;
+  srv.weight= 66;
+  srv.port= 10066;
+  srv.host= (char*)"davenant.example.org";
+  bench("srv_raw",adns_r_srv_raw,&srv);
+
+  mx.i= 10;
+  mx.str= (char*)"mx.example.org";
+  bench("mx_raw",adns_r_mx_raw,&mx);
+
+  for (i=0; i<(int)sizeof(bytes); i++) bytes[i]= i*7;
+  opaque.len= sizeof(bytes);
+  opaque.data= bytes;
+  bench("opaque/40",adns_r_unknown|99,&opaque);
+
+  return 0;
+}
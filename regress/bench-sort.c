@@ -0,0 +1,105 @@
+/*
+ * bench-sort.c
+ * - benchmark for adns__sort against adns__isort
+ *   (part of the test suite, not of the library)
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006  Ian Jackson
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* Sorts arrays of records the size of an adns_rr_addr, with a
+ * comparison which (like the sortlist one) scans a 10-entry table,
+ * and prints the time per element for each sort.  To try another
+ * crossover, change SORTMERGEMIN in internal.h and rebuild.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "internal.h"
+
+#define RECSZ 20
+#define MAXN 448
+#define NSORTLIST 10
+#define ELEMENTS 2000000 /* sorted per size, per sort */
+
+static unsigned sortlist[NSORTLIST];
+
+static int precedence(unsigned x) {
+  int i;
+
+  for (i=0; i<NSORTLIST; i++)
+    if (!((x ^ sortlist[i]) & 0xffff0000U)) break;
+  return i;
+}
+
+static int needswap(void *context, const void *a, const void *b) {
+  unsigned x, y;
+  int px, py;
+
+  memcpy(&x,a,sizeof(x));
+  memcpy(&y,b,sizeof(y));
+  px= precedence(x);
+  py= precedence(y);
+  return px > py || (px == py && x > y);
+}
+
+typedef void sortfn(void *array, int nobjs, int sz, void *tempbuf,
+		    int (*needswap)(void *context, const void *a, const void *b),
+		    void *context);
+
+static double timesort(sortfn *sort, const byte *data, int n) {
+  static byte array[MAXN*RECSZ], tempbuf[MAXN*RECSZ];
+  clock_t c0;
+  int r, reps;
+
+  reps= ELEMENTS/n;
+  c0= clock();
+  for (r=0; r<reps; r++) {
+    memcpy(array, data + ((r*7)&63)*RECSZ, n*RECSZ);
+    sort(array,n,RECSZ,tempbuf,needswap,0);
+  }
+  return (double)(clock()-c0)/CLOCKS_PER_SEC*1e9/reps/n;
+}
+
+int main(void) {
+  static const int sizes[]= { 4, 8, 12, 16, 24, 32, 48, 64, 128, MAXN };
+  static byte data[(MAXN+64)*RECSZ];
+  unsigned v;
+  int i;
+
+  srand(1);
+  for (i=0; i<NSORTLIST; i++) sortlist[i]= rand();
+  for (i=0; i<MAXN+64; i++) {
+    v= i&1 ? sortlist[rand()%NSORTLIST] ^ (rand() & 0xffff) : rand();
+    memcpy(data + i*RECSZ, &v, sizeof(v));
+  }
+
+  printf("%5s %12s %12s   (ns per element, SORTMERGEMIN %d)\n",
+	 "n","adns__isort","adns__sort",SORTMERGEMIN);
+  for (i=0; i<(int)(sizeof(sizes)/sizeof(sizes[0])); i++)
+    printf("%5d %12.1f %12.1f\n", sizes[i],
+	   timesort(adns__isort,data,sizes[i]),
+	   timesort(adns__sort,data,sizes[i]));
+  return 0;
+}
@@ -0,0 +1,178 @@
+/*
+ * bench-tcpwrite.c
+ * - counts the system calls made to write queries over TCP
+ *   (part of the test suite, not of the library)
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006  Ian Jackson
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+/* Forks a nameserver on a loopback TCP port which answers every
+ * query with SERVFAIL, sends it NQUERIES queries with adns_qf_usevc,
+ * and prints how many times the library called each of the functions
+ * wrapped (with ld --wrap, see Makefile.in) below.  The library
+ * writes each query with one sendmsg where MSG_NOSIGNAL is available,
+ * and otherwise with writev between calls which block SIGPIPE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "adns.h"
+
+#define NQUERIES 12
+
+static int counting, nsigaction, nsigprocmask, nwrite, nwritev, nsendmsg;
+
+int __real_sigaction(int sig, const struct sigaction *act,
+		     struct sigaction *oact);
+int __real_sigprocmask(int how, const sigset_t *set, sigset_t *oset);
+ssize_t __real_write(int fd, const void *buf, size_t len);
+ssize_t __real_writev(int fd, const struct iovec *iov, int iovcnt);
+ssize_t __real_sendmsg(int fd, const struct msghdr *msg, int flags);
+
+int __wrap_sigaction(int sig, const struct sigaction *act,
+		     struct sigaction *oact) {
+  nsigaction+= counting;
+  return __real_sigaction(sig,act,oact);
+}
+
+int __wrap_sigprocmask(int how, const sigset_t *set, sigset_t *oset) {
+  nsigprocmask+= counting;
+  return __real_sigprocmask(how,set,oset);
+}
+
+ssize_t __wrap_write(int fd, const void *buf, size_t len) {
+  nwrite+= counting;
+  return __real_write(fd,buf,len);
+}
+
+ssize_t __wrap_writev(int fd, const struct iovec *iov, int iovcnt) {
+  nwritev+= counting;
+  return __real_writev(fd,iov,iovcnt);
+}
+
+ssize_t __wrap_sendmsg(int fd, const struct msghdr *msg, int flags) {
+  nsendmsg+= counting;
+  return __real_sendmsg(fd,msg,flags);
+}
+
+static void sysfail(const char *what) {
+  fprintf(stderr,"bench-tcpwrite: %s: %s\n",what,strerror(errno));
+  exit(2);
+}
+
+static int readall(int fd, unsigned char *buf, size_t len) {
+  ssize_t r;
+
+  while (len) {
+    r= read(fd,buf,len);
+    if (r<=0) return -1;
+    buf+= r; len-= r;
+  }
+  return 0;
+}
+
+static void server(int lfd) {
+  unsigned char buf[2+512];
+  size_t len;
+  ssize_t r;
+  int fd;
+
+  fd= accept(lfd,0,0);  if (fd<0) _exit(2);
+  for (;;) {
+    if (readall(fd,buf,2)) _exit(0);
+    len= (buf[0]<<8) | buf[1];
+    if (len<12 || len>sizeof(buf)-2) _exit(2);
+    if (readall(fd,buf+2,len)) _exit(2);
+    buf[2+2]= (buf[2+2] | 0x80) & ~0x02; /* QR, not TC */
+    buf[2+3]= 0x80 | 2; /* RA, SERVFAIL */
+    r= __real_write(fd,buf,2+len);
+    if (r != (ssize_t)(2+len)) _exit(2);
+  }
+}
+
+int main(void) {
+  struct sockaddr_in sin;
+  socklen_t sl;
+  adns_state ads;
+  adns_query qu;
+  adns_answer *ans;
+  char cfg[100], owner[30];
+  pid_t child;
+  int lfd, r, i, status;
+
+  lfd= socket(AF_INET,SOCK_STREAM,0);  if (lfd<0) sysfail("socket");
+  memset(&sin,0,sizeof(sin));
+  sin.sin_family= AF_INET;
+  sin.sin_addr.s_addr= htonl(INADDR_LOOPBACK);
+  if (bind(lfd,(struct sockaddr*)&sin,sizeof(sin))) sysfail("bind");
+  if (listen(lfd,1)) sysfail("listen");
+  sl= sizeof(sin);
+  if (getsockname(lfd,(struct sockaddr*)&sin,&sl)) sysfail("getsockname");
+
+  child= fork();  if (child<0) sysfail("fork");
+  if (!child) server(lfd);
+  close(lfd);
+
+  sprintf(cfg,"nameserver 127.0.0.1:%d\n",ntohs(sin.sin_port));
+  r= adns_init_strcfg(&ads,adns_if_noenv|adns_if_noautosys,stderr,cfg);
+  if (r) { errno= r; sysfail("adns_init_strcfg"); }
+
+  counting= 1;
+  for (i=0; i<NQUERIES; i++) {
+    sprintf(owner,"q%d.example.org",i);
+    r= adns_submit(ads,owner,adns_r_a,adns_qf_usevc,0,&qu);
+    if (r) { errno= r; sysfail("adns_submit"); }
+  }
+  for (i=0; i<NQUERIES; i++) {
+    qu= 0;
+    r= adns_wait(ads,&qu,&ans,0);
+    if (r) { errno= r; sysfail("adns_wait"); }
+    if (ans->status != adns_s_rcodeservfail) {
+      fprintf(stderr,"bench-tcpwrite: unexpected answer: %s\n",
+	      adns_strerror(ans->status));
+      exit(2);
+    }
+    free(ans);
+  }
+  counting= 0;
+
+  adns_finish(ads);
+  if (waitpid(child,&status,0) != child) sysfail("waitpid");
+  if (status) { fprintf(stderr,"bench-tcpwrite: server failed\n"); exit(2); }
+
+  printf("%d queries over TCP: sigaction %d, sigprocmask %d,"
+	 " write %d, writev %d, sendmsg %d\n",
+	 NQUERIES, nsigaction, nsigprocmask, nwrite, nwritev, nsendmsg);
+  return 0;
+}
@@ -10,7 +10,7 @@ void Qselect(	int max , const fd_set *rfds , const fd_set *wfds , const fd_set *
 #ifdef HAVE_POLL
 void Qpoll(	const struct pollfd *fds , int nfds , int timeout 	);
 #endif
-void Qsocket(	 int type 	);
+void Qsocket(	int domain , int type 	);
 void Qfcntl(	int fd , int cmd , long arg 	);
 void Qconnect(	int fd , const struct sockaddr *addr , int addrlen 	);
 void Qbind(	int fd , const struct sockaddr *addr , int addrlen 	);
@@ -41,4 +41,40 @@ void Tvba(const char *str);
 extern vbuf vb;
 extern struct timeval currenttime;
 extern const struct Terrno { const char *n; int v; } Terrnos[];
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+/* The io_uring adns uses is one of ours, not the kernel one: see
+ * hcommon.c.  Both are described by a Tringq. */
+struct Tringq {
+  byte *ring; /* SQ and CQ rings, in one mapping */
+  size_t ringsz;
+  struct io_uring_sqe *sqes;
+  size_t sqessz;
+  unsigned *sqhead, *sqtail, *sqarray, sqmask;
+  unsigned *cqhead, *cqtail, cqmask, cqentries;
+  struct io_uring_cqe *cqes;
+};
+extern struct Tring {
+  int fd; /* -1 if none */
+  struct Tringq q; /* what adns sees */
+  struct Tringq k; /* when recording, the kernel ring for the same fd */
+  unsigned kpending; /* when recording, entries in k not yet consumed */
+  struct io_uring_buf_ring *br; /* registered by adns */
+  unsigned brentries;
+  unsigned short brhead; /* when playing back, next buffer to use */
+  byte **kbufs; /* when recording, buffer address for each bid */
+  int recvnamelen; /* from the msghdr of the multishot receives */
+} Tring;
+void Qio_uring_setup(unsigned entries, void *params);
+void Qio_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args);
+void Qio_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		     unsigned flags);
+size_t Tringq_size(const struct io_uring_params *p);
+void Tringq_init(struct Tringq *q, byte *ring, struct io_uring_sqe *sqes,
+		 const struct io_uring_params *p);
+void Tring_setup(int fd, unsigned entries, void *params);
+void Tring_registered(const void *arg);
+struct io_uring_sqe *Tring_sqe(unsigned n);
+void Tring_postcqe(unsigned long long ud, int res, unsigned flags);
+#endif
 #endif
@@ -38,6 +38,11 @@ m4_include(hmacros.i4)
 #include <fcntl.h>
 
 #include "harness.h"
+
+#ifdef HAVE_IO_URING
+#include <stddef.h>
+#include <sys/mman.h>
+#endif
 #include "internal.h"
 
 vbuf vb;
@@ -46,6 +51,7 @@ struct timeval currenttime;
 
 const struct Terrno Terrnos[]= {
   { "EBADF",                     EBADF                        },
+  { "ECANCELED",                 ECANCELED                    },
   { "EAGAIN",                    EAGAIN                       },
   { "EINPROGRESS",               EINPROGRESS                  },
   { "EINTR",                     EINTR                        },
@@ -55,6 +61,7 @@ const struct Terrno Terrnos[]= {
   { "ENOENT",                    ENOENT                       },
   { "ENOPROTOOPT",               ENOPROTOOPT                  },
   { "ENOSPC",                    ENOSPC                       },
+  { "ENOSYS",                    ENOSYS                       },
   { "EWOULDBLOCK",               EWOULDBLOCK                  },
   { "EHOSTUNREACH",              EHOSTUNREACH                 },
   { "ECONNRESET",                ECONNRESET                   },
@@ -83,6 +90,231 @@ int Hwritev(int fd, const struct iovec *vector, size_t count) {
   return Hwrite(fd,vbw.buf,vbw.used);
 }
 
+ssize_t Hsendmsg(int fd, const struct msghdr *msg, int flags) {
+  /* Only the form used for TCP writes, which is a write
+   * that cannot raise SIGPIPE, so we record it as one. */
+  Tmust("sendmsg","flags",flags==MSG_NOSIGNAL);
+  Tmust("sendmsg","msg_name",!msg->msg_name);
+  Tmust("sendmsg","msg_control",!msg->msg_controllen);
+  return Hwritev(fd,msg->msg_iov,msg->msg_iovlen);
+}
+
+#ifdef HAVE_IO_URING
+
+/* The kernel reads and writes an io_uring behind our back, so adns
+ * is given a ring of ours instead (Tring.q), which changes only when
+ * adns makes a syscall.  The entries adns queues there are shown
+ * with the io_uring_enter which submits them.  When recording they
+ * are then copied to the kernel ring (Tring.k); the completions the
+ * kernel posts there are moved across, and shown as cqe lines after
+ * the reply to the syscall which collected them.  When playing back,
+ * the cqe lines are posted to Tring.q, and received datagrams put in
+ * the buffers adns has registered, as the kernel would.
+ */
+
+struct Tring Tring= { -1 };
+
+struct Tringhdr {
+  unsigned sqhead, sqtail, sqmask, sqentries, sqflags, sqdropped;
+  unsigned cqhead, cqtail, cqmask, cqentries, cqoverflow;
+};
+
+size_t Tringq_size(const struct io_uring_params *p) {
+  size_t sqsz, cqsz;
+
+  sqsz= p->sq_off.array + p->sq_entries*sizeof(unsigned);
+  cqsz= p->cq_off.cqes + p->cq_entries*sizeof(struct io_uring_cqe);
+  return sqsz > cqsz ? sqsz : cqsz;
+}
+
+void Tringq_init(struct Tringq *q, byte *ring, struct io_uring_sqe *sqes,
+		 const struct io_uring_params *p) {
+  q->ring= ring;
+  q->ringsz= Tringq_size(p);
+  q->sqes= sqes;
+  q->sqessz= p->sq_entries*sizeof(struct io_uring_sqe);
+  q->sqhead= (unsigned*)(ring + p->sq_off.head);
+  q->sqtail= (unsigned*)(ring + p->sq_off.tail);
+  q->sqarray= (unsigned*)(ring + p->sq_off.array);
+  q->sqmask= *(unsigned*)(ring + p->sq_off.ring_mask);
+  q->cqhead= (unsigned*)(ring + p->cq_off.head);
+  q->cqtail= (unsigned*)(ring + p->cq_off.tail);
+  q->cqmask= *(unsigned*)(ring + p->cq_off.ring_mask);
+  q->cqentries= p->cq_entries;
+  q->cqes= (struct io_uring_cqe*)(ring + p->cq_off.cqes);
+}
+
+void Tring_setup(int fd, unsigned entries, void *params) {
+  struct io_uring_params *p= params;
+  struct Tringhdr *h;
+  byte *ring;
+  void *sqes;
+
+  memset(p,0,sizeof(*p));
+  p->sq_entries= entries;
+  p->cq_entries= entries*2;
+  p->features= IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP;
+  p->sq_off.head= offsetof(struct Tringhdr,sqhead);
+  p->sq_off.tail= offsetof(struct Tringhdr,sqtail);
+  p->sq_off.ring_mask= offsetof(struct Tringhdr,sqmask);
+  p->sq_off.ring_entries= offsetof(struct Tringhdr,sqentries);
+  p->sq_off.flags= offsetof(struct Tringhdr,sqflags);
+  p->sq_off.dropped= offsetof(struct Tringhdr,sqdropped);
+  p->sq_off.array= sizeof(struct Tringhdr);
+  p->cq_off.head= offsetof(struct Tringhdr,cqhead);
+  p->cq_off.tail= offsetof(struct Tringhdr,cqtail);
+  p->cq_off.ring_mask= offsetof(struct Tringhdr,cqmask);
+  p->cq_off.ring_entries= offsetof(struct Tringhdr,cqentries);
+  p->cq_off.overflow= offsetof(struct Tringhdr,cqoverflow);
+  p->cq_off.cqes= (p->sq_off.array + entries*sizeof(unsigned) + 15) & ~15;
+
+  ring= calloc(1,Tringq_size(p));  if (!ring) Tnomem();
+  sqes= calloc(entries,sizeof(struct io_uring_sqe));  if (!sqes) Tnomem();
+  h= (struct Tringhdr*)ring;
+  h->sqmask= entries-1;
+  h->sqentries= entries;
+  h->cqmask= entries*2-1;
+  h->cqentries= entries*2;
+  Tringq_init(&Tring.q,ring,sqes,p);
+  Tring.fd= fd;
+}
+
+void Tring_registered(const void *arg) {
+  const struct io_uring_buf_reg *reg= arg;
+
+  Tring.br= (struct io_uring_buf_ring*)(unsigned long)reg->ring_addr;
+  Tring.brentries= reg->ring_entries;
+  Tring.brhead= 0;
+  free(Tring.kbufs);
+  Tring.kbufs= calloc(Tring.brentries,sizeof(*Tring.kbufs));
+  if (!Tring.kbufs) Tnomem();
+}
+
+struct io_uring_sqe *Tring_sqe(unsigned n) {
+  return &Tring.q.sqes[Tring.q.sqarray[n & Tring.q.sqmask] & Tring.q.sqmask];
+}
+
+void Tring_postcqe(unsigned long long ud, int res, unsigned flags) {
+  struct io_uring_cqe *cqe;
+  unsigned tail;
+
+  tail= *Tring.q.cqtail;
+  Tmust("io_uring","completion queue space",
+	tail - __atomic_load_n(Tring.q.cqhead,__ATOMIC_ACQUIRE)
+	< Tring.q.cqentries);
+  cqe= &Tring.q.cqes[tail & Tring.q.cqmask];
+  cqe->user_data= ud;
+  cqe->res= res;
+  cqe->flags= flags;
+  __atomic_store_n(Tring.q.cqtail,tail+1,__ATOMIC_RELEASE);
+}
+
+void *Hmmap(void *addr, size_t len, int prot, int flags, int fd, off_t off) {
+  if (fd < 0 || fd != Tring.fd) return mmap(addr,len,prot,flags,fd,off);
+  Tmust("mmap","flags",flags & MAP_SHARED);
+  if (off == IORING_OFF_SQ_RING) {
+    Tmust("mmap","len",len <= Tring.q.ringsz);
+    return Tring.q.ring;
+  }
+  Tmust("mmap","off",off == IORING_OFF_SQES);
+  Tmust("mmap","len",len <= Tring.q.sqessz);
+  return Tring.q.sqes;
+}
+
+int Hmunmap(void *addr, size_t len) {
+  if (addr && addr == Tring.q.ring) {
+    free(Tring.q.ring);  Tring.q.ring= 0;
+    if (Tring.k.ring) { munmap(Tring.k.ring,Tring.k.ringsz); Tring.k.ring= 0; }
+  } else if (addr && addr == Tring.q.sqes) {
+    free(Tring.q.sqes);  Tring.q.sqes= 0;
+    if (Tring.k.sqes) { munmap(Tring.k.sqes,Tring.k.sqessz); Tring.k.sqes= 0; }
+  } else {
+    return munmap(addr,len);
+  }
+  if (!Tring.q.ring && !Tring.q.sqes) {
+    free(Tring.kbufs);
+    memset(&Tring,0,sizeof(Tring));
+    Tring.fd= -1;
+  }
+  return 0;
+}
+
+void Qio_uring_setup(unsigned entries, void *params) {
+  const struct io_uring_params *p= params;
+
+  Tmust("io_uring_setup","flags",!p->flags);
+  Tmust("io_uring_setup","entries",entries && !(entries & (entries-1)));
+  vb.used= 0;
+  Tvbf("io_uring_setup entries=%u",entries);
+  Q_vb();
+}
+
+void Qio_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  const struct io_uring_buf_reg *reg= arg;
+
+  Tmust("io_uring_register","fd",fd == Tring.fd);
+  Tmust("io_uring_register","opcode",opcode == IORING_REGISTER_PBUF_RING);
+  Tmust("io_uring_register","nr_args",nr_args == 1);
+  Tmust("io_uring_register","ring_entries",
+	reg->ring_entries && !(reg->ring_entries & (reg->ring_entries-1)));
+  vb.used= 0;
+  Tvbf("io_uring_register fd=%d opcode=PBUF_RING entries=%u bgid=%u",
+       fd,reg->ring_entries,reg->bgid);
+  Q_vb();
+}
+
+static void Tvbsqe(const struct io_uring_sqe *sqe) {
+  const struct msghdr *msg= (const struct msghdr*)(unsigned long)sqe->addr;
+  unsigned long long ud= sqe->user_data;
+
+  Tvba("\n  sqe ");
+  switch (sqe->opcode) {
+  case IORING_OP_SENDMSG:
+    Tmust("io_uring_enter","sendmsg len",sqe->len == 1);
+    Tmust("io_uring_enter","sendmsg msg_flags",!sqe->msg_flags);
+    Tmust("io_uring_enter","sendmsg msg_iovlen",msg->msg_iovlen == 1);
+    Tmust("io_uring_enter","sendmsg msg_control",!msg->msg_controllen);
+    Tvbf("sendmsg fd=%d ud=%llu addr=",sqe->fd,ud);
+    Tvbaddr(msg->msg_name,msg->msg_namelen);
+    Tvbbytes(msg->msg_iov[0].iov_base,msg->msg_iov[0].iov_len);
+    break;
+  case IORING_OP_RECVMSG:
+    Tmust("io_uring_enter","recvmsg len",sqe->len == 1);
+    Tmust("io_uring_enter","recvmsg flags",sqe->flags == IOSQE_BUFFER_SELECT);
+    Tmust("io_uring_enter","recvmsg ioprio",
+	  sqe->ioprio == IORING_RECV_MULTISHOT);
+    Tmust("io_uring_enter","recvmsg msg_control",!msg->msg_controllen);
+    Tvbf("recvmsg fd=%d ud=%llu group=%u multishot",sqe->fd,ud,sqe->buf_group);
+    Tring.recvnamelen= msg->msg_namelen;
+    break;
+  case IORING_OP_ASYNC_CANCEL:
+    Tmust("io_uring_enter","cancel flags",
+	  sqe->cancel_flags == IORING_ASYNC_CANCEL_ANY);
+    Tvbf("cancel ud=%llu any",ud);
+    break;
+  default:
+    Tmust("io_uring_enter","opcode",0);
+  }
+}
+
+void Qio_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		     unsigned flags) {
+  unsigned head, i;
+
+  Tmust("io_uring_enter","fd",fd == Tring.fd);
+  Tmust("io_uring_enter","flags",!(flags & ~IORING_ENTER_GETEVENTS));
+  head= *Tring.q.sqhead;
+  Tmust("io_uring_enter","to_submit",
+	to_submit <= __atomic_load_n(Tring.q.sqtail,__ATOMIC_ACQUIRE) - head);
+  vb.used= 0;
+  Tvbf("io_uring_enter fd=%d to_submit=%u min_complete=%u flags=%s",
+       fd,to_submit,min_complete, flags ? "GETEVENTS" : "0");
+  for (i=0; i<to_submit; i++) Tvbsqe(Tring_sqe(head+i));
+  Q_vb();
+}
+
+#endif /* HAVE_IO_URING */
+
 m4_define(`hm_syscall', `
  hm_create_proto_q
 void Q$1(hm_args_massage($3,void)) {
@@ -98,6 +330,8 @@ void Q$1(hm_args_massage($3,void)) {
   if ($'`1) Tvbf(" $'`1=%ld.%06ld",(long)$'`1->tv_sec,(long)$'`1->tv_usec);
   else Tvba(" $'`1=null");')
  m4_define(`hm_arg_must', `')
+ m4_define(`hm_arg_domain', `
+  if ($'`1==AF_INET6) Tvba(" $'`1=AF_INET6");')
  m4_define(`hm_arg_socktype', `
   Tvbf($'`1==SOCK_STREAM ? " $'`1=SOCK_STREAM" : " $'`1=SOCK_DGRAM");')
  m4_define(`hm_arg_ign', `')
@@ -130,7 +364,17 @@ m4_include(`hsyscalls.i4')
 
 void Tvbaddr(const struct sockaddr *addr, int len) {
   const struct sockaddr_in *ai= (const struct sockaddr_in*)addr;
-  
+  const struct sockaddr_in6 *ai6= (const struct sockaddr_in6*)addr;
+  char buf[INET6_ADDRSTRLEN];
+
+  if (addr->sa_family == AF_INET6) {
+    assert(len==sizeof(struct sockaddr_in6));
+    inet_ntop(AF_INET6,&ai6->sin6_addr,buf,sizeof(buf));
+    Tvbf("[%s",buf);
+    if (ai6->sin6_scope_id) Tvbf("%%%lu",(unsigned long)ai6->sin6_scope_id);
+    Tvbf("]:%u",htons(ai6->sin6_port));
+    return;
+  }
   assert(len==sizeof(struct sockaddr_in));
   assert(ai->sin_family==AF_INET);
   Tvbf("%s:%u",inet_ntoa(ai->sin_addr),htons(ai->sin_port));
@@ -83,11 +83,20 @@ static int Perrno(const char *stuff) {
   if (*ep) Psyntax("errno value not recognised, not numeric");
   return r;
 }
+#ifdef HAVE_IO_URING
+static void Pcqe(void);
+#endif
 static void P_updatetime(void) {
   int chars;
   unsigned long sec, usec;
-  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
-  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
+  for (;;) {
+    if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
+    fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
+#ifdef HAVE_IO_URING
+    if (!memcmp(vb2.buf," cqe ",5)) { Pcqe(); continue; }
+#endif
+    break;
+  }
   chars= -1;
   sscanf(vb2.buf," +%lu.%lu%n",&sec,&usec,&chars);
   if (chars==-1) Psyntax("update time invalid");
@@ -154,20 +163,40 @@ static void Ppollfds(struct pollfd *fds, int nfds) {
 #endif
 static void Paddr(struct sockaddr *addr, int *lenr) {
   struct sockaddr_in *sa= (struct sockaddr_in*)addr;
-  char *p, *ep;
+  struct sockaddr_in6 *sa6= (struct sockaddr_in6*)addr;
+  char *p, *pct, *ep;
   long ul;
-  assert(*lenr >= sizeof(*sa));
-  p= strchr(vb2.buf+vb2.used,':');
-  if (!p) Psyntax("no port on address");
-  *p++= 0;
-  memset(sa,0,sizeof(*sa));
-  sa->sin_family= AF_INET;
-  if (!inet_aton(vb2.buf+vb2.used,&sa->sin_addr)) Psyntax("invalid address");
+  if (vb2.buf[vb2.used] == '[') {
+    assert(*lenr >= sizeof(*sa6));
+    p= strchr(vb2.buf+vb2.used,']');
+    if (!p || p[1] != ':') Psyntax("no ]: after IPv6 address");
+    *p= 0; p+= 2;
+    memset(sa6,0,sizeof(*sa6));
+    sa6->sin6_family= AF_INET6;
+    pct= strchr(vb2.buf+vb2.used,'%');
+    if (pct) {
+      *pct++= 0;
+      sa6->sin6_scope_id= strtoul(pct,&ep,10);
+      if (*ep) Psyntax("invalid scope on IPv6 address");
+    }
+    if (inet_pton(AF_INET6,vb2.buf+vb2.used+1,&sa6->sin6_addr) != 1)
+      Psyntax("invalid IPv6 address");
+    *lenr= sizeof(*sa6);
+  } else {
+    assert(*lenr >= sizeof(*sa));
+    p= strchr(vb2.buf+vb2.used,':');
+    if (!p) Psyntax("no port on address");
+    *p++= 0;
+    memset(sa,0,sizeof(*sa));
+    sa->sin_family= AF_INET;
+    if (!inet_aton(vb2.buf+vb2.used,&sa->sin_addr)) Psyntax("invalid address");
+    *lenr= sizeof(*sa);
+  }
   ul= strtoul(p,&ep,10);
   if (*ep && *ep != ' ') Psyntax("invalid port (bad syntax)");
   if (ul >= 65536) Psyntax("port too large");
-  sa->sin_port= htons(ul);
-  *lenr= sizeof(*sa);
+  if (addr->sa_family == AF_INET6) sa6->sin6_port= htons(ul);
+  else sa->sin_port= htons(ul);
   vb2.used= ep - (char*)vb2.buf;
 }
 static int Pbytes(byte *buf, int maxlen) {
@@ -212,12 +241,142 @@ void Q_vb(void) {
             "adns test harness: program did unexpected:\n %.*s\n"
             "was expecting:\n %.*s\n",
             vb.used,vb.buf, vb.used,vb2.buf+1);
+#ifndef HAVE_IO_URING
+    if (!memcmp(vb2.buf+1,"io_uring_",9)) exit(5); /* built without it */
+#endif
     exit(1);
   }
   Tensurereportfile();
   nl= memchr(vb.buf,'\n',vb.used);
   fprintf(Treportfile," %.*s\n", (int)(nl ? nl - (const char*)vb.buf : vb.used), vb.buf);
 }
+#ifdef HAVE_IO_URING
+static int Pring_reply(const char *call) {
+  /* Reads the reply to one of the io_uring syscalls, which is an
+   * errno value (we return -1 and set errno), OK (0) or a number. */
+  int amtread, l, r, e;
+  char *ep;
+  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
+  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
+  Tensurereportfile();
+  fprintf(Treportfile,"%s",vb2.buf);
+  amtread= strlen(vb2.buf);
+  if (amtread<=0 || vb2.buf[--amtread]!='\n')
+    Psyntax("badly formed line");
+  vb2.buf[amtread]= 0;
+  l= strlen(call);
+  if (vb2.buf[0] != ' ' || memcmp(vb2.buf+1,call,l) ||
+      vb2.buf[l+1] != '=')
+    Psyntax("syscall reply mismatch");
+  vb2.used= l+2;
+  if (vb2.buf[vb2.used] == 'E') {
+    e= Perrno(vb2.buf+vb2.used);
+    P_updatetime();
+    errno= e;
+    return -1;
+  }
+  if (Pstring_maybe("OK")) {
+    r= 0;
+  } else {
+    r= strtoul(vb2.buf+vb2.used,&ep,10);
+    if (ep == (char*)vb2.buf+vb2.used)
+      Psyntax("return value not E*, OK or positive number");
+    vb2.used= ep - (char*)vb2.buf;
+  }
+  if (vb2.used != amtread) Psyntax("junk at end of line");
+  P_updatetime();
+  return r;
+}
+static void Pcqe(void) {
+  /* vb2 has a cqe line, which we post to the ring; if it is for a
+   * received datagram it is followed by the bytes, which we put in
+   * the next buffer from the ring adns registered. */
+  adns__sockaddr addr;
+  struct io_uring_recvmsg_out *out;
+  struct io_uring_buf *b;
+  unsigned long long ud;
+  unsigned flags;
+  int amtread, addrlen, hdrlen, res;
+  byte *buf;
+  char *ep;
+  Tensurereportfile();
+  fprintf(Treportfile,"%s",vb2.buf);
+  amtread= strlen(vb2.buf);
+  if (amtread<=0 || vb2.buf[--amtread]!='\n')
+    Psyntax("badly formed cqe line");
+  vb2.buf[amtread]= 0;
+  vb2.used= 4;
+  Parg("ud");
+  ud= strtoull(vb2.buf+vb2.used,&ep,10);
+  if (ep == (char*)vb2.buf+vb2.used) Psyntax("cqe ud not a number");
+  vb2.used= ep - (char*)vb2.buf;
+  flags= 0;
+  res= 0;
+  if (Pstring_maybe(" res=")) {
+    if (vb2.buf[vb2.used] == 'E') {
+      ep= strchr(vb2.buf+vb2.used,' ');
+      if (ep) *ep= 0;
+      res= -Perrno(vb2.buf+vb2.used);
+      if (ep) { *ep= ' '; vb2.used= ep - (char*)vb2.buf; }
+      else vb2.used= amtread;
+    } else {
+      res= strtoul(vb2.buf+vb2.used,&ep,10);
+      if (ep == (char*)vb2.buf+vb2.used) Psyntax("cqe res not E* or number");
+      vb2.used= ep - (char*)vb2.buf;
+    }
+  }
+  if (Pstring_maybe(" more")) flags |= IORING_CQE_F_MORE;
+  if (!Pstring_maybe(" from=")) {
+    if (vb2.used != amtread) Psyntax("junk at end of cqe line");
+    Tring_postcqe(ud,res,flags);
+    return;
+  }
+  addrlen= sizeof(addr);
+  Paddr(&addr.sa,&addrlen);
+  if (vb2.used != amtread) Psyntax("junk at end of cqe line");
+  Tmust("io_uring","buffer ring registered",Tring.br != 0);
+  Tmust("io_uring","buffer available",
+	Tring.brhead != __atomic_load_n(&Tring.br->tail,__ATOMIC_ACQUIRE));
+  b= &Tring.br->bufs[Tring.brhead++ & (Tring.brentries-1)];
+  buf= (byte*)(unsigned long)b->addr;
+  hdrlen= sizeof(*out) + Tring.recvnamelen;
+  Tmust("io_uring","buffer size",b->len >= hdrlen);
+  out= (struct io_uring_recvmsg_out*)buf;
+  memset(buf,0,hdrlen);
+  memcpy(buf+sizeof(*out),&addr,
+	 addrlen < Tring.recvnamelen ? addrlen : Tring.recvnamelen);
+  out->namelen= addrlen;
+  out->payloadlen= Pbytes(buf+hdrlen,b->len-hdrlen);
+  res= hdrlen + out->payloadlen;
+  flags |= IORING_CQE_F_BUFFER | (b->bid << IORING_CQE_BUFFER_SHIFT);
+  Tring_postcqe(ud,res,flags);
+}
+int Hio_uring_setup(unsigned entries, void *params) {
+  int r;
+  Qio_uring_setup(entries,params);
+  r= Pring_reply("io_uring_setup");
+  if (r >= 0) Tring_setup(r,entries,params);
+  return r;
+}
+int Hio_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  int r;
+  Qio_uring_register(fd,opcode,arg,nr_args);
+  r= Pring_reply("io_uring_register");
+  if (!r) Tring_registered(arg);
+  return r;
+}
+int Hio_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		    unsigned flags) {
+  int r;
+  Qio_uring_enter(fd,to_submit,min_complete,flags);
+  r= Pring_reply("io_uring_enter");
+  if (r > 0) {
+    Tmust("io_uring_enter","return",(unsigned)r <= to_submit);
+    __atomic_store_n(Tring.q.sqhead,*Tring.q.sqhead + r,__ATOMIC_RELEASE);
+  }
+  return r;
+}
+#endif /* HAVE_IO_URING */
 int Hselect(	int max , fd_set *rfds , fd_set *wfds , fd_set *efds , struct timeval *to 	) {
  int r, amtread;
  char *ep;
@@ -283,9 +442,9 @@ int Hpoll(	struct pollfd *fds , int nfds , int timeout 	) {
 int Hsocket(	int domain , int type , int protocol 	) {
  int r, amtread;
  char *ep;
-	Tmust("socket","domain",domain==AF_INET); 
+  Tmust("socket","domain",domain==AF_INET || domain==AF_INET6); 
   Tmust("socket","type",type==SOCK_STREAM || type==SOCK_DGRAM); 
- Qsocket(	 type 	);
+ Qsocket(	domain , type 	);
  if (!adns__vbuf_ensure(&vb2,1000)) Tnomem();
  fgets(vb2.buf,vb2.avail,Tinputfile); Pcheckinput();
  Tensurereportfile();
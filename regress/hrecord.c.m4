@@ -35,6 +35,11 @@ m4_include(hmacros.i4)
 
 #include "harness.h"
 
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
 static FILE *Toutputfile;
 
 void Tshutdown(void) {
@@ -82,6 +87,183 @@ static void R_vb(void) {
   Q_vb();
 }
 
+#ifdef HAVE_IO_URING
+
+static int R_ringready; /* the kernel ring has completions for us */
+
+static void R_ringfdset(const fd_set *fds) {
+  if (Tring.fd >= 0 && FD_ISSET(Tring.fd,fds)) R_ringready= 1;
+}
+
+#ifdef HAVE_POLL
+static void R_ringpollfds(const struct pollfd *fds, int nfds) {
+  for (; nfds>0; fds++, nfds--)
+    if (Tring.fd >= 0 && fds->fd == Tring.fd && (fds->revents & POLLIN))
+      R_ringready= 1;
+}
+#endif
+
+static void R_ringharvest(void) {
+  /* Moves the completions from the kernel ring to ours, showing them
+   * in vb.  We do this only when adns has seen (or waited for) the
+   * kernel ring become readable, since otherwise it would not look
+   * at ours either. */
+  const struct io_uring_recvmsg_out *out;
+  const struct io_uring_cqe *cqe;
+  struct io_uring_buf *b;
+  unsigned head, flags, i;
+  const byte *buf, *payload;
+  int payloadlen;
+
+  if (!R_ringready) return;
+  R_ringready= 0;
+  if (Tring.br) {
+    for (i=0; i<Tring.brentries; i++) {
+      b= &Tring.br->bufs[i];
+      if (b->bid < Tring.brentries)
+	Tring.kbufs[b->bid]= (byte*)(unsigned long)b->addr;
+    }
+  }
+  for (;;) {
+    head= *Tring.k.cqhead;
+    if (head == __atomic_load_n(Tring.k.cqtail,__ATOMIC_ACQUIRE)) break;
+    cqe= &Tring.k.cqes[head & Tring.k.cqmask];
+    flags= cqe->flags & (IORING_CQE_F_BUFFER | IORING_CQE_F_MORE);
+    Tvbf("\n cqe ud=%llu",(unsigned long long)cqe->user_data);
+    if (!(flags & IORING_CQE_F_BUFFER)) {
+      Tvba(" res=");
+      if (cqe->res < 0) Tvberrno(-cqe->res);
+      else Tvbf("%d",cqe->res);
+    }
+    if (flags & IORING_CQE_F_MORE) Tvba(" more");
+    if (flags & IORING_CQE_F_BUFFER) {
+      i= cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      flags |= i << IORING_CQE_BUFFER_SHIFT;
+      Tmust("io_uring","bid",i < Tring.brentries && Tring.kbufs[i]);
+      buf= Tring.kbufs[i];
+      out= (const struct io_uring_recvmsg_out*)buf;
+      payload= buf + sizeof(*out) + Tring.recvnamelen;
+      Tmust("io_uring","recvmsg res",cqe->res >= payload-buf);
+      payloadlen= out->payloadlen;
+      if (payloadlen > buf+cqe->res-payload) payloadlen= buf+cqe->res-payload;
+      Tvba(" from=");
+      Tvbaddr((const struct sockaddr*)(buf+sizeof(*out)),out->namelen);
+      Tvbbytes(payload,payloadlen);
+    }
+    Tring_postcqe(cqe->user_data,cqe->res,flags);
+    __atomic_store_n(Tring.k.cqhead,head+1,__ATOMIC_RELEASE);
+  }
+}
+
+int Hio_uring_setup(unsigned entries, void *params) {
+  struct io_uring_params kp;
+  byte *ring;
+  void *sqes;
+  int fd, e;
+
+  Qio_uring_setup(entries,params);
+  memset(&kp,0,sizeof(kp));
+  fd= syscall(__NR_io_uring_setup,entries,&kp);
+  e= errno;
+
+  vb.used= 0;
+  Tvba("io_uring_setup=");
+  if (fd<0) { Tvberrno(e); goto x_error; }
+  Tmust("io_uring_setup","features",
+	(kp.features & IORING_FEAT_SINGLE_MMAP) &&
+	(kp.features & IORING_FEAT_NODROP));
+  ring= mmap(0,Tringq_size(&kp),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+	     fd,IORING_OFF_SQ_RING);
+  if (ring == MAP_FAILED) Tfailed("mmap io_uring rings");
+  sqes= mmap(0,kp.sq_entries*sizeof(struct io_uring_sqe),
+	     PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,fd,IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) Tfailed("mmap io_uring sqes");
+  Tringq_init(&Tring.k,ring,sqes,&kp);
+  Tring.kpending= 0;
+  Tring_setup(fd,entries,params);
+  Tvbf("%d",fd);
+
+ x_error:
+  R_recordtime();
+  R_vb();
+  errno= e;
+  return fd;
+}
+
+int Hio_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  int r, e;
+
+  Qio_uring_register(fd,opcode,arg,nr_args);
+  r= syscall(__NR_io_uring_register,fd,opcode,arg,nr_args);
+  e= errno;
+
+  vb.used= 0;
+  Tvba("io_uring_register=");
+  if (r) {
+    Tvberrno(e);
+  } else {
+    Tvba("OK");
+    Tring_registered(arg);
+  }
+  R_recordtime();
+  R_vb();
+  errno= e;
+  return r;
+}
+
+int Hio_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		    unsigned flags) {
+  unsigned head, khead, ktail, i;
+  int r, e;
+
+  Qio_uring_enter(fd,to_submit,min_complete,flags);
+
+  /* Copy what the kernel ring does not already have. */
+  head= *Tring.q.sqhead;
+  Tmust("io_uring_enter","to_submit",to_submit >= Tring.kpending);
+  ktail= *Tring.k.sqtail;
+  for (i=Tring.kpending; i<to_submit; i++) {
+    Tring.k.sqes[ktail & Tring.k.sqmask]= *Tring_sqe(head+i);
+    Tring.k.sqarray[ktail & Tring.k.sqmask]= ktail & Tring.k.sqmask;
+    ktail++;
+  }
+  __atomic_store_n(Tring.k.sqtail,ktail,__ATOMIC_RELEASE);
+  Tring.kpending= to_submit;
+
+  khead= __atomic_load_n(Tring.k.sqhead,__ATOMIC_ACQUIRE);
+  r= syscall(__NR_io_uring_enter,fd,to_submit,min_complete,flags,
+	     (void*)0,(size_t)0);
+  e= errno;
+  i= __atomic_load_n(Tring.k.sqhead,__ATOMIC_ACQUIRE) - khead;
+  Tring.kpending -= i;
+  __atomic_store_n(Tring.q.sqhead,head+i,__ATOMIC_RELEASE);
+
+  vb.used= 0;
+  Tvba("io_uring_enter=");
+  if (r<0) {
+    Tvberrno(e);
+  } else {
+    Tmust("io_uring_enter","return",(unsigned)r == i);
+    Tvbf("%d",r);
+    if (flags & IORING_ENTER_GETEVENTS) R_ringready= 1;
+  }
+  R_ringharvest();
+  R_recordtime();
+  R_vb();
+  errno= e;
+  return r;
+}
+
+#else /* !HAVE_IO_URING */
+
+static void R_ringfdset(const fd_set *fds) { }
+#ifdef HAVE_POLL
+static void R_ringpollfds(const struct pollfd *fds, int nfds) { }
+#endif
+static void R_ringharvest(void) { }
+
+#endif /* HAVE_IO_URING */
+
 m4_define(`hm_syscall', `
  hm_create_proto_h
 int H$1(hm_args_massage($3,void)) {
@@ -146,6 +328,12 @@ int H$1(hm_args_massage($3,void)) {
  m4_define(`hm_rv_must',`')
  $2
 
+ hm_create_nothing
+ m4_define(`hm_arg_fdset_io',`if (r>0) R_ringfdset($'`1);')
+ m4_define(`hm_arg_pollfds_io',`if (r>0) R_ringpollfds($'`1,$'`2);')
+ $3
+ R_ringharvest();
+
  R_recordtime();
  R_vb();
  errno= e;
@@ -29,6 +29,18 @@
 #define write Hwrite
 #undef writev
 #define writev Hwritev
+#undef sendmsg
+#define sendmsg Hsendmsg
+#undef io_uring_setup
+#define io_uring_setup Hio_uring_setup
+#undef io_uring_enter
+#define io_uring_enter Hio_uring_enter
+#undef io_uring_register
+#define io_uring_register Hio_uring_register
+#undef mmap
+#define mmap Hmmap
+#undef munmap
+#define munmap Hmunmap
 #undef gettimeofday
 #define gettimeofday Hgettimeofday
 #undef getpid
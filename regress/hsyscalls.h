@@ -23,6 +23,12 @@ int Hrecvfrom(	int fd , void *buf , int buflen , unsigned int flags , struct soc
 int Hread(	int fd , void *buf , size_t buflen 	);
 int Hwrite(	int fd , const void *buf , size_t len 	);
 int Hwritev(int fd, const struct iovec *vector, size_t count);
+ssize_t Hsendmsg(int fd, const struct msghdr *msg, int flags);
+int Hio_uring_setup(unsigned entries, void *params);
+int Hio_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags);
+int Hio_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args);
+void* Hmmap(void *addr, size_t len, int prot, int flags, int fd, off_t off);
+int Hmunmap(void *addr, size_t len);
 int Hgettimeofday(struct timeval *tv, struct timezone *tz);
 pid_t Hgetpid(void);
 void* Hmalloc(size_t sz);
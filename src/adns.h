@@ -101,6 +101,9 @@ typedef enum { /* In general, or together the desired flags: */
  adns_qf_quotefail_cname=0x00000080,/* refuse if quote-req chars in CNAME we go via */
  adns_qf_cname_loose=    0x00000100,/* allow refs to CNAMEs - without, get _s_cname */
  adns_qf_cname_forbid=   0x00000200,/* don't follow CNAMEs, instead give _s_cname */
+ adns_qf_want_ipv4=      0x00000400,/* addr: want IPv4 (A) addresses */
+ adns_qf_want_ipv6=      0x00000800,/* addr: want IPv6 (AAAA) addresses */
+ adns_qf_want_allaf=     0x00000c00,/* addr: want both, looked up in parallel */
  adns__qf_internalmask=  0x0ff00000
 } adns_queryflags;
 
@@ -152,6 +155,8 @@ typedef enum {
  adns_r_rp_raw=          17,
  adns_r_rp=                  adns_r_rp_raw|adns__qtf_mail822,
 
+ adns_r_aaaa=            28,
+
  /* For SRV records, query domain without _qf_quoteok_query must look
   * as expected from SRV RFC with hostname-like Name.  _With_
   * _quoteok_query, any query domain is allowed. */
@@ -194,6 +199,18 @@ typedef enum {
  * default if quote-requiring characters are found.
  */
 
+/*
+ * adns_qf_want_ipv4 and _ipv6 say which kinds of address you want
+ * from adns_r_addr and from the +addr types (adns_r_ns, _mx and
+ * _srv).  If neither is set you get only IPv4 addresses, as in
+ * earlier versions.  If you ask for IPv6 addresses the A and/or AAAA
+ * queries are made in parallel and their answers merged into one
+ * array of adns_rr_addr (IPv4 addresses first, unless the sortlist
+ * says otherwise).  If neither query finds an address the status is
+ * that of the less permanent failure, and adns_s_nodata is preferred
+ * to adns_s_nxdomain.  The flags have no effect on other types.
+ */
+
 /*
  * If you ask for an RR which contains domains which are actually
  * encoded mailboxes, and don't ask for the _raw version, then adns
@@ -287,6 +304,7 @@ typedef struct {
   union {
     struct sockaddr sa;
     struct sockaddr_in inet;
+    struct sockaddr_in6 inet6;
   } addr;
 } adns_rr_addr;
 
@@ -355,6 +373,7 @@ typedef struct {
     adns_rr_intstr *(*manyistr);     /* txt (list strs ends with i=-1, str=0)*/
     adns_rr_addr *addr;              /* addr */
     struct in_addr *inaddr;          /* a */
+    struct in6_addr *in6addr;        /* aaaa */
     adns_rr_hostaddr *hostaddr;      /* ns */
     adns_rr_intstrpair *intstrpair;  /* hinfo */
     adns_rr_strpair *strpair;        /* rp, rp_raw */
@@ -371,7 +390,11 @@ typedef struct {
  *  adns_state and adns_query are actually pointers to malloc'd state;
  *  On submission questions are copied, including the owner domain;
  *  Answers are malloc'd as a single piece of memory; pointers in the
- *  answer struct point into further memory in the answer.
+ *  answer struct point into further memory in the answer.  They may
+ *  be freed with free() (or adns_free_answer, which is required if
+ *  the state was made with adns_init_allocator), or handed back with
+ *  adns_answer_release so that the memory can be reused for later
+ *  answers.
  * query_io:
  *  Must always be non-null pointer;
  *  If *query_io is 0 to start with then any query may be returned;
@@ -432,6 +455,26 @@ int adns_init_logfn(adns_state *newstate_r, adns_initflags flags,
 		    adns_logcallbackfn *logfn /*0=>logfndata is a FILE* */,
 		    void *logfndata /*0 with logfn==0 => discard*/);
 
+typedef struct {
+  void *(*mallocfn)(void *ctx, size_t sz);
+  void *(*reallocfn)(void *ctx, void *ptr, size_t sz);
+  void (*freefn)(void *ctx, void *ptr);
+  void *ctx;
+} adns_allocator;
+
+int adns_init_allocator(adns_state *newstate_r, adns_initflags flags,
+			const char *configtext /*0=>use default config files*/,
+			adns_logcallbackfn *logfn /*0=>logfndata is a FILE* */,
+			void *logfndata /*0 with logfn==0 => discard*/,
+			const adns_allocator *allocator /*0=>libc*/);
+  /* Like adns_init_logfn, but all the memory for the new adns_state,
+   * including the answers returned by _check, _wait et al, is
+   * obtained from *allocator (which is copied).  The functions must
+   * behave like malloc, realloc and free and must set errno on
+   * failure; freefn is never passed a null pointer.  All three must
+   * be supplied, or you get EINVAL.  Answers must then be disposed
+   * of with adns_free_answer or adns_answer_release, not free(). */
+
 /* Configuration:
  *  adns_init reads /etc/resolv.conf, which is expected to be (broadly
  *  speaking) in the format expected by libresolv, and then
@@ -442,11 +485,23 @@ int adns_init_logfn(adns_state *newstate_r, adns_initflags flags,
  *
  * Standard directives understood in resolv[-adns].conf:
  * 
- *  nameserver <address>
- *   Must be followed by the IP address of a nameserver.  Several
- *   nameservers may be specified, and they will be tried in the order
- *   found.  There is a compiled in limit, currently 5, on the number
- *   of nameservers.  (libresolv supports only 3 nameservers.)
+ *  nameserver <address> [source <address>] [interface <name>]
+ *   Must be followed by the IP address (IPv4 or IPv6) of a nameserver.
+ *   Several nameservers may be specified, and they will be tried in
+ *   the order found.  There is a compiled in limit, currently 5, on
+ *   the number of nameservers.  (libresolv supports only 3
+ *   nameservers.)
+ *   adns also accepts a port other than 53, as <ipv4-address>:<port>
+ *   or [<ipv6-address>]:<port>; replies must come from the same
+ *   address and port.  `source' binds the sockets used for this
+ *   server to a local address (of the same family, without a port),
+ *   and `interface' to a network interface (where supported, and
+ *   usually needing privilege).  Each server with either of these
+ *   has its own UDP socket, which adns_beforepoll &c will return.
+ *   An IPv6 address may have a %<interface> suffix (a name or number)
+ *   giving its scope, eg fe80::1%eth0; a link-local address without
+ *   one takes its scope from `interface', if given.  Without a scope
+ *   replies are accepted whatever interface they arrive on.
  *
  *  search <domain> ...
  *   Specifies the search list for queries which specify
@@ -464,9 +519,10 @@ int adns_init_logfn(adns_state *newstate_r, adns_initflags flags,
  *  sortlist <addr>/<mask> ...
  *   Should be followed by a sequence of IP-address and netmask pairs,
  *   separated by spaces.  They may be specified as
- *   eg. 172.30.206.0/24 or 172.30.206.0/255.255.255.0.  Currently up
- *   to 15 pairs may be specified (but note that libresolv only
- *   supports up to 10).
+ *   eg. 172.30.206.0/24 or 172.30.206.0/255.255.255.0; masks must be
+ *   contiguous.  IPv6 prefixes may be given too, eg 2001:db8::/32.
+ *   There is no limit on the number of pairs (but note that libresolv
+ *   only supports up to 10).
  *
  *  options
  *   Should followed by one or more options, separated by spaces.
@@ -505,6 +561,71 @@ int adns_init_logfn(adns_state *newstate_r, adns_initflags flags,
  *   Changes the consistency checking frequency; this overrides the
  *   setting of adns_if_check_entex, adns_if_check_freq, or neither,
  *   in the flags passed to adns_init.
+ *
+ *  adns_answerpool:<count>
+ *   Limits the number of answers given back by adns_answer_release
+ *   which are kept for reuse rather than freed.  The default is 256;
+ *   no more are ever kept than the largest number of queries which
+ *   have been outstanding at once.
+ *
+ *  adns_tcpconns:<count>
+ *   Allows up to <count> (at most 8) TCP connections to be open at
+ *   once.  Queries which need TCP are given to the connection with
+ *   fewest outstanding; a new connection is made (to the current
+ *   server) only when all the open ones are busy.  The default is 1.
+ *   <count> is a limit on the total, not per server: all the
+ *   connections go to the same nameserver, and the load is not
+ *   spread over the others, which are only used (as without this
+ *   option) when connecting to or talking to that one fails.
+ *
+ *  adns_tcpfastopen
+ *   Use TCP Fast Open (where the system supports it) for connections
+ *   to nameservers, so that once a server has given us a cookie, the
+ *   first request on a new connection is sent along with the SYN.
+ *
+ *  adns_tcpprewarm
+ *   Start connecting to the first nameserver when the adns_state is
+ *   initialised, rather than waiting until a query needs TCP.  The
+ *   connection is closed again if it is idle for a while.
+ *
+ *  adns_tcpwait:<ms>
+ *  adns_tcpconnect:<ms>
+ *  adns_tcpidle:<ms>
+ *   How long a query may wait for an answer over TCP (default 30000),
+ *   how long a TCP connection may take to be established (14000), and
+ *   how long an idle TCP connection is kept open (30000); see also
+ *   adns_tcptimeouts.
+ *
+ *  adns_tcpinflight:<count>
+ *   Sends no more than <count> queries at once on each TCP connection;
+ *   the rest wait, unsent, until replies arrive (and new queries go
+ *   to another connection, if adns_tcpconns: allows).  Replies may
+ *   come in any order.  The default, 0, means no limit.
+ *
+ *  adns_keepalive
+ *   Ask in each query sent over TCP (with an EDNS0 OPT record) for the
+ *   server's edns-tcp-keepalive idle timeout (RFC7828), and when it
+ *   gives one use it instead of adns_tcpidle: for that connection.
+ *   Only use this if all the nameservers understand EDNS0: others
+ *   may answer with a format error.
+ *
+ *  adns_udprcvbuf:<bytes>
+ *  adns_udpsndbuf:<bytes>
+ *   Sets the kernel's receive and send buffer sizes (SO_RCVBUF and
+ *   SO_SNDBUF) for adns's UDP sockets; the system may limit these.
+ *   A large receive buffer helps when many replies arrive at once.
+ *   The default, 0, leaves the system default alone.
+ *
+ *  adns_udpdrops
+ *   Count the replies which the kernel drops because a UDP receive
+ *   buffer is full; see adns_udpdrops.  This needs SO_RXQ_OVFL, and
+ *   on other systems the option is a configuration error.
+ *
+ *  adns_uring
+ *   Send and receive UDP datagrams via an io_uring (on Linux 6.0 or
+ *   later, if adns was built with support for it), rather than with
+ *   a system call each; see adns_uring_process.  If the ring cannot
+ *   be set up adns carries on as normal.  TCP is unaffected.
  * 
  * There are a number of environment variables which can modify the
  * behaviour of adns.  They take effect only if adns_init is used, and
@@ -589,7 +710,9 @@ int adns_submit_reverse(adns_state ads,
 			void *context,
 			adns_query *query_r);
 /* type must be _r_ptr or _r_ptr_raw.  _qf_search is ignored.
- * addr->sa_family must be AF_INET or you get ENOSYS.
+ * addr->sa_family must be AF_INET (looked up in in-addr.arpa) or
+ * AF_INET6 (looked up in ip6.arpa), or you get ENOSYS.  For _r_ptr
+ * the name found is checked with an A or AAAA query respectively.
  */
 
 int adns_submit_reverse_any(adns_state ads,
@@ -602,7 +725,9 @@ int adns_submit_reverse_any(adns_state ads,
 /* For RBL-style reverse `zone's; look up
  *   <reversed-address>.<zone>
  * Any type is allowed.  _qf_search is ignored.
- * addr->sa_family must be AF_INET or you get ENOSYS.
+ * addr->sa_family must be AF_INET or AF_INET6 or you get ENOSYS.
+ * For AF_INET6 the reversed address is the 32 hex nibbles, least
+ * significant first, as for ip6.arpa.
  */
 
 void adns_finish(adns_state ads);
@@ -610,6 +735,37 @@ void adns_finish(adns_state ads);
  * they will be cancelled.
  */
 
+void adns_free_answer(adns_state ads, adns_answer *answer);
+/* Frees an answer obtained from a query on ads, using the allocator
+ * given to adns_init_allocator if any (otherwise this is the same as
+ * free(answer)).  ads must not yet have been passed to adns_finish.
+ * answer may be 0.
+ */
+
+void adns_answer_release(adns_state ads, adns_answer *answer);
+/* Equivalent to adns_free_answer, except that the memory may be kept
+ * by ads and reused for a later answer.  answer must have come from
+ * a query on ads, and may be 0.  Any answers which are still held
+ * are freed by adns_finish.
+ */
+
+void adns_tcptimeouts(adns_state ads, int waitms, int connectms,
+		      int idlems);
+/* Sets the timeouts (in milliseconds) which can also be set with the
+ * adns_tcpwait:, adns_tcpconnect: and adns_tcpidle: options.  A value
+ * of -1 (or 0, for the first two) leaves that timeout unchanged.
+ * They apply to queries and connections which start waiting after
+ * the call.
+ */
+
+unsigned long adns_udpdrops(adns_state ads);
+/* Returns the number of datagrams (normally replies) which the kernel
+ * has discarded because one of our UDP sockets' receive buffers was
+ * full.  Such queries are only retried when their UDP timeout
+ * expires.  The count is kept only with the adns_udpdrops option,
+ * and is otherwise always 0.
+ */
+
 
 void adns_forallqueries_begin(adns_state ads);
 adns_query adns_forallqueries_next(adns_state ads, void **context_r);
@@ -696,6 +852,23 @@ void adns_processtimeouts(adns_state ads, const struct timeval *now);
  * obtained from gettimeofday.
  */
 
+int adns_uring_fd(adns_state ads);
+int adns_uring_process(adns_state ads, const struct timeval *now);
+/* With the adns_uring option (see above), adns may do its UDP I/O
+ * through an io_uring: adns_uring_fd returns the ring's fd, or -1 if
+ * adns is not using one (because it was built without support, or
+ * the kernel refused).  The ring's fd is one of those returned by
+ * adns_beforepoll &c, and adns_processreadable on it is the same as
+ * adns_uring_process, which handles whatever the kernel has done
+ * (received replies, and completed sends).  Call it when the ring's
+ * fd is readable; it returns 0 or an errno value as for
+ * _processreadable.  now is as for _processtimeouts.
+ *
+ * Datagrams to be sent are queued, and given to the kernel together
+ * by adns_uring_process, adns_beforepoll, adns_beforeselect and the
+ * other entry points which go on to wait for I/O.
+ */
+
 void adns_firsttimeout(adns_state ads,
 		       struct timeval **tv_mod, struct timeval *tv_buf,
 		       struct timeval now);
@@ -744,8 +917,9 @@ void adns_beforeselect(adns_state ads, int *maxfd, fd_set *readfds,
  * for adns_firsttimeout.  readfds, writefds, exceptfds and maxfd_io may
  * not be 0.
  *
- * If tv_mod is 0 on entry then this will never actually do any I/O,
- * or change the fds that adns is using or the timeouts it wants.  In
+ * If tv_mod is 0 on entry then this will never actually do any I/O
+ * (other than handing datagrams queued for an io_uring to the
+ * kernel), or change the fds that adns is using or the timeouts it wants.  In
  * any case it won't block, and it will set the timeout to zero if a
  * query finishes in _beforeselect.
  */
@@ -823,7 +997,8 @@ int adns_beforepoll(adns_state ads, struct pollfd *fds,
  * adns_beforepoll will return 0 on success, and will not fail for any
  * reason other than the fds buffer being too small (ERANGE).
  *
- * This call will never actually do any I/O.  If you supply the
+ * This call will never actually do any I/O (other than handing
+ * datagrams queued for an io_uring to the kernel).  If you supply the
  * current time it will not change the fds that adns is using or the
  * timeouts it wants.
  *
@@ -834,7 +1009,10 @@ int adns_beforepoll(adns_state ads, struct pollfd *fds,
 /* If you allocate an fds buf with at least RECOMMENDED entries then
  * you are unlikely to need to enlarge it.  You are recommended to do
  * so if it's convenient.  However, you must be prepared for adns to
- * require more space than this.
+ * require more space than this (for example one more if there are
+ * IPv6 nameservers, one for each nameserver with a source address or
+ * interface, one for an io_uring, and if the adns_tcpconns option is
+ * used, up to one more per TCP connection).
  */
 
 void adns_afterpoll(adns_state ads, const struct pollfd *fds, int nfds,
@@ -882,8 +1060,9 @@ adns_status adns_rr_info(adns_rrtype type,
  * The representation is in two parts: first, a word for the address
  * family (ie, in AF_XXX, the XXX), and then one or more items for the
  * address itself, depending on the format.  For an IPv4 address the
- * syntax is INET followed by the dotted quad (from inet_ntoa).
- * Currently only IPv4 is supported.
+ * syntax is INET followed by the dotted quad (from inet_ntoa).  For
+ * an IPv6 address it is INET6 followed by the address as from
+ * inet_ntop.  Other address families come out as AF=<number>.
  *
  * Text strings (as in adns_rr_txt) appear inside double quotes, and
  * use \" and \\ to represent " and \, and \xHH to represent
@@ -24,6 +24,8 @@
  *  Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA. 
  */
 
+#include <limits.h>
+
 #include "internal.h"
 
 void adns_checkconsistency(adns_state ads, adns_query qu) {
@@ -64,43 +66,69 @@ static void checkc_query(adns_state ads, adns_query qu) {
 
   assert(qu->udpnextserver < ads->nservers);
   assert(!(qu->udpsent & (~0UL << ads->nservers)));
-  assert(qu->search_pos <= ads->nsearchlist);
+  assert(!qu->search || qu->search->pos <= ads->nsearchlist);
   if (qu->parent) DLIST_ASSERTON(qu, child, qu->parent->children, siblings.);
 }
 
-static void checkc_notcpbuf(adns_state ads) {
-  assert(!ads->tcpsend.used);
-  assert(!ads->tcprecv.used);
-  assert(!ads->tcprecv_skip);
+static void checkc_notcpbuf(const struct tcpconn *c) {
+  assert(!c->send.used);
+  assert(!c->recv.used);
+  assert(!c->recv_skip);
+  assert(!c->send_skip);
 }
 
-static void checkc_global(adns_state ads) {
-  int i;
-  
-  assert(ads->udpsocket >= 0);
+static void checkc_tcpconn(adns_state ads, const struct tcpconn *c) {
+  adns_query qu;
+  int ci, n, nsent;
 
-  for (i=0; i<ads->nsortlist; i++)
-    assert(!(ads->sortlist[i].base.s_addr & ~ads->sortlist[i].mask.s_addr));
+  ci= c - ads->tcp;
+  for (qu= ads->tcpw.head, n=nsent=0; qu; qu= qu->next)
+    if (qu->tcpconn == ci) { n++; if (qu->tcpsent) nsent++; }
+  assert(c->nqueries == n);
+  assert(c->ninflight == nsent);
+  assert(!ads->tcpinflight || c->ninflight <= ads->tcpinflight);
+  if (c->state != server_ok) assert(!c->ninflight);
 
-  assert(ads->tcpserver >= 0 && ads->tcpserver < ads->nservers);
-  
-  switch (ads->tcpstate) {
+  switch (c->state) {
   case server_connecting:
-    assert(ads->tcpsocket >= 0);
-    checkc_notcpbuf(ads);
+    assert(c->fd >= 0);
+    checkc_notcpbuf(c);
     break;
   case server_disconnected:
   case server_broken:
-    assert(ads->tcpsocket == -1);
-    checkc_notcpbuf(ads);
+    assert(c->fd == -1);
+    checkc_notcpbuf(c);
     break;
   case server_ok:
-    assert(ads->tcpsocket >= 0);
-    assert(ads->tcprecv_skip <= ads->tcprecv.used);
+    assert(c->fd >= 0);
+    assert(c->recv_skip <= c->recv.used);
+    assert(c->send_skip < c->send.used || (!c->send_skip && !c->send.used));
     break;
   default:
-    assert(!"ads->tcpstate value");
+    assert(!"tcpconn state value");
   }
+}
+
+static void checkc_sortlist(adns_state ads, const struct sortlist_node *sn,
+			    int parentplen, int maxplen) {
+  if (!sn) return;
+  assert(sn->plen > parentplen && sn->plen <= maxplen);
+  assert(sn->prec == INT_MAX || (sn->prec >= 0 && sn->prec < ads->nsortlist));
+  checkc_sortlist(ads,sn->child[0],sn->plen,maxplen);
+  checkc_sortlist(ads,sn->child[1],sn->plen,maxplen);
+}
+
+static void checkc_global(adns_state ads) {
+  int i;
+
+  assert(ads->udpsocket >= 0);
+
+  checkc_sortlist(ads,ads->sortlist_inet,-1,32);
+  checkc_sortlist(ads,ads->sortlist_inet6,-1,128);
+
+  assert(ads->tcpserver >= 0 && ads->tcpserver < ads->nservers);
+  assert(ads->ntcp >= 1 && ads->ntcp <= MAXTCPCONNS);
+  for (i=0; i<ads->ntcp; i++) checkc_tcpconn(ads,&ads->tcp[i]);
 
   assert(ads->searchlist || !ads->nsearchlist);
 }
@@ -125,6 +153,8 @@ static void checkc_queue_tcpw(adns_state ads) {
     assert(qu->state==query_tcpw);
     assert(!qu->children.head && !qu->children.tail);
     assert(qu->retries <= ads->nservers+1);
+    assert(qu->tcpconn >= -1 && qu->tcpconn < ads->ntcp);
+    assert(!qu->tcpsent || qu->tcpconn != -1);
     checkc_query(ads,qu);
     checkc_query_alloc(ads,qu);
   });
@@ -35,6 +35,7 @@
 #include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
 #include "internal.h"
@@ -42,68 +43,132 @@
 
 /* TCP connection management. */
 
-static void tcp_close(adns_state ads) {
-  int serv;
-  
-  serv= ads->tcpserver;
-  close(ads->tcpsocket);
-  ads->tcpsocket= -1;
-  ads->tcprecv.used= ads->tcprecv_skip= ads->tcpsend.used= 0;
+static void tcp_close(adns_state ads, struct tcpconn *c) {
+  close(c->fd);
+  c->fd= -1;
+  c->recv.used= c->recv_skip= c->send.used= c->send_skip= 0;
+  c->idlems= -1;
 }
 
-void adns__tcp_broken(adns_state ads, const char *what, const char *why) {
-  int serv;
+void adns__tcp_broken(adns_state ads, struct tcpconn *c,
+		      const char *what, const char *why) {
+  int serv, ci;
   adns_query qu;
   
-  assert(ads->tcpstate == server_connecting || ads->tcpstate == server_ok);
-  serv= ads->tcpserver;
+  assert(c->state == server_connecting || c->state == server_ok);
+  serv= c->serv;
   if (what) adns__warn(ads,serv,0,"TCP connection failed: %s: %s",what,why);
 
-  if (ads->tcpstate == server_connecting) {
-    /* Counts as a retry for all the queries waiting for TCP. */
-    for (qu= ads->tcpw.head; qu; qu= qu->next)
-      qu->retries++;
+  ci= c - ads->tcp;
+  for (qu= ads->tcpw.head; qu; qu= qu->next) {
+    if (qu->tcpconn != ci) continue;
+    /* Counts as a retry for all the queries waiting for it. */
+    if (c->state == server_connecting) qu->retries++;
+    qu->tcpsent= 0;
   }
+  c->ninflight= 0;
 
-  tcp_close(ads);
-  ads->tcpstate= server_broken;
+  tcp_close(ads,c);
+  c->state= server_broken;
   ads->tcpserver= (serv+1)%ads->nservers;
 }
 
-static void tcp_connected(adns_state ads, struct timeval now) {
+void adns__tcp_assign(adns_query qu) {
+  adns_state ads= qu->ads;
+  struct tcpconn *c, *best, *spare;
+
+  assert(qu->tcpconn == -1);
+  best= spare= 0;
+  for (c= ads->tcp; c < ads->tcp + ads->ntcp; c++) {
+    switch (c->state) {
+    case server_connecting:
+    case server_ok:
+      if (!best || c->nqueries < best->nqueries) best= c;
+      break;
+    case server_disconnected:
+      if (!spare) spare= c;
+      break;
+    case server_broken:
+      break;
+    default:
+      abort();
+    }
+  }
+  if (spare && (!best || best->nqueries)) best= spare;
+  if (!best) return;
+  qu->tcpconn= best - ads->tcp;
+  best->nqueries++;
+}
+
+void adns__tcp_release(adns_query qu) {
+  struct tcpconn *c;
+
+  if (qu->tcpconn == -1) return;
+  c= &qu->ads->tcp[qu->tcpconn];
+  c->nqueries--;
+  if (qu->tcpsent) { c->ninflight--; qu->tcpsent= 0; }
+  qu->tcpconn= -1;
+}
+
+static int tcp_canpipeline(adns_state ads, struct tcpconn *c) {
+  /* Whether c has queries waiting which it is allowed to send now. */
+  return c->state == server_ok && c->nqueries > c->ninflight &&
+    (!ads->tcpinflight || c->ninflight < ads->tcpinflight);
+}
+
+static void tcp_sendqueued(adns_state ads, struct tcpconn *c,
+			   struct timeval now) {
   adns_query qu, nqu;
-  
-  adns__debug(ads,ads->tcpserver,0,"TCP connected");
-  ads->tcpstate= server_ok;
-  for (qu= ads->tcpw.head; qu && ads->tcpstate == server_ok; qu= nqu) {
+  int ci;
+
+  ci= c - ads->tcp;
+  for (qu= ads->tcpw.head; qu && tcp_canpipeline(ads,c); qu= nqu) {
     nqu= qu->next;
     assert(qu->state == query_tcpw);
+    if (qu->tcpconn != ci || qu->tcpsent) continue;
     adns__querysend_tcp(qu,now);
   }
 }
 
-static void tcp_broken_events(adns_state ads) {
+static void tcp_connected(adns_state ads, struct tcpconn *c,
+			  struct timeval now) {
+  adns__debug(ads,c->serv,0,"TCP connected");
+  c->state= server_ok;
+  tcp_sendqueued(ads,c,now);
+}
+
+static void tcp_broken_events(adns_state ads, struct tcpconn *c,
+			      struct timeval now) {
+  /* Fails the queries which were waiting for c and have run out of
+   * retries; the others are given to another connection (perhaps
+   * the same slot, now disconnected, which will then reconnect). */
   adns_query qu, nqu;
+  int ci;
   
-  assert(ads->tcpstate == server_broken);
+  assert(c->state == server_broken);
+  ci= c - ads->tcp;
   for (qu= ads->tcpw.head; qu; qu= nqu) {
     nqu= qu->next;
     assert(qu->state == query_tcpw);
+    if (qu->tcpconn != ci && qu->tcpconn != -1) continue;
+    adns__tcp_release(qu);
     if (qu->retries > ads->nservers) {
       LIST_UNLINK(ads->tcpw,qu);
       adns__query_fail(qu,adns_s_allservfail);
     }
   }
-  ads->tcpstate= server_disconnected;
+  c->state= server_disconnected;
+  for (qu= ads->tcpw.head; qu; qu= qu->next)
+    if (qu->tcpconn == -1) adns__querysend_tcp(qu,now);
 }
 
-void adns__tcp_tryconnect(adns_state ads, struct timeval now) {
+void adns__tcp_tryconnect(adns_state ads, struct tcpconn *c,
+			  struct timeval now) {
   int r, fd, tries;
-  struct sockaddr_in addr;
-  struct protoent *proto;
+  const struct server *serv;
 
   for (tries=0; tries<ads->nservers; tries++) {
-    switch (ads->tcpstate) {
+    switch (c->state) {
     case server_connecting:
     case server_ok:
     case server_broken:
@@ -114,16 +179,16 @@ void adns__tcp_tryconnect(adns_state ads, struct timeval now) {
       abort();
     }
     
-    assert(!ads->tcpsend.used);
-    assert(!ads->tcprecv.used);
-    assert(!ads->tcprecv_skip);
+    assert(!c->send.used);
+    assert(!c->recv.used);
+    assert(!c->recv_skip);
 
-    proto= getprotobyname("tcp");
-    if (!proto) {
+    if (ads->tcpproto < 0) {
       adns__diag(ads,-1,0,"unable to find protocol no. for TCP !");
       return;
     }
-    fd= socket(AF_INET,SOCK_STREAM,proto->p_proto);
+    serv= &ads->servers[ads->tcpserver];
+    fd= socket(serv->addr.sa.sa_family,SOCK_STREAM,ads->tcpproto);
     if (fd<0) {
       adns__diag(ads,-1,0,"cannot create TCP socket: %s",strerror(errno));
       return;
@@ -135,24 +200,126 @@ void adns__tcp_tryconnect(adns_state ads, struct timeval now) {
       close(fd);
       return;
     }
-    memset(&addr,0,sizeof(addr));
-    addr.sin_family= AF_INET;
-    addr.sin_port= htons(DNS_PORT);
-    addr.sin_addr= ads->servers[ads->tcpserver].addr;
-    r= connect(fd,(const struct sockaddr*)&addr,sizeof(addr));
-    ads->tcpsocket= fd;
-    ads->tcpstate= server_connecting;
-    if (r==0) { tcp_connected(ads,now); return; }
+    c->serv= ads->tcpserver;
+    c->fd= fd;
+    c->state= server_connecting;
+    r= adns__server_bind(ads,ads->tcpserver,fd);
+    if (r) {
+      /* Like a failed connect: this server is no use, try the next. */
+      adns__tcp_broken(ads,c,"bind",strerror(r));
+      tcp_broken_events(ads,c,now);
+      continue;
+    }
+#ifdef TCP_FASTOPEN_CONNECT
+    if (ads->tcpfastopen) {
+      /* connect returns at once, and our first write goes in the SYN
+       * if we have a cookie for the server (otherwise it gets
+       * EINPROGRESS and the request is sent after the handshake). */
+      r= 1;
+      if (setsockopt(fd,IPPROTO_TCP,TCP_FASTOPEN_CONNECT,&r,sizeof(r)))
+	adns__diag(ads,-1,0,"cannot enable TCP fast open: %s",
+		   strerror(errno));
+    }
+#endif
+    r= connect(fd,&serv->addr.sa,serv->len);
+    if (r==0) { tcp_connected(ads,c,now); return; }
     if (errno == EWOULDBLOCK || errno == EINPROGRESS) {
-      ads->tcptimeout= now;
-      timevaladd(&ads->tcptimeout,TCPCONNMS);
+      c->timeout= now;
+      timevaladd(&c->timeout,ads->tcpconnms);
       return;
     }
-    adns__tcp_broken(ads,"connect",strerror(errno));
-    tcp_broken_events(ads);
+    adns__tcp_broken(ads,c,"connect",strerror(errno));
+    tcp_broken_events(ads,c,now);
   }
 }
 
+int adns__udp_byfd(adns_state ads, int fd, unsigned **ovfl_r) {
+  int i;
+
+  if (fd < 0) return 0;
+  if (fd == ads->udpsocket) { *ovfl_r= &ads->udpovfl; return AF_INET; }
+  if (fd == ads->udpsocket6) { *ovfl_r= &ads->udpovfl6; return AF_INET6; }
+  for (i=0; i<ads->nservers; i++) {
+    if (fd == ads->servers[i].udpsocket) {
+      *ovfl_r= &ads->servers[i].udpovfl;
+      return ads->servers[i].addr.sa.sa_family;
+    }
+  }
+  return 0;
+}
+
+void adns__udp_ovfl(adns_state ads, struct msghdr *msg, unsigned *ovfl_io) {
+#ifdef SO_RXQ_OVFL
+  struct cmsghdr *cm;
+  unsigned ovfl;
+
+  for (cm= CMSG_FIRSTHDR(msg); cm; cm= CMSG_NXTHDR(msg,cm)) {
+    if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SO_RXQ_OVFL)
+      continue;
+    memcpy(&ovfl,CMSG_DATA(cm),sizeof(ovfl));
+    if (ovfl == *ovfl_io) continue;
+    adns__debug(ads,-1,0,"kernel dropped %u datagrams"
+		" (UDP receive buffer full)", ovfl - *ovfl_io);
+    ads->udpdrops += ovfl - *ovfl_io;
+    *ovfl_io= ovfl;
+  }
+#endif
+}
+
+static int udp_recv(adns_state ads, int fd, unsigned *ovfl_io,
+		    byte *buf, int buflen, adns__sockaddr *addr,
+		    int *addrlen_io) {
+  /* Like recvfrom.  With adns_udpdrops, also picks up the kernel's
+   * count of datagrams dropped on this socket. */
+#ifdef SO_RXQ_OVFL
+  struct msghdr msg;
+  struct iovec iov;
+  union {
+    struct cmsghdr align;
+    char buf[ADNS__UDP_CMSGSPACE];
+  } cbuf;
+  int r;
+
+  if (ads->udpdropstats) {
+    iov.iov_base= buf;
+    iov.iov_len= buflen;
+    memset(&msg,0,sizeof(msg));
+    msg.msg_name= addr;
+    msg.msg_namelen= *addrlen_io;
+    msg.msg_iov= &iov;
+    msg.msg_iovlen= 1;
+    msg.msg_control= cbuf.buf;
+    msg.msg_controllen= sizeof(cbuf.buf);
+    r= recvmsg(fd,&msg,0);
+    if (r<0) return r;
+    *addrlen_io= msg.msg_namelen;
+    adns__udp_ovfl(ads,&msg,ovfl_io);
+    return r;
+  }
+#endif
+  return recvfrom(fd,buf,buflen,0,&addr->sa,addrlen_io);
+}
+
+static struct tcpconn *tcp_byfd(adns_state ads, int fd) {
+  /* Returns the connection (connecting or connected) using fd, or 0. */
+  struct tcpconn *c;
+
+  for (c= ads->tcp; c < ads->tcp + ads->ntcp; c++) {
+    switch (c->state) {
+    case server_disconnected:
+    case server_broken:
+      break;
+    case server_connecting:
+    case server_ok:
+      if (c->fd == fd) return c;
+      break;
+    default:
+      abort();
+    }
+  }
+  return 0;
+}
+
 /* Timeout handling functions. */
 
 void adns__must_gettimeofday(adns_state ads, const struct timeval **now_io,
@@ -224,6 +391,7 @@ static void timeouts_queue(adns_state ads, int act,
       if (!act) { inter_immed(tv_io,tvbuf); return; }
       LIST_UNLINK(*queue,qu);
       if (qu->state != query_tosend) {
+	adns__tcp_release(qu);
 	adns__query_fail(qu,adns_s_timeout);
       } else {
 	adns__query_send(qu,now);
@@ -233,39 +401,44 @@ static void timeouts_queue(adns_state ads, int act,
   }
 }
 
-static void tcp_events(adns_state ads, int act,
+static void tcp_events(adns_state ads, struct tcpconn *c, int act,
 		       struct timeval **tv_io, struct timeval *tvbuf,
 		       struct timeval now) {
   for (;;) {
-    switch (ads->tcpstate) {
+    switch (c->state) {
     case server_broken:
       if (!act) { inter_immed(tv_io,tvbuf); return; }
-      tcp_broken_events(ads);
+      tcp_broken_events(ads,c,now);
     case server_disconnected: /* fall through */
-      if (!ads->tcpw.head) return;
+      if (!c->nqueries) return;
       if (!act) { inter_immed(tv_io,tvbuf); return; }
-      adns__tcp_tryconnect(ads,now);
+      adns__tcp_tryconnect(ads,c,now);
       break;
     case server_ok:
-      if (ads->tcpw.head) return;
-      if (!ads->tcptimeout.tv_sec) {
-	assert(!ads->tcptimeout.tv_usec);
-	ads->tcptimeout= now;
-	timevaladd(&ads->tcptimeout,TCPIDLEMS);
+      if (tcp_canpipeline(ads,c)) {
+	if (!act) { inter_immed(tv_io,tvbuf); return; }
+	tcp_sendqueued(ads,c,now);
+	if (c->state != server_ok) continue;
+      }
+      if (c->nqueries) return;
+      if (!c->timeout.tv_sec) {
+	assert(!c->timeout.tv_usec);
+	c->timeout= now;
+	timevaladd(&c->timeout, c->idlems>=0 ? c->idlems : ads->tcpidlems);
       }
     case server_connecting: /* fall through */
-      if (!act || !timercmp(&now,&ads->tcptimeout,>)) {
-	inter_maxtoabs(tv_io,tvbuf,now,ads->tcptimeout);
+      if (!act || !timercmp(&now,&c->timeout,>)) {
+	inter_maxtoabs(tv_io,tvbuf,now,c->timeout);
 	return;
       } {
 	/* TCP timeout has happened */
-	switch (ads->tcpstate) {
+	switch (c->state) {
 	case server_connecting: /* failed to connect */
-	  adns__tcp_broken(ads,"unable to make connection","timed out");
+	  adns__tcp_broken(ads,c,"unable to make connection","timed out");
 	  break;
 	case server_ok: /* idle timeout */
-	  tcp_close(ads);
-	  ads->tcpstate= server_disconnected;
+	  tcp_close(ads,c);
+	  c->state= server_disconnected;
 	  return;
 	default:
 	  abort();
@@ -282,9 +455,12 @@ static void tcp_events(adns_state ads, int act,
 void adns__timeouts(adns_state ads, int act,
 		    struct timeval **tv_io, struct timeval *tvbuf,
 		    struct timeval now) {
+  struct tcpconn *c;
+
   timeouts_queue(ads,act,tv_io,tvbuf,now, &ads->udpw);
   timeouts_queue(ads,act,tv_io,tvbuf,now, &ads->tcpw);
-  tcp_events(ads,act,tv_io,tvbuf,now);
+  for (c= ads->tcp; c < ads->tcp + ads->ntcp; c++)
+    tcp_events(ads,c,act,tv_io,tvbuf,now);
 }
 
 void adns_firsttimeout(adns_state ads,
@@ -308,57 +484,123 @@ void adns_processtimeouts(adns_state ads, const struct timeval *now) {
  * reception and often transmission.
  */
 
+static int pollfd_in(adns_state ads, struct pollfd *pollfds_buf, int n,
+		     int fd) {
+  /* Adds fd (if it is valid and its reads are not being done by the
+   * ring) to the array for reading. */
+  if (fd < 0 || adns__uring_receiving(ads,fd)) return n;
+  pollfds_buf[n].fd= fd;
+  pollfds_buf[n].events= POLLIN;
+  pollfds_buf[n].revents= 0;
+  return n+1;
+}
+
 int adns__pollfds(adns_state ads, struct pollfd pollfds_buf[MAX_POLLFDS]) {
   /* Returns the number of entries filled in.  Always zeroes revents. */
+  struct tcpconn *c;
+  int n, i;
+
+  adns__uring_submit(ads);
+  n= pollfd_in(ads,pollfds_buf,0,adns__uring_fd(ads));
+  n= pollfd_in(ads,pollfds_buf,n,ads->udpsocket);
+  n= pollfd_in(ads,pollfds_buf,n,ads->udpsocket6);
+  for (i=0; i<ads->nservers; i++)
+    n= pollfd_in(ads,pollfds_buf,n,ads->servers[i].udpsocket);
+
+  for (c= ads->tcp; c < ads->tcp + ads->ntcp; c++) {
+    switch (c->state) {
+    case server_disconnected:
+    case server_broken:
+      continue;
+    case server_connecting:
+      pollfds_buf[n].events= POLLOUT;
+      break;
+    case server_ok:
+      pollfds_buf[n].events=
+	c->send.used ? POLLIN|POLLOUT|POLLPRI : POLLIN|POLLPRI;
+      break;
+    default:
+      abort();
+    }
+    pollfds_buf[n].fd= c->fd;
+    pollfds_buf[n].revents= 0;
+    n++;
+  }
+  return n;
+}
 
-  assert(MAX_POLLFDS==2);
-
-  pollfds_buf[0].fd= ads->udpsocket;
-  pollfds_buf[0].events= POLLIN;
-  pollfds_buf[0].revents= 0;
-
-  switch (ads->tcpstate) {
-  case server_disconnected:
-  case server_broken:
-    return 1;
-  case server_connecting:
-    pollfds_buf[1].events= POLLOUT;
-    break;
-  case server_ok:
-    pollfds_buf[1].events=
-      ads->tcpsend.used ? POLLIN|POLLOUT|POLLPRI : POLLIN|POLLPRI;
-    break;
-  default:
-    abort();
+void adns__udp_dgram(adns_state ads, int fd, int af,
+		     const byte *dgram, int dglen,
+		     const adns__sockaddr *addr, int addrlen,
+		     struct timeval now) {
+  int afaddrlen, serv, addrserv, port;
+  char abuf[ADNS__SOCKADDR_NTOA_BUFLEN];
+
+  afaddrlen= af == AF_INET ? sizeof(addr->inet) : sizeof(addr->inet6);
+  if (addrlen != afaddrlen) {
+    adns__diag(ads,-1,0,"datagram received with wrong address length %d"
+	       " (expected %lu)", addrlen,
+	       (unsigned long)afaddrlen);
+    return;
+  }
+  if (addr->sa.sa_family != af) {
+    adns__diag(ads,-1,0,"datagram received with wrong protocol family"
+	       " %u (expected %u)",addr->sa.sa_family,af);
+    return;
+  }
+  addrserv= -1;
+  for (serv= 0; serv < ads->nservers; serv++) {
+    if (adns__server_socket(ads,serv) != fd ||
+	!adns__sockaddr_equal(&ads->servers[serv].addr.sa,&addr->sa,0))
+      continue;
+    if (adns__sockaddr_equal(&ads->servers[serv].addr.sa,&addr->sa,1))
+      break;
+    addrserv= serv;
+  }
+  if (serv >= ads->nservers) {
+    if (addrserv >= 0) {
+      port= ntohs(af == AF_INET
+		  ? addr->inet.sin_port : addr->inet6.sin6_port);
+      adns__diag(ads,-1,0,"datagram received from wrong port"
+		 " %u (expected %u)", port,
+		 ntohs(af == AF_INET
+		       ? ads->servers[addrserv].addr.inet.sin_port
+		       : ads->servers[addrserv].addr.inet6.sin6_port));
+    } else {
+      adns__warn(ads,-1,0,"datagram received from unknown nameserver %s",
+		 adns__sockaddr_ntoa(&addr->sa,abuf));
+    }
+    return;
   }
-  pollfds_buf[1].fd= ads->tcpsocket;
-  return 2;
+  adns__procdgram(ads,dgram,dglen,serv,0,now);
 }
 
 int adns_processreadable(adns_state ads, int fd, const struct timeval *now) {
-  int want, dgramlen, r, udpaddrlen, serv, old_skip;
+  int want, dgramlen, r, udpaddrlen, old_skip, ka, af;
+  unsigned *ovfl;
   byte udpbuf[DNS_MAXUDP];
-  struct sockaddr_in udpaddr;
+  adns__sockaddr udpaddr;
+  struct tcpconn *c;
   
   adns__consistency(ads,0,cc_entex);
 
-  switch (ads->tcpstate) {
-  case server_disconnected:
-  case server_broken:
-  case server_connecting:
-    break;
-  case server_ok:
-    if (fd != ads->tcpsocket) break;
-    assert(!ads->tcprecv_skip);
+  c= tcp_byfd(ads,fd);
+  if (c && c->state == server_ok) {
+    assert(!c->recv_skip);
     do {
-      if (ads->tcprecv.used >= ads->tcprecv_skip+2) {
-	dgramlen= ((ads->tcprecv.buf[ads->tcprecv_skip]<<8) |
-	           ads->tcprecv.buf[ads->tcprecv_skip+1]);
-	if (ads->tcprecv.used >= ads->tcprecv_skip+2+dgramlen) {
-	  old_skip= ads->tcprecv_skip;
-	  ads->tcprecv_skip += 2+dgramlen;
-	  adns__procdgram(ads, ads->tcprecv.buf+old_skip+2,
-			  dgramlen, ads->tcpserver, 1,*now);
+      if (c->recv.used >= c->recv_skip+2) {
+	dgramlen= ((c->recv.buf[c->recv_skip]<<8) |
+	           c->recv.buf[c->recv_skip+1]);
+	if (c->recv.used >= c->recv_skip+2+dgramlen) {
+	  old_skip= c->recv_skip;
+	  c->recv_skip += 2+dgramlen;
+	  if (ads->tcpkeepalive) {
+	    ka= adns__tcpkeepalive(c->recv.buf+old_skip+2, dgramlen);
+	    if (ka >= 0) c->idlems= ka;
+	  }
+	  adns__procdgram(ads, c->recv.buf+old_skip+2,
+			  dgramlen, c->serv, 1,*now);
+	  if (tcp_canpipeline(ads,c)) tcp_sendqueued(ads,c,*now);
 	  continue;
 	} else {
 	  want= 2+dgramlen;
@@ -366,36 +608,39 @@ int adns_processreadable(adns_state ads, int fd, const struct timeval *now) {
       } else {
 	want= 2;
       }
-      ads->tcprecv.used -= ads->tcprecv_skip;
-      memmove(ads->tcprecv.buf, ads->tcprecv.buf+ads->tcprecv_skip,
-	      ads->tcprecv.used);
-      ads->tcprecv_skip= 0;
-      if (!adns__vbuf_ensure(&ads->tcprecv,want)) { r= ENOMEM; goto xit; }
-      assert(ads->tcprecv.used <= ads->tcprecv.avail);
-      if (ads->tcprecv.used == ads->tcprecv.avail) continue;
-      r= read(ads->tcpsocket,
-	      ads->tcprecv.buf+ads->tcprecv.used,
-	      ads->tcprecv.avail-ads->tcprecv.used);
+      if (c->recv_skip) {
+	c->recv.used -= c->recv_skip;
+	if (c->recv.used)
+	  memmove(c->recv.buf, c->recv.buf+c->recv_skip, c->recv.used);
+	c->recv_skip= 0;
+      }
+      if (!adns__vbuf_ensure(&c->recv,want)) { r= ENOMEM; goto xit; }
+      assert(c->recv.used <= c->recv.avail);
+      if (c->recv.used == c->recv.avail) continue;
+      r= read(c->fd, c->recv.buf+c->recv.used, c->recv.avail-c->recv.used);
       if (r>0) {
-	ads->tcprecv.used+= r;
+	c->recv.used+= r;
       } else {
 	if (r) {
 	  if (errno==EAGAIN || errno==EWOULDBLOCK) { r= 0; goto xit; }
 	  if (errno==EINTR) continue;
 	  if (errno_resources(errno)) { r= errno; goto xit; }
 	}
-	adns__tcp_broken(ads,"read",r?strerror(errno):"closed");
+	adns__tcp_broken(ads,c,"read",r?strerror(errno):"closed");
       }
-    } while (ads->tcpstate == server_ok);
+    } while (c->state == server_ok);
     r= 0; goto xit;
-  default:
-    abort();
   }
-  if (fd == ads->udpsocket) {
+  if (fd == adns__uring_fd(ads)) {
+    r= adns__uring_reap(ads,*now);
+    goto xit;
+  }
+  af= adns__udp_byfd(ads,fd,&ovfl);
+  if (af) {
     for (;;) {
-      udpaddrlen= sizeof(udpaddr);
-      r= recvfrom(ads->udpsocket,udpbuf,sizeof(udpbuf),0,
-		  (struct sockaddr*)&udpaddr,&udpaddrlen);
+      udpaddrlen= af == AF_INET
+	? sizeof(udpaddr.inet) : sizeof(udpaddr.inet6);
+      r= udp_recv(ads,fd,ovfl,udpbuf,sizeof(udpbuf),&udpaddr,&udpaddrlen);
       if (r<0) {
 	if (errno == EAGAIN || errno == EWOULDBLOCK) { r= 0; goto xit; }
 	if (errno == EINTR) continue;
@@ -403,32 +648,7 @@ int adns_processreadable(adns_state ads, int fd, const struct timeval *now) {
 	adns__warn(ads,-1,0,"datagram receive error: %s",strerror(errno));
 	r= 0; goto xit;
       }
-      if (udpaddrlen != sizeof(udpaddr)) {
-	adns__diag(ads,-1,0,"datagram received with wrong address length %d"
-		   " (expected %lu)", udpaddrlen,
-		   (unsigned long)sizeof(udpaddr));
-	continue;
-      }
-      if (udpaddr.sin_family != AF_INET) {
-	adns__diag(ads,-1,0,"datagram received with wrong protocol family"
-		   " %u (expected %u)",udpaddr.sin_family,AF_INET);
-	continue;
-      }
-      if (ntohs(udpaddr.sin_port) != DNS_PORT) {
-	adns__diag(ads,-1,0,"datagram received from wrong port"
-		   " %u (expected %u)", ntohs(udpaddr.sin_port),DNS_PORT);
-	continue;
-      }
-      for (serv= 0;
-	   serv < ads->nservers &&
-	     ads->servers[serv].addr.s_addr != udpaddr.sin_addr.s_addr;
-	   serv++);
-      if (serv >= ads->nservers) {
-	adns__warn(ads,-1,0,"datagram received from unknown nameserver %s",
-		   inet_ntoa(udpaddr.sin_addr));
-	continue;
-      }
-      adns__procdgram(ads,udpbuf,r,serv,0,*now);
+      adns__udp_dgram(ads,fd,af,udpbuf,r,&udpaddr,udpaddrlen,*now);
     }
   }
   r= 0;
@@ -438,49 +658,46 @@ xit:
 }
 
 int adns_processwriteable(adns_state ads, int fd, const struct timeval *now) {
+  struct tcpconn *c;
   int r;
   
   adns__consistency(ads,0,cc_entex);
 
-  switch (ads->tcpstate) {
-  case server_disconnected:
-  case server_broken:
-    break;
+  c= tcp_byfd(ads,fd);
+  if (!c) { r= 0; goto xit; }
+  switch (c->state) {
   case server_connecting:
-    if (fd != ads->tcpsocket) break;
-    assert(ads->tcprecv.used==0);
-    assert(ads->tcprecv_skip==0);
+    assert(c->recv.used==0);
+    assert(c->recv_skip==0);
     for (;;) {
-      if (!adns__vbuf_ensure(&ads->tcprecv,1)) { r= ENOMEM; goto xit; }
-      r= read(ads->tcpsocket,&ads->tcprecv.buf,1);
+      if (!adns__vbuf_ensure(&c->recv,1)) { r= ENOMEM; goto xit; }
+      r= read(c->fd,c->recv.buf,1);
       if (r==0 || (r<0 && (errno==EAGAIN || errno==EWOULDBLOCK))) {
-	tcp_connected(ads,*now);
+	tcp_connected(ads,c,*now);
 	r= 0; goto xit;
       }
       if (r>0) {
-	adns__tcp_broken(ads,"connect/read","sent data before first request");
+	adns__tcp_broken(ads,c,"connect/read","sent data before first request");
 	r= 0; goto xit;
       }
       if (errno==EINTR) continue;
       if (errno_resources(errno)) { r= errno; goto xit; }
-      adns__tcp_broken(ads,"connect/read",strerror(errno));
+      adns__tcp_broken(ads,c,"connect/read",strerror(errno));
       r= 0; goto xit;
     } /* not reached */
   case server_ok:
-    if (fd != ads->tcpsocket) break;
-    while (ads->tcpsend.used) {
-      adns__sigpipe_protect(ads);
-      r= write(ads->tcpsocket,ads->tcpsend.buf,ads->tcpsend.used);
-      adns__sigpipe_unprotect(ads);
+    while (c->send.used) {
+      r= adns__tcp_write(ads,c->fd,c->send.buf+c->send_skip,
+			 c->send.used-c->send_skip);
       if (r<0) {
 	if (errno==EINTR) continue;
 	if (errno==EAGAIN || errno==EWOULDBLOCK) { r= 0; goto xit; }
 	if (errno_resources(errno)) { r= errno; goto xit; }
-	adns__tcp_broken(ads,"write",strerror(errno));
+	adns__tcp_broken(ads,c,"write",strerror(errno));
 	r= 0; goto xit;
       } else if (r>0) {
-	ads->tcpsend.used -= r;
-	memmove(ads->tcpsend.buf,ads->tcpsend.buf+r,ads->tcpsend.used);
+	c->send_skip += r;
+	if (c->send_skip == c->send.used) c->send.used= c->send_skip= 0;
       }
     }
     r= 0;
@@ -488,7 +705,6 @@ int adns_processwriteable(adns_state ads, int fd, const struct timeval *now) {
   default:
     abort();
   }
-  r= 0;
 xit:
   adns__consistency(ads,0,cc_entex);
   return r;
@@ -496,19 +712,12 @@ xit:
   
 int adns_processexceptional(adns_state ads, int fd,
 			    const struct timeval *now) {
+  struct tcpconn *c;
+
   adns__consistency(ads,0,cc_entex);
-  switch (ads->tcpstate) {
-  case server_disconnected:
-  case server_broken:
-    break;
-  case server_connecting:
-  case server_ok:
-    if (fd != ads->tcpsocket) break;
-    adns__tcp_broken(ads,"poll/select","exceptional condition detected");
-    break;
-  default:
-    abort();
-  }
+  c= tcp_byfd(ads,fd);
+  if (c)
+    adns__tcp_broken(ads,c,"poll/select","exceptional condition detected");
   adns__consistency(ads,0,cc_entex);
   return 0;
 }
@@ -614,21 +823,33 @@ xit:
 /* General helpful functions. */
 
 void adns_globalsystemfailure(adns_state ads) {
+  struct tcpconn *c;
+  adns_query qu;
+
   adns__consistency(ads,0,cc_entex);
 
-  while (ads->udpw.head) adns__query_fail(ads->udpw.head, adns_s_systemfail);
-  while (ads->tcpw.head) adns__query_fail(ads->tcpw.head, adns_s_systemfail);
+  while ((qu= ads->udpw.head)) {
+    LIST_UNLINK(ads->udpw,qu);
+    adns__query_fail(qu, adns_s_systemfail);
+  }
+  while ((qu= ads->tcpw.head)) {
+    LIST_UNLINK(ads->tcpw,qu);
+    adns__tcp_release(qu);
+    adns__query_fail(qu, adns_s_systemfail);
+  }
   
-  switch (ads->tcpstate) {
-  case server_connecting:
-  case server_ok:
-    adns__tcp_broken(ads,0,0);
-    break;
-  case server_disconnected:
-  case server_broken:
-    break;
-  default:
-    abort();
+  for (c= ads->tcp; c < ads->tcp + ads->ntcp; c++) {
+    switch (c->state) {
+    case server_connecting:
+    case server_ok:
+      adns__tcp_broken(ads,c,0,0);
+      break;
+    case server_disconnected:
+    case server_broken:
+      break;
+    default:
+      abort();
+    }
   }
   adns__consistency(ads,0,cc_entex);
 }
@@ -686,7 +907,7 @@ int adns__internal_check(adns_state ads,
   *answer= qu->answer;
   if (context_r) *context_r= qu->ctx.ext;
   *query_io= qu;
-  free(qu);
+  adns__query_recycle(qu);
   return 0;
 }
 
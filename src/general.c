@@ -51,6 +51,7 @@ void adns__lprintf(adns_state ads, const char *fmt, ...) {
 void adns__vdiag(adns_state ads, const char *pfx, adns_initflags prevent,
 		 int serv, adns_query qu, const char *fmt, va_list al) {
   const char *bef, *aft;
+  char nsbuf[ADNS__SOCKADDR_NTOA_BUFLEN];
   vbuf vb;
   
   if (!ads->logfn ||
@@ -70,7 +71,7 @@ void adns__vdiag(adns_state ads, const char *pfx, adns_initflags prevent,
   aft= "\n";
 
   if (qu && qu->query_dgram) {
-    adns__vbuf_init(&vb);
+    adns__vbuf_init(&vb,ads);
     adns__lprintf(ads,"%sQNAME=%s, QTYPE=%s",
 	    bef,
 	    adns__diag_domain(qu->ads,-1,0, &vb,
@@ -83,7 +84,8 @@ void adns__vdiag(adns_state ads, const char *pfx, adns_initflags prevent,
   }
   
   if (serv>=0) {
-    adns__lprintf(ads,"%sNS=%s",bef,inet_ntoa(ads->servers[serv].addr));
+    adns__lprintf(ads,"%sNS=%s",bef,
+		  adns__sockaddr_ntoa(&ads->servers[serv].addr.sa, nsbuf));
     bef=", "; aft=")\n";
   }
 
@@ -118,17 +120,40 @@ void adns__diag(adns_state ads, int serv, adns_query qu,
   va_end(al);
 }
 
+/* Memory allocation */
+
+void *adns__malloc(adns_state ads, size_t sz) {
+  if (ads && ads->allocator.mallocfn)
+    return ads->allocator.mallocfn(ads->allocator.ctx,sz);
+  return malloc(sz);
+}
+
+void *adns__realloc(adns_state ads, void *p, size_t sz) {
+  if (ads && ads->allocator.reallocfn)
+    return ads->allocator.reallocfn(ads->allocator.ctx,p,sz);
+  return realloc(p,sz);
+}
+
+void adns__free(adns_state ads, void *p) {
+  if (ads && ads->allocator.freefn) {
+    if (p) ads->allocator.freefn(ads->allocator.ctx,p);
+    return;
+  }
+  free(p);
+}
+
 /* vbuf functions */
 
-void adns__vbuf_init(vbuf *vb) {
+void adns__vbuf_init(vbuf *vb, adns_state ads) {
   vb->used= vb->avail= 0; vb->buf= 0;
+  vb->ads= ads;
 }
 
 int adns__vbuf_ensure(vbuf *vb, int want) {
   void *nb;
   
   if (vb->avail >= want) return 1;
-  nb= realloc(vb->buf,want); if (!nb) return 0;
+  nb= adns__realloc(vb->ads,vb->buf,want); if (!nb) return 0;
   vb->buf= nb;
   vb->avail= want;
   return 1;
@@ -147,8 +172,8 @@ int adns__vbuf_append(vbuf *vb, const byte *data, int len) {
   if (vb->avail < newlen) {
     if (newlen<20) newlen= 20;
     newlen <<= 1;
-    nb= realloc(vb->buf,newlen);
-    if (!nb) { newlen= vb->used+len; nb= realloc(vb->buf,newlen); }
+    nb= adns__realloc(vb->ads,vb->buf,newlen);
+    if (!nb) { newlen= vb->used+len; nb= adns__realloc(vb->ads,vb->buf,newlen); }
     if (!nb) return 0;
     vb->buf= nb;
     vb->avail= newlen;
@@ -164,8 +189,63 @@ int adns__vbuf_appendstr(vbuf *vb, const char *data) {
 }
 
 void adns__vbuf_free(vbuf *vb) {
-  free(vb->buf);
-  adns__vbuf_init(vb);
+  adns__free(vb->ads,vb->buf);
+  adns__vbuf_init(vb,vb->ads);
+}
+
+/* Socket addresses */
+
+const char *adns__sockaddr_ntoa(const struct sockaddr *sa, char *buf) {
+  const struct sockaddr_in6 *sa6;
+  const char *p;
+
+  switch (sa->sa_family) {
+  case AF_INET:
+    p= inet_ntop(AF_INET, &((const struct sockaddr_in*)sa)->sin_addr,
+		 buf, ADNS__SOCKADDR_NTOA_BUFLEN);
+    break;
+  case AF_INET6:
+    sa6= (const struct sockaddr_in6*)sa;
+    p= inet_ntop(AF_INET6, &sa6->sin6_addr, buf, INET6_ADDRSTRLEN);
+    if (p && sa6->sin6_scope_id)
+      sprintf(buf+strlen(buf),"%%%lu",(unsigned long)sa6->sin6_scope_id);
+    break;
+  default:
+    abort();
+  }
+  assert(p);
+  return buf;
+}
+
+int adns__sockaddr_equal(const struct sockaddr *a,
+			 const struct sockaddr *b, int ports) {
+  const struct sockaddr_in *a4, *b4;
+  const struct sockaddr_in6 *a6, *b6;
+
+  if (a->sa_family != b->sa_family) return 0;
+  switch (a->sa_family) {
+  case AF_INET:
+    a4= (const struct sockaddr_in*)a;
+    b4= (const struct sockaddr_in*)b;
+    return a4->sin_addr.s_addr == b4->sin_addr.s_addr &&
+      (!ports || a4->sin_port == b4->sin_port);
+  case AF_INET6:
+    a6= (const struct sockaddr_in6*)a;
+    b6= (const struct sockaddr_in6*)b;
+    return !memcmp(&a6->sin6_addr,&b6->sin6_addr,sizeof(struct in6_addr)) &&
+      (!a6->sin6_scope_id || a6->sin6_scope_id == b6->sin6_scope_id) &&
+      (!ports || a6->sin6_port == b6->sin6_port);
+  default:
+    abort();
+  }
+}
+
+int adns__server_socket(adns_state ads, int serv) {
+  const struct server *ss= &ads->servers[serv];
+
+  if (ss->srclen || ss->ifname[0]) return ss->udpsocket;
+  return ss->addr.sa.sa_family == AF_INET6
+    ? ads->udpsocket6 : ads->udpsocket;
 }
 
 /* Additional diagnostic functions */
@@ -213,7 +293,7 @@ adns_status adns_rr_info(adns_rrtype type,
 
   if (!datap) return adns_s_ok;
   
-  adns__vbuf_init(&vb);
+  adns__vbuf_init(&vb,0);
   st= typei->convstring(&vb,datap);
   if (st) goto x_freevb;
   if (!adns__vbuf_append(&vb,"",1)) { st= adns_s_nomemory; goto x_freevb; }
@@ -349,9 +429,90 @@ void adns__isort(void *array, int nobjs, int sz, void *tempbuf,
   }
 }
 
-/* SIGPIPE protection. */
+void adns__sort(void *array, int nobjs, int sz, void *tempbuf,
+		int (*needswap)(void *context, const void *a, const void *b),
+		void *context) {
+  byte *data= array, *temp= tempbuf;
+  int nleft, i, j, k;
+
+  if (nobjs <= SORTMERGEMIN) {
+    adns__isort(array,nobjs,sz,tempbuf,needswap,context);
+    return;
+  }
+
+  nleft= nobjs/2;
+  adns__sort(data, nleft, sz, tempbuf, needswap,context);
+  adns__sort(data + nleft*sz, nobjs-nleft, sz, tempbuf, needswap,context);
+  if (!needswap(context, data + (nleft-1)*sz, data + nleft*sz)) return;
+
+  /* Merge the left half (moved out to temp) with the right half (still
+   * in place); taking from the right only if strictly less keeps the
+   * sort stable, and we never overwrite right half entries not yet used.
+   */
+  memcpy(temp, data, nleft*sz);
+  for (i=0, j=nleft, k=0; i<nleft && j<nobjs; k++) {
+    if (needswap(context, temp + i*sz, data + j*sz)) {
+      memcpy(data + k*sz, data + j*sz, sz);  j++;
+    } else {
+      memcpy(data + k*sz, temp + i*sz, sz);  i++;
+    }
+  }
+  memcpy(data + k*sz, temp + i*sz, (nleft-i)*sz);
+}
+
+static int sort_needswap_key(void *context, const void *a, const void *b) {
+  return *(const int*)a > *(const int*)b;
+}
 
-void adns__sigpipe_protect(adns_state ads) {
+int adns__sort_bykey(adns_state ads, void *array, int nobjs, int sz,
+		     vbuf *tempvb,
+		     int (*sortkey)(adns_state ads, const void *datap)) {
+  byte *data= array, *ent;
+  int esz, i;
+
+  if (!ads->nsortlist || nobjs<2) return 1;
+
+  /* Each entry in tempvb is the key followed by a copy of the object,
+   * and is padded so that the keys stay aligned. */
+  esz= (sizeof(int) + sz + sizeof(int)-1) / sizeof(int) * sizeof(int);
+  if (!adns__vbuf_ensure(tempvb,nobjs*esz*2)) return 0;
+
+  for (i=0, ent=tempvb->buf; i<nobjs; i++, ent+=esz) {
+    *(int*)ent= sortkey(ads, data + i*sz);
+    memcpy(ent+sizeof(int), data + i*sz, sz);
+  }
+  adns__sort(tempvb->buf, nobjs, esz, tempvb->buf + nobjs*esz,
+	     sort_needswap_key, 0);
+  for (i=0, ent=tempvb->buf; i<nobjs; i++, ent+=esz)
+    memcpy(data + i*sz, ent+sizeof(int), sz);
+  return 1;
+}
+
+/* Writing to TCP connections, with SIGPIPE protection. */
+
+#ifdef MSG_NOSIGNAL
+
+int adns__tcp_writev(adns_state ads, int fd,
+		     struct iovec *iov, int iovcnt) {
+  struct msghdr msg;
+
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov= iov;
+  msg.msg_iovlen= iovcnt;
+  return sendmsg(fd,&msg,MSG_NOSIGNAL);
+}
+
+int adns__tcp_write(adns_state ads, int fd, byte *buf, int len) {
+  struct iovec iov;
+
+  iov.iov_base= buf;
+  iov.iov_len= len;
+  return adns__tcp_writev(ads,fd,&iov,1);
+}
+
+#else /* !MSG_NOSIGNAL */
+
+static void sigpipe_protect(adns_state ads) {
   sigset_t toblock;
   struct sigaction sa;
   int r;
@@ -369,11 +530,34 @@ void adns__sigpipe_protect(adns_state ads) {
   r= sigaction(SIGPIPE,&sa,&ads->stdsigpipe); assert(!r);
 }
 
-void adns__sigpipe_unprotect(adns_state ads) {
-  int r;
+static void sigpipe_unprotect(adns_state ads) {
+  int r, e;
 
   if (ads->iflags & adns_if_nosigpipe) return;
 
+  e= errno;
   r= sigaction(SIGPIPE,&ads->stdsigpipe,0); assert(!r);
   r= sigprocmask(SIG_SETMASK,&ads->stdsigmask,0); assert(!r);
+  errno= e;
 }
+
+int adns__tcp_write(adns_state ads, int fd, byte *buf, int len) {
+  int r;
+
+  sigpipe_protect(ads);
+  r= write(fd,buf,len);
+  sigpipe_unprotect(ads);
+  return r;
+}
+
+int adns__tcp_writev(adns_state ads, int fd,
+		     struct iovec *iov, int iovcnt) {
+  int r;
+
+  sigpipe_protect(ads);
+  r= writev(fd,iov,iovcnt);
+  sigpipe_unprotect(ads);
+  return r;
+}
+
+#endif /* !MSG_NOSIGNAL */
@@ -41,6 +41,8 @@ typedef unsigned char byte;
 #include <stdlib.h>
 
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <net/if.h>
 
 #include "adns.h"
 #include "dlist.h"
@@ -52,13 +54,22 @@ typedef unsigned char byte;
 /* Configuration and constants */
 
 #define MAXSERVERS 5
-#define MAXSORTLIST 15
+#define MAXTCPCONNS 8 /* limit on adns_tcpconns: */
 #define UDPMAXRETRIES 15
 #define UDPRETRYMS 2000
-#define TCPWAITMS 30000
+#define TCPWAITMS 30000 /* defaults; see adns_tcptimeouts */
 #define TCPCONNMS 14000
 #define TCPIDLEMS 30000
 #define MAXTTLBELIEVE (7*86400) /* any TTL > 7 days is capped */
+#define QUERYSLABSZ 32 /* queries allocated from the heap at a time */
+#define CACHELINE 64 /* bytes; each query in a slab starts on a new one */
+#define ANSWERPOOLMAX 256 /* default cap on recycled answers kept */
+#define SORTMERGEMIN 8 /* adns__sort uses insertion sort up to this many */
+#define WANTEDRRS_STACK 32 /* answer RRs noted on the stack by procdgram */
+#define OWNERMEMO_MAX 8 /* names remembered by an ownermemo */
+#define URINGENTRIES 128 /* submission queue size, with adns_uring */
+#define URINGBUFS 64 /* receive buffers given to the kernel (power of 2) */
+#define URINGSENDS 64 /* datagrams which may be in the ring being sent */
 
 #define DNS_PORT 53
 #define DNS_MAXUDP 512
@@ -67,10 +78,27 @@ typedef unsigned char byte;
 #define DNS_HDRSIZE 12
 #define DNS_IDOFFSET 0
 #define DNS_CLASS_IN 1
+#define DNS_TYPE_OPT 41
+#define DNS_EDNSOPT_TCPKEEPALIVE 11 /* RFC7828 */
 
 #define DNS_INADDR_ARPA "in-addr", "arpa"
+#define DNS_IP6_ARPA "ip6", "arpa"
+#define DNS_MAXREVLABELS 64 /* 32 nibble labels for ip6.arpa */
 
-#define MAX_POLLFDS  ADNS_POLLFDS_RECOMMENDED
+#define adns__r_addr6 (adns_r_aaaa|adns__qtf_deref)
+  /* Internal type for the AAAA half of an adns_r_addr query which
+   * wants IPv6 addresses; its RRs are adns_rr_addr. */
+
+#define MAX_POLLFDS  (3+MAXSERVERS+MAXTCPCONNS)
+
+typedef union {
+  struct sockaddr sa;
+  struct sockaddr_in inet;
+  struct sockaddr_in6 inet6;
+} adns__sockaddr;
+
+#define ADNS__UDP_CMSGSPACE CMSG_SPACE(sizeof(unsigned))
+  /* Room for the ancillary data we ask for on UDP sockets. */
 
 typedef enum {
   cc_user,
@@ -101,8 +129,25 @@ typedef union {
 typedef struct {
   int used, avail;
   byte *buf;
+  adns_state ads; /* whose allocator to use; 0 means libc */
 } vbuf;
 
+typedef struct {
+  enum { glue_unindexed, glue_indexed, glue_unindexable } state;
+  int lookups, nrrs, mask;
+  int *rrstart, *next, *bucket;
+  unsigned long *hash;
+} glueindex;
+/* Index of the authority and additional sections of a datagram by
+ * hash of owner name, so that addresses for many hosts can be found
+ * without scanning those sections for each one.  It is built by
+ * types.c (in memory from adns__alloc_mine) on the second lookup;
+ * before that, or if the sections are malformed or truncated, the
+ * sections are scanned.  bucket[hash & mask] is the first RR with that
+ * hash bucket, and next[] chains them in ascending order; -1 ends.
+ * RRs 0..nscount-1 are the authority section, and the rest are the
+ * additional section. */
+
 typedef struct {
   adns_state ads;
   adns_query qu;
@@ -110,6 +155,7 @@ typedef struct {
   const byte *dgram;
   int dglen, nsstart, nscount, arcount;
   struct timeval now;
+  glueindex *glue; /* initially state glue_unindexed, lookups 0 */
 } parseinfo;
 
 typedef struct typeinfo {
@@ -164,6 +210,18 @@ typedef struct typeinfo {
    * them.  (This is really for the benefit of SRV's bizarre weighting
    * stuff.)  May be 0 to mean nothing needs to be done.
    */
+
+  int (*sortkey)(adns_state ads, const void *datap);
+  /* If non-0, the sort order given by diff_needswap is exactly that
+   * of this key, lowest first, so the RRs can be sorted by computing
+   * it once for each RR.  Must not fail.
+   */
+
+  void (*query_send)(adns_query qu, struct timeval now);
+  /* If non-0, called instead of adns__query_send once the query
+   * datagram has been built; it may instead submit child queries
+   * (and put qu on the childw queue).  Same rules as __query_send.
+   */
 } typeinfo;
 
 adns_status adns__qdpl_normal(adns_state ads,
@@ -196,20 +254,59 @@ typedef struct {
   } info;
 } qcontext;
 
+struct query_search {
+  vbuf vb;
+  int origlen, pos, doneabs;
+  /* Used by the searching algorithm.  The query domain in textual form
+   * is copied into the vbuf, and _origlen set to its length.  Then
+   * we walk the searchlist, if we want to.  _pos says where we are
+   * (next entry to try), and _doneabs says whether we've done the
+   * absolute query yet (0=not yet, 1=done, -1=must do straight away,
+   * but not done yet).
+   */
+};
+
+struct query_cname {
+  byte *dgram;
+  int dglen, begin;
+  /* The datagram containing the CNAME we are following, and the
+   * offset of the canonical name in it.  Allocated (together with
+   * the datagram copy) using adns__alloc_mine.
+   */
+};
+
 struct adns__query {
+  /* The members used on every pass through the event loop come first,
+   * so that on LP64 they occupy the first 64 bytes, which are a whole
+   * cache line since queries live in struct queryslab.
+   *
+   * On LP64 this structure is 272 bytes, and its slot in a slab 320.
+   * A plain A or PTR query in flight also has an answer header (56
+   * bytes) and its query datagram (typically under 64 bytes)
+   * allocated, so costs around 470 bytes including malloc overhead:
+   * 1M concurrent queries need about 470MB.
+   */
   adns_state ads;
+  adns_query back, next;
+  struct timeval timeout;
+  unsigned long udpsent; /* bitmap indexed by server */
   enum { query_tosend, query_tcpw, query_childw, query_done } state;
-  adns_query back, next, parent;
+  int id, flags, retries;
+
+  int udpnextserver;
+  int tcpconn; /* index in ads->tcp, or -1; only meaningful in tcpw */
+  const typeinfo *typei;
+  byte *query_dgram;
+  int query_dglen;
+  int tcpsent; /* in tcpw: written (or buffered) on our connection */
+
+  adns_query parent;
   struct { adns_query head, tail; } children;
   struct { adns_query back, next; } siblings;
   struct { allocnode *head, *tail; } allocations;
   int interim_allocd, preserved_allocd;
   void *final_allocspace;
 
-  const typeinfo *typei;
-  byte *query_dgram;
-  int query_dglen;
-
   vbuf vb;
   /* General-purpose messing-about buffer.
    * Wherever a `big' interface is crossed, this may be corrupted/changed
@@ -227,25 +324,12 @@ struct adns__query {
    * in which case it is set only when we find an answer.
    */
 
-  byte *cname_dgram;
-  int cname_dglen, cname_begin;
-  /* If non-0, has been allocated using . */
-
-  vbuf search_vb;
-  int search_origlen, search_pos, search_doneabs;
-  /* Used by the searching algorithm.  The query domain in textual form
-   * is copied into the vbuf, and _origlen set to its length.  Then
-   * we walk the searchlist, if we want to.  _pos says where we are
-   * (next entry to try), and _doneabs says whether we've done the
-   * absolute query yet (0=not yet, 1=done, -1=must do straight away,
-   * but not done yet).  If flags doesn't have adns_qf_search then
-   * the vbuf is initialised but empty and everything else is zero.
+  struct query_cname *cname; /* 0 unless we have found a CNAME */
+  struct query_search *search;
+  /* Allocated when the query is submitted if it has adns_qf_search,
+   * and freed with the other query allocations; otherwise 0.
    */
 
-  int id, flags, retries;
-  int udpnextserver;
-  unsigned long udpsent; /* bitmap indexed by server */
-  struct timeval timeout;
   time_t expires; /* Earliest expiry time of any record we used. */
 
   qcontext ctx;
@@ -260,13 +344,18 @@ struct adns__query {
    *
    *  tcpw    tcpw    null   >=0  irrelevant     any         any
    *
+   * A query in tcpw is assigned to one of the TCP connections in
+   * ads->tcp (qu->tcpconn), or to none (-1) if they are all broken.
+   *
    *  child   childw  set    >=0  irrelevant     irrelevant  irrelevant
    *  child   NONE    null   >=0  irrelevant     irrelevant  irrelevant
    *  done    output  null   -1   irrelevant     irrelevant  irrelevant
    *
    * Queries are only not on a queue when they are actually being processed.
    * Queries in state tcpw/tcpw have been sent (or are in the to-send buffer)
-   * iff the tcp connection is in state server_ok.
+   * iff tcpsent is set, which is only so if their tcp connection is in
+   * state server_ok; with adns_tcpinflight: some may still be waiting
+   * for a turn even then.
    *
    *			      +------------------------+
    *             START -----> |      tosend/NONE       |
@@ -306,6 +395,42 @@ struct adns__query {
 
 struct query_queue { adns_query head, tail; };
 
+enum adns__tcpstate {
+  server_disconnected, server_connecting,
+  server_ok, server_broken
+};
+
+struct tcpconn {
+  int fd, serv, recv_skip, send_skip;
+  int nqueries; /* number of queries in tcpw assigned to us */
+  int ninflight; /* how many of those have been sent (tcpsent) */
+  int idlems; /* from the server's edns-tcp-keepalive, or -1 */
+  enum adns__tcpstate state;
+  vbuf send, recv;
+  /* The first send_skip bytes of send have already been written.
+   * When everything has been written send is emptied; otherwise the
+   * written prefix is only discarded (by querysend_tcp) once it is
+   * at least as long as the remainder, so copying stays linear.
+   */
+  struct timeval timeout;
+  /* This will have tv_sec==0 if it is not valid.  It will always be
+   * valid if state is _connecting.  When _ok, it will be nonzero if
+   * we are idle (ie, nqueries is 0), in which case it is the
+   * absolute time when we will close the connection.
+   */
+};
+
+struct queryslab {
+  /* qus comes first, and the slab is aligned to CACHELINE within the
+   * block we allocate, so that each query starts a cache line. */
+  union queryslot {
+    struct adns__query qu;
+    byte pad[(sizeof(struct adns__query)+CACHELINE-1)/CACHELINE*CACHELINE];
+  } qus[QUERYSLABSZ];
+  struct queryslab *next;
+  void *block; /* as returned by adns__malloc */
+};
+
 struct adns__state {
   adns_initflags iflags;
   adns_logcallbackfn *logfn;
@@ -313,35 +438,76 @@ struct adns__state {
   int configerrno;
   struct query_queue udpw, tcpw, childw, output;
   adns_query forallnext;
-  int nextid, udpsocket, tcpsocket;
-  vbuf tcpsend, tcprecv;
-  int nservers, nsortlist, nsearchlist, searchndots, tcpserver, tcprecv_skip;
-  enum adns__tcpstate {
-    server_disconnected, server_connecting,
-    server_ok, server_broken
-  } tcpstate;
-  struct timeval tcptimeout;
-  /* This will have tv_sec==0 if it is not valid.  It will always be
-   * valid if tcpstate _connecting.  When _ok, it will be nonzero if
-   * we are idle (ie, tcpw queue is empty), in which case it is the
-   * absolute time when we will close the connection.
+  int nextid, udpsocket;
+  int udpsocket6; /* only if there is an IPv6 nameserver, otherwise -1 */
+  int nservers, nsortlist, nsearchlist, searchndots, tcpserver, ntcp;
+  int tcpproto; /* from getprotobyname at init, or -1 if none */
+  int tcpfastopen, tcpprewarm; /* options adns_tcpfastopen, _tcpprewarm */
+  int tcpwaitms, tcpconnms, tcpidlems, tcpkeepalive;
+  int tcpinflight; /* adns_tcpinflight:, limit on ninflight; 0 => none */
+  int udprcvbuf, udpsndbuf; /* adns_udprcvbuf:, _udpsndbuf:; 0 => default */
+  int udpdropstats; /* option adns_udpdrops */
+  unsigned long udpdrops; /* replies dropped by the kernel, if udpdropstats */
+  unsigned udpovfl, udpovfl6; /* last SO_RXQ_OVFL counts on udpsocket[6] */
+  int uringwanted; /* option adns_uring */
+  struct adns__uring *uring; /* 0 unless we are using an io_uring */
+  struct tcpconn tcp[MAXTCPCONNS];
+  /* The TCP connection pool: ntcp (adns_tcpconns:) slots, of which
+   * those in use may be connected to different servers.  New
+   * connections are made to tcpserver, which moves on to the next
+   * server whenever a connection to it breaks.
    */
+#ifndef MSG_NOSIGNAL
   struct sigaction stdsigpipe;
   sigset_t stdsigmask;
+#endif
   struct pollfd pollfds_buf[MAX_POLLFDS];
   struct server {
-    struct in_addr addr;
+    int len; /* of addr, which includes the port */
+    adns__sockaddr addr;
+    int srclen; /* of src, or 0 if we do not bind to a source address */
+    adns__sockaddr src;
+    char ifname[IFNAMSIZ]; /* "" unless we bind to an interface */
+    int udpsocket; /* our own if we bind (src or ifname), otherwise -1 */
+    unsigned udpovfl; /* last SO_RXQ_OVFL count on udpsocket */
   } servers[MAXSERVERS];
-  struct sortlist {
-    struct in_addr base, mask;
-  } sortlist[MAXSORTLIST];
+  struct sortlist_node {
+    struct sortlist_node *child[2];
+    byte prefix[16]; /* network byte order; bits beyond plen are zero */
+    int plen, prec;
+  } *sortlist_inet, *sortlist_inet6;
   char **searchlist;
   unsigned short rand48xsubi[3];
+  adns_allocator allocator; /* all zero if libc is to be used */
+  struct {
+    struct queryslab *slabs;
+    adns_query head; /* free list, linked through next */
+    int nfree, nlive, hwm;
+  } qupool;
+  struct {
+    adns_answer *head; /* free list, linked through the first word */
+    int nfree, max;
+  } anspool;
+  /* Query structures are carved out of slabs which are only returned
+   * to the heap by adns_finish; so the footprint is that of the
+   * largest number of queries ever in existence at once.  Answer
+   * headers handed back with adns_answer_release are kept for reuse,
+   * but no more than qupool.hwm of them and no more than anspool.max.
+   */
 };
 
 /* From setup.c: */
 
 int adns__setnonblock(adns_state ads, int fd); /* => errno value */
+int adns__server_bind(adns_state ads, int serv, int fd); /* => errno value */
+/* Binds fd (a new socket of the server's family) to the source
+ * address and/or interface configured for the server, if any. */
+
+int adns__sortlist_find(adns_state ads, int af, const void *addr);
+/* Returns the precedence of addr (an in_addr or in6_addr according
+ * to af) in the sortlist: the index of the first sortlist entry
+ * which matches it, or ads->nsortlist if none does.
+ */
 
 /* From general.c: */
 
@@ -359,12 +525,20 @@ void adns__warn(adns_state ads, int serv, adns_query qu,
 void adns__diag(adns_state ads, int serv, adns_query qu,
 		const char *fmt, ...) PRINTFFORMAT(4,5);
 
+void *adns__malloc(adns_state ads, size_t sz);
+void *adns__realloc(adns_state ads, void *p, size_t sz);
+void adns__free(adns_state ads, void *p);
+/* Like malloc, realloc and free, but using the allocator supplied to
+ * adns_init_allocator, if any.  ads may be 0, meaning libc.
+ * adns__free(ads,0) is permitted and does nothing.
+ */
+
 int adns__vbuf_ensure(vbuf *vb, int want);
 int adns__vbuf_appendstr(vbuf *vb, const char *data); /* doesn't include nul */
 int adns__vbuf_append(vbuf *vb, const byte *data, int len);
 /* 1=>success, 0=>realloc failed */
 void adns__vbuf_appendq(vbuf *vb, const byte *data, int len);
-void adns__vbuf_init(vbuf *vb);
+void adns__vbuf_init(vbuf *vb, adns_state ads); /* ads may be 0 */
 void adns__vbuf_free(vbuf *vb);
 
 const char *adns__diag_domain(adns_state ads, int serv, adns_query qu,
@@ -381,6 +555,30 @@ const char *adns__diag_domain(adns_state ads, int serv, adns_query qu,
  * vb before using the return value.
  */
 
+#define ADNS__SOCKADDR_NTOA_BUFLEN (INET6_ADDRSTRLEN+11)
+
+const char *adns__sockaddr_ntoa(const struct sockaddr *sa, char *buf);
+/* Formats the address (not the port) of an AF_INET or AF_INET6
+ * sockaddr, with its scope id (if any) as %<number>, into buf, which
+ * must have room for ADNS__SOCKADDR_NTOA_BUFLEN bytes.  Returns buf.
+ */
+
+int adns__sockaddr_equal(const struct sockaddr *a, const struct sockaddr *b,
+			 int ports);
+/* Whether a and b have the same family and address (and port, if
+ * ports is nonzero).  Both must be AF_INET or AF_INET6.  For AF_INET6
+ * the scope ids must match too, unless a's is 0 (as for a nameserver
+ * configured without one), which matches any.  So a should be the
+ * configured address and b the one we are checking against it.
+ */
+
+int adns__server_socket(adns_state ads, int serv);
+/* Returns our UDP socket for talking to the server: its own if it has
+ * a source address or interface, otherwise the shared one for its
+ * family.  Returns -1 if we could not make that socket (its own, or
+ * the IPv6 one); that has already been reported.
+ */
+
 void adns__isort(void *array, int nobjs, int sz, void *tempbuf,
 		 int (*needswap)(void *context, const void *a, const void *b),
 		 void *context);
@@ -390,13 +588,34 @@ void adns__isort(void *array, int nobjs, int sz, void *tempbuf,
  * wrong order) 0 if a<=b (ie, order is fine).
  */
 
-void adns__sigpipe_protect(adns_state);
-void adns__sigpipe_unprotect(adns_state);
-/* If SIGPIPE protection is not disabled, will block all signals except
- * SIGPIPE, and set SIGPIPE's disposition to SIG_IGN.  (And then restore.)
- * Each call to _protect must be followed by a call to _unprotect before
- * any significant amount of code gets to run, since the old signal mask
- * is stored in the adns structure.
+void adns__sort(void *array, int nobjs, int sz, void *tempbuf,
+		int (*needswap)(void *context, const void *a, const void *b),
+		void *context);
+/* Like adns__isort, and also stable, but a merge sort (falling back
+ * to insertion sort for runs of up to SORTMERGEMIN objects) so
+ * O(nobjs log nobjs).  tempbuf must be at least nobjs*sz bytes long.
+ */
+
+int adns__sort_bykey(adns_state ads, void *array, int nobjs, int sz,
+		     vbuf *tempvb,
+		     int (*sortkey)(adns_state ads, const void *datap));
+/* Stably sorts array by the value of sortkey, which is called once
+ * for each object.  Does nothing if there is no sortlist, since our
+ * only keys are sortlist precedences.  tempvb is used as scratch
+ * space and may be left in any state.  Returns 0 if it runs out of
+ * memory (in which case array is unchanged), 1 otherwise.
+ */
+
+int adns__tcp_write(adns_state ads, int fd, byte *buf, int len);
+int adns__tcp_writev(adns_state ads, int fd,
+		     struct iovec *iov, int iovcnt);
+/* Like write and writev, but for our TCP sockets: they never raise
+ * SIGPIPE.  Where the system has MSG_NOSIGNAL they are sendmsg with
+ * that flag, and the signal state is not touched.
+ * Otherwise, unless SIGPIPE protection is disabled (adns_if_nosigpipe),
+ * the write is done with all signals except SIGPIPE blocked and with
+ * SIGPIPE's disposition set to SIG_IGN, and these are then restored.
+ * errno is preserved from the write.
  */
 
 /* From transmit.c: */
@@ -408,6 +627,30 @@ adns_status adns__mkquery(adns_state ads, vbuf *vb, int *id_r,
 /* Assembles a query packet in vb.  A new id is allocated and returned.
  */
 
+extern const byte adns__decimal_label[256][4];
+/* adns__decimal_label[n] is n in decimal as a DNS label: a length
+ * byte followed by the digits.
+ */
+
+int adns__revlabels(int af, const void *addr,
+		    byte labels_r[DNS_MAXREVLABELS], int *nlabels_r);
+/* Writes the labels (without a terminating root label) of the
+ * reverse-lookup name for addr, a struct in_addr or in6_addr, as
+ * found before the zone: d.c.b.a for AF_INET, or the 32 nibbles for
+ * AF_INET6.  Returns the number of bytes; the number of labels is
+ * stored in *nlabels_r.  af must be one of those two.
+ */
+
+adns_status adns__mkquery_prefix(adns_state ads, vbuf *vb, int *id_r,
+				 const byte *labels, int ll, int nlabels,
+				 const char *zone, int zl,
+				 const typeinfo *typei, adns_rrtype type,
+				 adns_queryflags flags);
+/* Same as adns__mkquery, but the owner is the ll bytes of wire-format
+ * labels (nlabels of them, with no root label) followed by the text
+ * domain zone, which must not have a trailing `.'.
+ */
+
 adns_status adns__mkquery_frdgram(adns_state ads, vbuf *vb, int *id_r,
 				  const byte *qd_dgram, int qd_dglen,
 				  int qd_begin,
@@ -417,9 +660,16 @@ adns_status adns__mkquery_frdgram(adns_state ads, vbuf *vb, int *id_r,
  */
 
 void adns__querysend_tcp(adns_query qu, struct timeval now);
-/* Query must be in state tcpw/tcpw; it will be sent if possible and
- * no further processing can be done on it for now.  The connection
- * might be broken, but no reconnect will be attempted.
+/* Query must be in state tcpw/tcpw; it is assigned to a connection
+ * if it has not been already, and will be sent if that connection is
+ * up, and no further processing can be done on it for now.  The
+ * connection might be broken, but no reconnect will be attempted.
+ */
+
+void adns__query_usetcp(adns_query qu, struct timeval now);
+/* Query must be in state tosend/NONE and on no queue; it is sent (or
+ * will be) over TCP, as if _qf_usevc were set.  Used by __query_send,
+ * and when the kernel says a UDP datagram is too big to send.
  */
 
 void adns__query_send(adns_query qu, struct timeval now);
@@ -533,9 +783,31 @@ void adns__reset_preserved(adns_query qu);
  * in a datagram and discover that we need to retry the query.
  */
 
+void adns__query_recycle(adns_query qu);
+/* Returns the query structure (not anything it points to) to the
+ * state's query pool.  The query must not be on any queue.
+ */
+
+void adns__pools_free(adns_state ads);
+/* Returns all pooled query slabs and answers to the heap.  Only for
+ * adns_finish; there must be no queries left.
+ */
+
 void adns__query_done(adns_query qu);
 void adns__query_fail(adns_query qu, adns_status stat);
 
+int adns__query_flatrrs(adns_query qu, int nrrs);
+void adns__query_done_flat(adns_query qu);
+/* Fast path for answers whose RRs contain no pointers, used by
+ * adns__procdgram when the query has nothing in interim memory (no
+ * CNAME, no owner, not a child).  _flatrrs enlarges qu->answer so that
+ * it has room for nrrs RRs laid out as makefinal would leave them, and
+ * points rrs at that; it returns 0 if memory runs out.  The caller
+ * fills in the RRs and nrrs and calls _done_flat, which finishes the
+ * query as adns__query_done would but without copying the RRs.  On
+ * error (before _done_flat) adns__query_fail may still be used.
+ */
+
 /* From reply.c: */
 
 void adns__procdgram(adns_state ads, const byte *dgram, int len,
@@ -549,6 +821,13 @@ void adns__procdgram(adns_state ads, const byte *dgram, int len,
  * Sending functions may NOT call receiving functions.
  */
 
+int adns__tcpkeepalive(const byte *dgram, int dglen);
+/* Looks in the additional section of the reply dgram for an OPT RR
+ * with an edns-tcp-keepalive option (RFC7828), and returns the idle
+ * timeout it gives in milliseconds, or -1 if there is none (or the
+ * reply is malformed, which procdgram will deal with and report).
+ */
+
 /* From types.c: */
 
 const typeinfo *adns__findtype(adns_rrtype type);
@@ -627,11 +906,26 @@ adns_status adns__parse_domain_more(findlabel_state *fls, adns_state ads,
  * the existing contents.
  */
 
+typedef struct {
+  int n, next;
+  struct { int offset, matched; } ent[OWNERMEMO_MAX];
+} ownermemo;
+/* Remembers, for one datagram and one expected owner, whether the
+ * domain at various offsets in the datagram is that owner.  Since
+ * most owners are compression pointers to a few names (usually the
+ * question) this lets adns__findrr_anychk skip the comparison. */
+
+void adns__ownermemo_init(ownermemo *om, const byte *dgram, int dglen,
+			  int known);
+/* Initialises *om.  If known is not -1 then the domain at offset
+ * known in dgram (which must be valid and untruncated) is the
+ * expected owner. */
+
 adns_status adns__findrr(adns_query qu, int serv,
 			 const byte *dgram, int dglen, int *cbyte_io,
 			 int *type_r, int *class_r, unsigned long *ttl_r,
 			 int *rdlen_r, int *rdstart_r,
-			 int *ownermatchedquery_r);
+			 int *ownermatchedquery_r, ownermemo *memo);
 /* Finds the extent and some of the contents of an RR in a datagram
  * and does some checks.  The datagram is *dgram, length dglen, and
  * the RR starts at *cbyte_io (which is updated afterwards to point
@@ -653,6 +947,9 @@ adns_status adns__findrr(adns_query qu, int serv,
  *
  * qu must obviously be non-null.
  *
+ * memo may be 0; otherwise it must have been set up for this
+ * datagram and for whichever owner we are comparing with.
+ *
  * If an error is returned then *type_r will be undefined too.
  */
 
@@ -662,7 +959,8 @@ adns_status adns__findrr_anychk(adns_query qu, int serv,
 				unsigned long *ttl_r,
 				int *rdlen_r, int *rdstart_r,
 				const byte *eo_dgram, int eo_dglen,
-				int eo_cbyte, int *eo_matched_r);
+				int eo_cbyte, int *eo_matched_r,
+				ownermemo *memo);
 /* Like adns__findrr_checked, except that the datagram and
  * owner to compare with can be specified explicitly.
  *
@@ -687,10 +985,26 @@ int vbuf__append_quoted1035(vbuf *vb, const byte *buf, int len);
 
 /* From event.c: */
 
-void adns__tcp_broken(adns_state ads, const char *what, const char *why);
+void adns__tcp_broken(adns_state ads, struct tcpconn *c,
+		      const char *what, const char *why);
 /* what and why may be both 0, or both non-0. */
 
-void adns__tcp_tryconnect(adns_state ads, struct timeval now);
+void adns__tcp_tryconnect(adns_state ads, struct tcpconn *c,
+			  struct timeval now);
+
+void adns__tcp_assign(adns_query qu);
+/* qu must be in tcpw and not assigned to a connection.  Assigns it
+ * to the least loaded connection (connected or connecting), or to an
+ * unused slot if all of those have queries outstanding.  If every
+ * slot is broken qu->tcpconn is left as -1.
+ */
+
+void adns__tcp_release(adns_query qu);
+/* Called when qu leaves tcpw: it is no longer assigned to (or counted
+ * in the load of) its connection, and if it had been sent its place
+ * in the connection's in-flight limit is freed (the next waiting query
+ * is sent by the event loop, not here).
+ */
 
 void adns__autosys(adns_state ads, struct timeval now);
 /* Make all the system calls we want to if the application wants us to.
@@ -719,6 +1033,66 @@ void adns__timeouts(adns_state ads, int act,
  * if previous events broke it or require it to be connected.
  */
 
+int adns__udp_byfd(adns_state ads, int fd, unsigned **ovfl_r);
+/* Returns the address family of our UDP socket fd, or 0 if fd is
+ * not one of ours, and sets *ovfl_r to its last drop count.
+ */
+
+void adns__udp_ovfl(adns_state ads, struct msghdr *msg, unsigned *ovfl_io);
+/* Picks up the kernel's count of datagrams dropped on the socket
+ * (SO_RXQ_OVFL, which it sends only once there have been some) from
+ * the ancillary data of a received msg, and adds any new drops to
+ * ads->udpdrops.
+ */
+
+void adns__udp_dgram(adns_state ads, int fd, int af,
+		     const byte *dgram, int dglen,
+		     const adns__sockaddr *addr, int addrlen,
+		     struct timeval now);
+/* Deals with a datagram received on our UDP socket fd (of family af)
+ * from addr: checks that it came from a nameserver we use with that
+ * socket, and if so passes it to adns__procdgram.
+ */
+
+/* From uring.c: */
+
+int adns__uring_init(adns_state ads); /* => errno value */
+/* Sets up ads->uring, with a multishot receive on each UDP socket.
+ * Fails with ENOSYS if adns was built without io_uring support, or
+ * with whatever the kernel said; the caller then carries on without.
+ */
+
+void adns__uring_finish(adns_state ads);
+/* Cancels the ring's receives and any sends still in progress, waits
+ * for the kernel to finish with them, and frees the ring. */
+
+int adns__uring_fd(adns_state ads);
+/* The ring's fd, which is readable when there are completions to
+ * reap, or -1 if we are not using a ring. */
+
+int adns__uring_receiving(adns_state ads, int fd);
+/* Whether the ring is doing the reads for the UDP socket fd (so that
+ * it must not be polled or read). */
+
+int adns__uring_send(adns_state ads, int serv, int fd,
+		     const byte *dgram, int dglen);
+/* Queues dgram to be sent to serv on fd by the ring.  Returns 0 if
+ * it cannot (no ring, or no room), in which case the caller must send
+ * it itself.  Queued sends are given to the kernel together by
+ * adns__uring_submit.
+ */
+
+void adns__uring_submit(adns_state ads);
+/* Gives the kernel whatever we have queued (and rearms any receives
+ * which have stopped).  Called by adns__pollfds, ie whenever the
+ * application is about to wait, and by adns__uring_reap. */
+
+int adns__uring_reap(adns_state ads, struct timeval now);
+/* Processes the completions in the ring: received datagrams go to
+ * adns__udp_dgram, and a query whose datagram was too big to send
+ * switches to TCP.  Returns 0 or an errno value as for
+ * adns_processreadable. */
+
 /* From check.c: */
 
 void adns__consistency(adns_state ads, adns_query qu, consistency_checks cc);
@@ -735,9 +1109,6 @@ static inline int ctype_alpha(int c) {
 static inline int ctype_822special(int c) {
   return strchr("()<>@,;:\\\".[]",c) != 0;
 }
-static inline int ctype_domainunquoted(int c) {
-  return ctype_alpha(c) || ctype_digit(c) || (strchr("-_/+",c) != 0);
-}
 
 static inline int errno_resources(int e) { return e==ENOMEM || e==ENOBUFS; }
 
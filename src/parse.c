@@ -26,32 +26,105 @@
 
 #include "internal.h"
 
+/* Length of each byte when quoted as for RFC1035 master files: 1 for
+ * characters which are left alone, 2 for those which are escaped with
+ * a backslash, and 4 for those which are written as \ooo. */
+static const byte quotedlen[256]= {
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 2, 1, 2, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2,
+  2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 1,
+  2, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+  4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
+};
+
 int vbuf__append_quoted1035(vbuf *vb, const byte *buf, int len) {
-  char qbuf[10];
-  int i, ch;
-  
-  while (len) {
-    qbuf[0]= 0;
-    for (i=0; i<len; i++) {
-      ch= buf[i];
-      if (ch <= ' ' || ch >= 127) {
-	sprintf(qbuf,"\\%03o",ch);
-	break;
-      } else if (!ctype_domainunquoted(ch)) {
-	sprintf(qbuf,"\\%c",ch);
-	break;
-      }
+  int i, ch, qlen;
+  byte *p;
+
+  for (i=0, qlen=0; i<len; i++) qlen+= quotedlen[buf[i]];
+  if (!adns__vbuf_ensure(vb, vb->used+qlen)) return 0;
+  p= vb->buf + vb->used;
+  for (i=0; i<len; i++) {
+    ch= buf[i];
+    switch (quotedlen[ch]) {
+    case 1:
+      *p++= ch;
+      break;
+    case 2:
+      *p++= '\\'; *p++= ch;
+      break;
+    default:
+      *p++= '\\';
+      *p++= '0' + (ch>>6);
+      *p++= '0' + ((ch>>3) & 7);
+      *p++= '0' + (ch & 7);
     }
-    if (!adns__vbuf_append(vb,buf,i) ||
-	!adns__vbuf_append(vb,qbuf,strlen(qbuf)))
-      return 0;
-    if (i<len) i++;
-    buf+= i;
-    len-= i;
   }
+  vb->used+= qlen;
   return 1;
 }
 
+/* Classification of bytes in hostname labels, for
+ * adns__parse_domain_more: LC_LD for letters and digits, which may
+ * appear anywhere, and LC_H for hyphen, which may not start a label.
+ * A label is valid iff the AND of the entries for all its bytes,
+ * with the first one shifted right, is nonzero. */
+#define LC_H  1
+#define LC_LD 3
+static const byte labelchars[256]= {
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     LC_H,  0,     0,
+  LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD,
+  LC_LD, LC_LD, 0,     0,     0,     0,     0,     0,
+  0,     LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD,
+  LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD,
+  LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD,
+  LC_LD, LC_LD, LC_LD, 0,     0,     0,     0,     0,
+  0,     LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD,
+  LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD,
+  LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD, LC_LD,
+  LC_LD, LC_LD, LC_LD, 0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+  0,     0,     0,     0,     0,     0,     0,     0,
+};
+
+static int label_valid(const byte *p, int len) {
+  int i, valid;
+
+  valid= labelchars[p[0]] >> 1;
+  for (i=1; i<len; i++) valid &= labelchars[p[i]];
+  return valid;
+}
+
 void adns__findlabel_start(findlabel_state *fls, adns_state ads,
 			   int serv, adns_query qu,
 			   const byte *dgram, int dglen, int max,
@@ -127,47 +200,76 @@ adns_status adns__parse_domain_more(findlabel_state *fls, adns_state ads,
 				    adns_query qu, vbuf *vb,
 				    parsedomain_flags flags,
 				    const byte *dgram) {
-  int lablen, labstart, i, ch, first;
+  int lablen, labstart, first;
   adns_status st;
 
+  if (!(flags & pdf_quoteok)) {
+    /* findlabel_next limits the name to DNS_MAXDOMAIN, so this is
+     * all the space we will need. */
+    if (!adns__vbuf_ensure(vb, vb->used + DNS_MAXDOMAIN + 1))
+      return adns_s_nomemory;
+  }
   first= 1;
   for (;;) {
     st= adns__findlabel_next(fls,&lablen,&labstart);
     if (st) return st;
     if (lablen<0) { vb->used=0; return adns_s_ok; }
     if (!lablen) break;
-    if (first) {
-      first= 0;
-    } else {
-      if (!adns__vbuf_append(vb,".",1)) return adns_s_nomemory;
-    }
     if (flags & pdf_quoteok) {
+      if (!first && !adns__vbuf_append(vb,".",1)) return adns_s_nomemory;
       if (!vbuf__append_quoted1035(vb,dgram+labstart,lablen))
 	return adns_s_nomemory;
     } else {
-      ch= dgram[labstart];
-      if (!ctype_alpha(ch) && !ctype_digit(ch))
+      if (!label_valid(dgram+labstart,lablen))
 	return adns_s_answerdomaininvalid;
-      for (i= labstart+1; i<labstart+lablen; i++) {
-	ch= dgram[i];
-	if (ch != '-' && !ctype_alpha(ch) && !ctype_digit(ch))
-	  return adns_s_answerdomaininvalid;
-      }
-      if (!adns__vbuf_append(vb,dgram+labstart,lablen))
-	return adns_s_nomemory;
+      if (!first) adns__vbuf_appendq(vb,".",1);
+      adns__vbuf_appendq(vb,dgram+labstart,lablen);
     }
+    first= 0;
   }
   if (!adns__vbuf_append(vb,"",1)) return adns_s_nomemory;
   return adns_s_ok;
 }
 	
+static int ownermemo_key(const byte *dgram, int dglen, int cbyte) {
+  /* A domain which is just a compression pointer is the same as the
+   * one it points to, so we index the memo by the latter. */
+  if (cbyte+2 <= dglen && (dgram[cbyte] & 0x0c0) == 0x0c0)
+    return ((dgram[cbyte] & 0x03f) << 8) | dgram[cbyte+1];
+  return cbyte;
+}
+
+void adns__ownermemo_init(ownermemo *om, const byte *dgram, int dglen,
+			  int known) {
+  om->n= om->next= 0;
+  if (known == -1) return;
+  om->ent[0].offset= ownermemo_key(dgram,dglen,known);
+  om->ent[0].matched= 1;
+  om->n= 1;
+}
+
+static void ownermemo_record(ownermemo *om, int offset, int matched) {
+  int i;
+
+  if (om->n < OWNERMEMO_MAX) {
+    i= om->n++;
+  } else {
+    /* Evict round-robin, but never the seed in slot 0. */
+    i= om->next + 1;
+    om->next= (om->next + 1) % (OWNERMEMO_MAX-1);
+  }
+  om->ent[i].offset= offset;
+  om->ent[i].matched= matched;
+}
+
 adns_status adns__findrr_anychk(adns_query qu, int serv,
 				const byte *dgram, int dglen, int *cbyte_io,
 				int *type_r, int *class_r,
 				unsigned long *ttl_r,
 				int *rdlen_r, int *rdstart_r,
 				const byte *eo_dgram, int eo_dglen,
-				int eo_cbyte, int *eo_matched_r) {
+				int eo_cbyte, int *eo_matched_r,
+				ownermemo *memo) {
   findlabel_state fls, eo_fls_buf;
   findlabel_state *eo_fls; /* 0 iff we know it's not matching eo_... */
   int cbyte;
@@ -176,10 +278,25 @@ adns_status adns__findrr_anychk(adns_query qu, int serv,
   unsigned long ttl;
   int lablen, labstart, ch;
   int eo_lablen, eo_labstart, eo_ch;
+  int memokey, i;
   adns_status st;
 
   cbyte= *cbyte_io;
 
+  if (memo && eo_dgram) {
+    memokey= ownermemo_key(dgram,dglen,cbyte);
+    if (memokey != cbyte) {
+      for (i=0; i<memo->n; i++) {
+	if (memo->ent[i].offset != memokey) continue;
+	*eo_matched_r= memo->ent[i].matched;
+	cbyte += 2;
+	goto x_ownerdone;
+      }
+    }
+  } else {
+    memokey= -1;
+  }
+
   adns__findlabel_start(&fls,qu->ads, serv,qu, dgram,dglen,dglen,cbyte,&cbyte);
   if (eo_dgram) {
     eo_fls= &eo_fls_buf;
@@ -207,7 +324,9 @@ adns_status adns__findrr_anychk(adns_query qu, int serv,
     if (!lablen) break;
   }
   if (eo_matched_r) *eo_matched_r= !!eo_fls;
-   
+  if (memokey != -1) ownermemo_record(memo,memokey,!!eo_fls);
+
+ x_ownerdone:
   if (cbyte+10>dglen) goto x_truncated;
   GET_W(cbyte,tmp); *type_r= tmp;
   GET_W(cbyte,tmp); *class_r= tmp;
@@ -232,23 +351,23 @@ adns_status adns__findrr(adns_query qu, int serv,
 			 const byte *dgram, int dglen, int *cbyte_io,
 			 int *type_r, int *class_r, unsigned long *ttl_r,
 			 int *rdlen_r, int *rdstart_r,
-			 int *ownermatchedquery_r) {
+			 int *ownermatchedquery_r, ownermemo *memo) {
   if (!ownermatchedquery_r) {
     return adns__findrr_anychk(qu,serv,
 			       dgram,dglen,cbyte_io,
 			       type_r,class_r,ttl_r,rdlen_r,rdstart_r,
-			       0,0,0, 0);
-  } else if (!qu->cname_dgram) {
+			       0,0,0, 0, 0);
+  } else if (!qu->cname) {
     return adns__findrr_anychk(qu,serv,
 			       dgram,dglen,cbyte_io,
 			       type_r,class_r,ttl_r,rdlen_r,rdstart_r,
 			       qu->query_dgram,qu->query_dglen,DNS_HDRSIZE,
-			       ownermatchedquery_r);
+			       ownermatchedquery_r, memo);
   } else {
     return adns__findrr_anychk(qu,serv,
 			       dgram,dglen,cbyte_io,
 			       type_r,class_r,ttl_r,rdlen_r,rdstart_r,
-			       qu->cname_dgram,qu->cname_dglen,qu->cname_begin,
-			       ownermatchedquery_r);
+			       qu->cname->dgram,qu->cname->dglen,qu->cname->begin,
+			       ownermatchedquery_r, memo);
   }
 }
@@ -36,17 +36,112 @@
 
 #include "internal.h"
 
+/* Query and answer object pools. */
+
+static adns_query query_get(adns_state ads) {
+  /* Takes a query structure from the free list, carving a new slab
+   * off the heap if the list is empty.  The contents are garbage.
+   */
+  struct queryslab *slab;
+  adns_query qu;
+  void *block;
+  int i;
+
+  if (!ads->qupool.head) {
+    block= adns__malloc(ads,sizeof(*slab)+CACHELINE-1);
+    if (!block) return 0;
+    slab= (struct queryslab*)
+      (((unsigned long)block + CACHELINE-1) & ~(unsigned long)(CACHELINE-1));
+    slab->block= block;
+    slab->next= ads->qupool.slabs;
+    ads->qupool.slabs= slab;
+    for (i=QUERYSLABSZ-1; i>=0; i--) {
+      slab->qus[i].qu.next= ads->qupool.head;
+      ads->qupool.head= &slab->qus[i].qu;
+    }
+    ads->qupool.nfree += QUERYSLABSZ;
+  }
+  qu= ads->qupool.head;
+  ads->qupool.head= qu->next;
+  ads->qupool.nfree--;
+  if (++ads->qupool.nlive > ads->qupool.hwm)
+    ads->qupool.hwm= ads->qupool.nlive;
+  return qu;
+}
+
+void adns__query_recycle(adns_query qu) {
+  adns_state ads= qu->ads;
+
+  qu->next= ads->qupool.head;
+  ads->qupool.head= qu;
+  ads->qupool.nfree++;
+  ads->qupool.nlive--;
+}
+
+static adns_answer *answer_get(adns_state ads) {
+  adns_answer *ans;
+
+  ans= ads->anspool.head;
+  if (!ans) return adns__malloc(ads,sizeof(*ans));
+  ads->anspool.head= *(adns_answer**)ans;
+  ads->anspool.nfree--;
+  return ans;
+}
+
+static void answer_put(adns_state ads, adns_answer *ans) {
+  /* We keep no more answers than there have ever been queries in
+   * flight at once, and never more than the configured maximum.
+   */
+  if (ads->anspool.nfree >= ads->anspool.max ||
+      ads->anspool.nfree >= ads->qupool.hwm) {
+    adns__free(ads,ans);
+    return;
+  }
+  *(adns_answer**)ans= ads->anspool.head;
+  ads->anspool.head= ans;
+  ads->anspool.nfree++;
+}
+
+void adns_free_answer(adns_state ads, adns_answer *answer) {
+  adns__free(ads,answer);
+}
+
+void adns_answer_release(adns_state ads, adns_answer *answer) {
+  if (!answer) return;
+  adns__consistency(ads,0,cc_entex);
+  answer_put(ads,answer);
+  adns__consistency(ads,0,cc_entex);
+}
+
+void adns__pools_free(adns_state ads) {
+  struct queryslab *slab;
+  adns_answer *ans;
+
+  assert(!ads->qupool.nlive);
+  while ((slab= ads->qupool.slabs)) {
+    ads->qupool.slabs= slab->next;
+    adns__free(ads,slab->block);
+  }
+  ads->qupool.head= 0;
+  ads->qupool.nfree= 0;
+  while ((ans= ads->anspool.head)) {
+    ads->anspool.head= *(adns_answer**)ans;
+    adns__free(ads,ans);
+  }
+  ads->anspool.nfree= 0;
+}
+
 static adns_query query_alloc(adns_state ads,
 			      const typeinfo *typei, adns_rrtype type,
 			      adns_queryflags flags, struct timeval now) {
   /* Allocate a virgin query and return it. */
   adns_query qu;
   
-  qu= malloc(sizeof(*qu));  if (!qu) return 0;
-  qu->answer= malloc(sizeof(*qu->answer));
-  if (!qu->answer) { free(qu); return 0; }
-  
+  qu= query_get(ads);  if (!qu) return 0;
   qu->ads= ads;
+  qu->answer= answer_get(ads);
+  if (!qu->answer) { adns__query_recycle(qu); return 0; }
+  
   qu->state= query_tosend;
   qu->back= qu->next= qu->parent= 0;
   LIST_INIT(qu->children);
@@ -59,18 +154,17 @@ static adns_query query_alloc(adns_state ads,
   qu->typei= typei;
   qu->query_dgram= 0;
   qu->query_dglen= 0;
-  adns__vbuf_init(&qu->vb);
+  adns__vbuf_init(&qu->vb,ads);
 
-  qu->cname_dgram= 0;
-  qu->cname_dglen= qu->cname_begin= 0;
-
-  adns__vbuf_init(&qu->search_vb);
-  qu->search_origlen= qu->search_pos= qu->search_doneabs= 0;
+  qu->cname= 0;
+  qu->search= 0;
 
   qu->id= -2; /* will be overwritten with real id before we leave adns */
   qu->flags= flags;
   qu->retries= 0;
   qu->udpnextserver= 0;
+  qu->tcpconn= -1;
+  qu->tcpsent= 0;
   qu->udpsent= 0;
   timerclear(&qu->timeout);
   qu->expires= now.tv_sec + MAXTTLBELIEVE;
@@ -95,17 +189,13 @@ static void query_submit(adns_state ads, adns_query qu,
    * and submits it.  Cannot fail.  Takes over the memory for qumsg_vb.
    */
 
-  qu->vb= *qumsg_vb;
-  adns__vbuf_init(qumsg_vb);
-
-  qu->query_dgram= malloc(qu->vb.used);
-  if (!qu->query_dgram) { adns__query_fail(qu,adns_s_nomemory); return; }
-  
+  qu->query_dgram= qumsg_vb->buf;
+  qu->query_dglen= qumsg_vb->used;
+  adns__vbuf_init(qumsg_vb,ads);
   qu->id= id;
-  qu->query_dglen= qu->vb.used;
-  memcpy(qu->query_dgram,qu->vb.buf,qu->vb.used);
   
-  adns__query_send(qu,now);
+  if (typei->query_send) typei->query_send(qu,now);
+  else adns__query_send(qu,now);
 }
 
 adns_status adns__internal_submit(adns_state ads, adns_query *query_r,
@@ -146,7 +236,7 @@ static void query_simple(adns_state ads, adns_query qu,
   }
 
   vb_new= qu->vb;
-  adns__vbuf_init(&qu->vb);
+  adns__vbuf_init(&qu->vb,ads);
   query_submit(ads,qu, typei,&vb_new,id, flags,now);
 }
 
@@ -154,34 +244,34 @@ void adns__search_next(adns_state ads, adns_query qu, struct timeval now) {
   const char *nextentry;
   adns_status stat;
   
-  if (qu->search_doneabs<0) {
+  if (qu->search->doneabs<0) {
     nextentry= 0;
-    qu->search_doneabs= 1;
+    qu->search->doneabs= 1;
   } else {
-    if (qu->search_pos >= ads->nsearchlist) {
-      if (qu->search_doneabs) {
-	qu->search_vb.used= qu->search_origlen;
+    if (qu->search->pos >= ads->nsearchlist) {
+      if (qu->search->doneabs) {
+	qu->search->vb.used= qu->search->origlen;
 	stat= adns_s_nxdomain; goto x_fail;
       } else {
 	nextentry= 0;
-	qu->search_doneabs= 1;
+	qu->search->doneabs= 1;
       }
     } else {
-      nextentry= ads->searchlist[qu->search_pos++];
+      nextentry= ads->searchlist[qu->search->pos++];
     }
   }
 
-  qu->search_vb.used= qu->search_origlen;
+  qu->search->vb.used= qu->search->origlen;
   if (nextentry) {
-    if (!adns__vbuf_append(&qu->search_vb,".",1) ||
-	!adns__vbuf_appendstr(&qu->search_vb,nextentry))
+    if (!adns__vbuf_append(&qu->search->vb,".",1) ||
+	!adns__vbuf_appendstr(&qu->search->vb,nextentry))
       goto x_nomemory;
   }
 
-  free(qu->query_dgram);
+  adns__free(ads,qu->query_dgram);
   qu->query_dgram= 0; qu->query_dglen= 0;
 
-  query_simple(ads,qu, qu->search_vb.buf, qu->search_vb.used,
+  query_simple(ads,qu, qu->search->vb.buf, qu->search->vb.used,
 	       qu->typei, qu->flags, now);
   return;
 
@@ -234,6 +324,13 @@ int adns_submit(adns_state ads,
 
   *query_r= qu;
 
+  if (flags & adns_qf_search) {
+    qu->search= adns__malloc(ads,sizeof(*qu->search));
+    if (!qu->search) { stat= adns_s_nomemory; goto x_adnsfail; }
+    adns__vbuf_init(&qu->search->vb,ads);
+    qu->search->origlen= qu->search->pos= qu->search->doneabs= 0;
+  }
+
   ol= strlen(owner);
   if (!ol) { stat= adns_s_querydomaininvalid; goto x_adnsfail; }
   if (ol>DNS_MAXDOMAIN+1) { stat= adns_s_querydomaintoolong; goto x_adnsfail; }
@@ -245,12 +342,12 @@ int adns_submit(adns_state ads,
   }
 
   if (flags & adns_qf_search) {
-    r= adns__vbuf_append(&qu->search_vb,owner,ol);
+    r= adns__vbuf_append(&qu->search->vb,owner,ol);
     if (!r) { stat= adns_s_nomemory; goto x_adnsfail; }
 
     for (ndots=0, p=owner; (p= strchr(p,'.')); p++, ndots++);
-    qu->search_doneabs= (ndots >= ads->searchndots) ? -1 : 0;
-    qu->search_origlen= ol;
+    qu->search->doneabs= (ndots >= ads->searchndots) ? -1 : 0;
+    qu->search->origlen= ol;
     adns__search_next(ads,qu,now);
   } else {
     if (flags & adns_qf_owner) {
@@ -281,30 +378,108 @@ int adns_submit_reverse_any(adns_state ads,
 			    adns_queryflags flags,
 			    void *context,
 			    adns_query *query_r) {
-  const unsigned char *iaddr;
-  char *buf, *buf_free;
-  char shortbuf[100];
-  int r, lreq;
+  /* Equivalent to adns_submit of "<reversed-address>.zone", but we
+   * write the query directly rather than formatting and then parsing
+   * the name, and for PTR in in-addr.arpa or ip6.arpa we tell pa_ptr
+   * the address. */
+  static const byte inaddr_arpa[]= "\7in-addr\4arpa";
+  static const byte ip6_arpa[]= "\3ip6\4arpa";
+  const typeinfo *typei;
+  const byte *arpa;
+  byte labels[DNS_MAXREVLABELS];
+  struct timeval now;
+  adns_query qu;
+  adns_status stat;
+  adns_rr_addr *ap;
+  int r, i, zl, zlorig, rl, nlabels, arpalen, id;
 
   flags &= ~adns_qf_search;
 
-  if (addr->sa_family != AF_INET) return ENOSYS;
-  iaddr= (const unsigned char*)
-    &(((const struct sockaddr_in*)addr) -> sin_addr);
+  switch (addr->sa_family) {
+  case AF_INET:
+    rl= adns__revlabels(AF_INET,
+			&((const struct sockaddr_in*)addr)->sin_addr,
+			labels,&nlabels);
+    arpa= inaddr_arpa;  arpalen= sizeof(inaddr_arpa);
+    break;
+  case AF_INET6:
+    rl= adns__revlabels(AF_INET6,
+			&((const struct sockaddr_in6*)addr)->sin6_addr,
+			labels,&nlabels);
+    arpa= ip6_arpa;  arpalen= sizeof(ip6_arpa);
+    break;
+  default:
+    return ENOSYS;
+  }
 
-  lreq= strlen(zone) + 4*4 + 1;
-  if (lreq > sizeof(shortbuf)) {
-    buf= malloc(strlen(zone) + 4*4 + 1);
-    if (!buf) return errno;
-    buf_free= buf;
-  } else {
-    buf= shortbuf;
-    buf_free= 0;
+  adns__consistency(ads,0,cc_entex);
+
+  typei= adns__findtype(type);
+  if (!typei) return ENOSYS;
+
+  r= gettimeofday(&now,0); if (r) goto x_errno;
+  qu= query_alloc(ads,typei,type,flags,now); if (!qu) goto x_errno;
+
+  qu->ctx.ext= context;
+  qu->ctx.callback= 0;
+  memset(&qu->ctx.info,0,sizeof(qu->ctx.info));
+
+  *query_r= qu;
+
+  /* The text form of the labels (each followed by a dot) is rl long. */
+  zl= zlorig= strlen(zone);
+  if (rl+zl > DNS_MAXDOMAIN+1)
+    { stat= adns_s_querydomaintoolong; goto x_adnsfail; }
+  if (zl>=1 && zone[zl-1]=='.' && (zl<2 || zone[zl-2]!='\\')) zl--;
+
+  if (flags & adns_qf_owner) {
+    qu->vb.used= 0;
+    for (i=0; i<rl; i+= labels[i]+1) {
+      if (!adns__vbuf_append(&qu->vb,labels+i+1,labels[i]) ||
+	  !adns__vbuf_append(&qu->vb,".",1))
+	{ stat= adns_s_nomemory; goto x_adnsfail; }
+    }
+    if (!adns__vbuf_append(&qu->vb,zone,zl))
+      { stat= adns_s_nomemory; goto x_adnsfail; }
+    if (!save_owner(qu,qu->vb.buf,qu->vb.used - (zlorig ? 0 : 1)))
+      { stat= adns_s_nomemory; goto x_adnsfail; }
   }
-  sprintf(buf, "%d.%d.%d.%d.%s", iaddr[3], iaddr[2], iaddr[1], iaddr[0], zone);
 
-  r= adns_submit(ads,buf,type,flags,context,query_r);
-  free(buf_free);
+  stat= adns__mkquery_prefix(ads,&qu->vb,&id, labels,rl,nlabels, zone,zl,
+			     typei,type,flags);
+  if (stat) goto x_adnsfail;
+
+  /* arpa includes the root label, as its nul. */
+  if (typei->typekey == adns_r_ptr &&
+      qu->vb.used == DNS_HDRSIZE + rl + arpalen + 4 &&
+      !memcmp(qu->vb.buf + DNS_HDRSIZE + rl, arpa, arpalen)) {
+    ap= &qu->ctx.info.ptr_parent_addr;
+    memset(ap,0,sizeof(*ap));
+    if (addr->sa_family == AF_INET) {
+      ap->len= sizeof(struct sockaddr_in);
+      ap->addr.inet.sin_family= AF_INET;
+      ap->addr.inet.sin_addr= ((const struct sockaddr_in*)addr)->sin_addr;
+    } else {
+      ap->len= sizeof(struct sockaddr_in6);
+      ap->addr.inet6.sin6_family= AF_INET6;
+      ap->addr.inet6.sin6_addr= ((const struct sockaddr_in6*)addr)->sin6_addr;
+    }
+  }
+
+  query_submit(ads,qu, typei,&qu->vb,id, flags,now);
+  adns__autosys(ads,now);
+  adns__consistency(ads,qu,cc_entex);
+  return 0;
+
+ x_adnsfail:
+  adns__query_fail(qu,stat);
+  adns__consistency(ads,qu,cc_entex);
+  return 0;
+
+ x_errno:
+  r= errno;
+  assert(r);
+  adns__consistency(ads,0,cc_entex);
   return r;
 }
 
@@ -315,7 +490,9 @@ int adns_submit_reverse(adns_state ads,
 			void *context,
 			adns_query *query_r) {
   if (type != adns_r_ptr && type != adns_r_ptr_raw) return EINVAL;
-  return adns_submit_reverse_any(ads,addr,"in-addr.arpa",
+  return adns_submit_reverse_any(ads,addr,
+				 addr->sa_family == AF_INET6
+				 ? "ip6.arpa" : "in-addr.arpa",
 				 type,flags,context,query_r);
 }
 
@@ -341,7 +518,7 @@ static void *alloc_common(adns_query qu, size_t sz) {
 
   if (!sz) return qu; /* Any old pointer will do */
   assert(!qu->final_allocspace);
-  an= malloc(MEM_ROUND(MEM_ROUND(sizeof(*an)) + sz));
+  an= adns__malloc(qu->ads,MEM_ROUND(MEM_ROUND(sizeof(*an)) + sz));
   if (!an) return 0;
   LIST_LINK_TAIL(qu->allocations,an);
   return (byte*)an + MEM_ROUND(sizeof(*an));
@@ -428,11 +605,18 @@ static void free_query_allocs(adns_query qu) {
   allocnode *an, *ann;
 
   cancel_children(qu);
-  for (an= qu->allocations.head; an; an= ann) { ann= an->next; free(an); }
+  for (an= qu->allocations.head; an; an= ann) {
+    ann= an->next;
+    adns__free(qu->ads,an);
+  }
   LIST_INIT(qu->allocations);
   adns__vbuf_free(&qu->vb);
-  adns__vbuf_free(&qu->search_vb);
-  free(qu->query_dgram);
+  if (qu->search) {
+    adns__vbuf_free(&qu->search->vb);
+    adns__free(qu->ads,qu->search);
+    qu->search= 0;
+  }
+  adns__free(qu->ads,qu->query_dgram);
   qu->query_dgram= 0;
 }
 
@@ -448,6 +632,7 @@ void adns_cancel(adns_query qu) {
     break;
   case query_tcpw:
     LIST_UNLINK(ads->tcpw,qu);
+    adns__tcp_release(qu);
     break;
   case query_childw:
     LIST_UNLINK(ads->childw,qu);
@@ -459,8 +644,8 @@ void adns_cancel(adns_query qu) {
     abort();
   }
   free_query_allocs(qu);
-  free(qu->answer);
-  free(qu);
+  answer_put(ads,qu->answer);
+  adns__query_recycle(qu);
   adns__consistency(ads,0,cc_entex);
 }
 
@@ -481,7 +666,7 @@ static void makefinal_query(adns_query qu) {
   ans= qu->answer;
 
   if (qu->interim_allocd) {
-    ans= realloc(qu->answer,
+    ans= adns__realloc(qu->ads,qu->answer,
 		 MEM_ROUND(MEM_ROUND(sizeof(*ans)) + qu->interim_allocd));
     if (!ans) goto x_nomem;
     qu->answer= ans;
@@ -511,6 +696,54 @@ static void makefinal_query(adns_query qu) {
   free_query_allocs(qu);
 }
 
+static int sort_answer(adns_query qu) {
+  adns_answer *ans;
+
+  ans= qu->answer;
+  if (ans->nrrs && qu->typei->sortkey) {
+    if (!adns__sort_bykey(qu->ads, ans->rrs.bytes, ans->nrrs, ans->rrsz,
+			  &qu->vb, qu->typei->sortkey))
+      return 0;
+  } else if (ans->nrrs && qu->typei->diff_needswap) {
+    if (!adns__vbuf_ensure(&qu->vb,ans->nrrs*ans->rrsz))
+      return 0;
+    adns__sort(ans->rrs.bytes, ans->nrrs, ans->rrsz,
+		qu->vb.buf,
+		(int(*)(void*, const void*, const void*))
+		  qu->typei->diff_needswap,
+		qu->ads);
+  }
+  if (ans->nrrs && qu->typei->postsort) {
+    qu->typei->postsort(qu->ads, ans->rrs.bytes, ans->nrrs, qu->typei);
+  }
+  return 1;
+}
+
+int adns__query_flatrrs(adns_query qu, int nrrs) {
+  adns_answer *ans;
+
+  assert(!qu->interim_allocd && !qu->parent);
+  ans= adns__realloc(qu->ads,qu->answer,
+		     MEM_ROUND(MEM_ROUND(sizeof(*ans)) +
+			       MEM_ROUND(qu->typei->rrsz*nrrs)));
+  if (!ans) return 0;
+  qu->answer= ans;
+  ans->rrs.untyped= (byte*)ans + MEM_ROUND(sizeof(*ans));
+  return 1;
+}
+
+void adns__query_done_flat(adns_query qu) {
+  qu->id= -1;
+  if (!sort_answer(qu)) {
+    adns__query_fail(qu,adns_s_nomemory);
+    return;
+  }
+  qu->answer->expires= qu->expires;
+  free_query_allocs(qu);
+  LIST_LINK_TAIL(qu->ads->output,qu);
+  qu->state= query_done;
+}
+
 void adns__query_done(adns_query qu) {
   adns_answer *ans;
   adns_query parent;
@@ -521,25 +754,15 @@ void adns__query_done(adns_query qu) {
   ans= qu->answer;
 
   if (qu->flags & adns_qf_search && ans->status != adns_s_nomemory) {
-    if (!save_owner(qu, qu->search_vb.buf, qu->search_vb.used)) {
+    if (!save_owner(qu, qu->search->vb.buf, qu->search->vb.used)) {
       adns__query_fail(qu,adns_s_nomemory);
       return;
     }
   }
 
-  if (ans->nrrs && qu->typei->diff_needswap) {
-    if (!adns__vbuf_ensure(&qu->vb,qu->typei->rrsz)) {
-      adns__query_fail(qu,adns_s_nomemory);
-      return;
-    }
-    adns__isort(ans->rrs.bytes, ans->nrrs, ans->rrsz,
-		qu->vb.buf,
-		(int(*)(void*, const void*, const void*))
-		  qu->typei->diff_needswap,
-		qu->ads);
-  }
-  if (ans->nrrs && qu->typei->postsort) {
-    qu->typei->postsort(qu->ads, ans->rrs.bytes, ans->nrrs, qu->typei);
+  if (!sort_answer(qu)) {
+    adns__query_fail(qu,adns_s_nomemory);
+    return;
   }
 
   ans->expires= qu->expires;
@@ -549,8 +772,8 @@ void adns__query_done(adns_query qu) {
     LIST_UNLINK(qu->ads->childw,parent);
     qu->ctx.callback(parent,qu);
     free_query_allocs(qu);
-    free(qu->answer);
-    free(qu);
+    answer_put(qu->ads,qu->answer);
+    adns__query_recycle(qu);
   } else {
     makefinal_query(qu);
     LIST_LINK_TAIL(qu->ads->output,qu);
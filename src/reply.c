@@ -27,16 +27,65 @@
 #include <stdlib.h>
 
 #include "internal.h"
-    
+
+typedef struct {
+  int rdstart, rdlength;
+  unsigned long ttl;
+} wantedrr;
+
+static void procdgram_flat(adns_query qu, const byte *dgram,
+			   const wantedrr *wanted, int nwanted,
+			   struct timeval now) {
+  /* Replies to adns_r_a, adns_r_aaaa and adns_r_addr are just arrays
+   * of addresses, so we parse them straight into the final answer,
+   * without the typeinfo callbacks or interim memory.  The answer must
+   * be just as pa_inaddr, pa_in6addr, pa_addr and adns__query_done
+   * would have made it. */
+  adns_answer *ans;
+  adns_rr_addr *addr;
+  int i, rdlen;
+
+  if (!adns__query_flatrrs(qu,nwanted)) {
+    adns__query_fail(qu,adns_s_nomemory);
+    return;
+  }
+  ans= qu->answer;
+  rdlen= qu->typei->typekey == adns_r_aaaa ? 16 : 4;
+  for (i=0; i<nwanted; i++) {
+    adns__update_expires(qu,wanted[i].ttl,now);
+    if (wanted[i].rdlength != rdlen) {
+      adns__query_fail(qu,adns_s_invaliddata);
+      return;
+    }
+    if (qu->typei->typekey == adns_r_a) {
+      memcpy(&ans->rrs.inaddr[i], dgram+wanted[i].rdstart, 4);
+    } else if (qu->typei->typekey == adns_r_aaaa) {
+      memcpy(&ans->rrs.in6addr[i], dgram+wanted[i].rdstart, 16);
+    } else {
+      addr= &ans->rrs.addr[i];
+      addr->len= sizeof(addr->addr.inet);
+      memset(&addr->addr,0,sizeof(addr->addr.inet));
+      addr->addr.inet.sin_family= AF_INET;
+      memcpy(&addr->addr.inet.sin_addr, dgram+wanted[i].rdstart, 4);
+    }
+  }
+  ans->nrrs= nwanted;
+  adns__query_done_flat(qu);
+}
+
 void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
 		     int serv, int viatcp, struct timeval now) {
   int cbyte, rrstart, wantedrrs, rri, foundsoa, foundns, cname_here;
+  int cname_begin;
   int id, f1, f2, qdcount, ancount, nscount, arcount;
   int flg_ra, flg_rd, flg_tc, flg_qr, opcode;
   int rrtype, rrclass, rdlength, rdstart;
   int anstart, nsstart, arstart;
-  int ownermatched, l, nrrs;
+  int ownermatched, l, nrrs, wantedspace;
   unsigned long ttl, soattl;
+  wantedrr wantedbuf[WANTEDRRS_STACK], *wanted, *newwanted;
+  ownermemo memo;
+  glueindex glue;
   const typeinfo *typei;
   adns_query qu, nqu;
   dns_rcode rcode;
@@ -101,7 +150,7 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
     }
     if (qu) {
       /* We're definitely going to do something with this query now */
-      if (viatcp) LIST_UNLINK(ads->tcpw,qu);
+      if (viatcp) { LIST_UNLINK(ads->tcpw,qu); adns__tcp_release(qu); }
       else LIST_UNLINK(ads->udpw,qu);
     }
   }
@@ -144,7 +193,7 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
       adns__diag(ads,serv,0,"server claimed to answer %d"
 		 " questions with one message", qdcount);
     } else if (ads->iflags & adns_if_debug) {
-      adns__vbuf_init(&tempvb);
+      adns__vbuf_init(&tempvb,ads);
       adns__debug(ads,serv,0,"reply not found, id %02x, query owner %s",
 		  id, adns__diag_domain(ads,serv,0,&tempvb,
 					dgram,dglen,DNS_HDRSIZE));
@@ -160,15 +209,23 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
   arstart= -1;
 
   /* Now, take a look at the answer section, and see if it is complete.
-   * If it has any CNAMEs we stuff them in the answer.
+   * If it has any CNAMEs we stuff them in the answer.  We note where
+   * the RRs we want are, so that we need not walk the section again.
+   * (Any such RRs must come after the CNAME, if there is one, since
+   * CNAMEs after wanted RRs are ignored.)
    */
   wantedrrs= 0;
+  wanted= wantedbuf;
+  wantedspace= WANTEDRRS_STACK;
+  /* The question in the reply is the same as in our query, which (even
+   * if we are following a CNAME) is what we expect the owners to be. */
+  adns__ownermemo_init(&memo,dgram,dglen,DNS_HDRSIZE);
   cbyte= anstart;
   for (rri= 0; rri<ancount; rri++) {
     rrstart= cbyte;
     st= adns__findrr(qu,serv, dgram,dglen,&cbyte,
 		     &rrtype,&rrclass,&ttl, &rdlength,&rdstart,
-		     &ownermatched);
+		     &ownermatched, &memo);
     if (st) { adns__query_fail(qu,st); return; }
     if (rrtype == -1) goto x_truncated;
 
@@ -190,7 +247,7 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
       if (qu->flags & adns_qf_cname_forbid) {
 	adns__query_fail(qu,adns_s_prohibitedcname);
 	return;
-      } else if (qu->cname_dgram) { /* Ignore second and subsequent CNAME(s) */
+      } else if (qu->cname) { /* Ignore second and subsequent CNAME(s) */
 	adns__debug(ads,serv,qu,"allegedly canonical name %s"
 		    " is actually alias for %s", qu->answer->cname,
 		    adns__diag_domain(ads,serv,qu, &qu->vb,
@@ -202,8 +259,7 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
 		    adns__diag_domain(ads,serv,qu, &qu->vb,
 				      dgram,dglen,rdstart));
       } else {
-	qu->cname_begin= rdstart;
-	qu->cname_dglen= dglen;
+	cname_begin= rdstart;
 	st= adns__parse_domain(ads,serv,qu, &qu->vb,
 			       qu->flags & adns_qf_quotefail_cname
 			       ? 0 : pdf_quoteok,
@@ -217,11 +273,19 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
 	  return;
 	}
 
-	qu->cname_dgram= adns__alloc_mine(qu,dglen);
-	memcpy(qu->cname_dgram,dgram,dglen);
+	qu->cname= adns__alloc_mine(qu,sizeof(*qu->cname)+dglen);
+	if (!qu->cname) {
+	  adns__query_fail(qu,adns_s_nomemory);
+	  return;
+	}
+	qu->cname->dgram= (byte*)(qu->cname+1);
+	qu->cname->dglen= dglen;
+	qu->cname->begin= cname_begin;
+	memcpy(qu->cname->dgram,dgram,dglen);
 
 	memcpy(qu->answer->cname,qu->vb.buf,l);
 	cname_here= 1;
+	adns__ownermemo_init(&memo,dgram,dglen,cname_begin);
 	adns__update_expires(qu,ttl,now);
 	/* If we find the answer section truncated after this point we restart
 	 * the query at the CNAME; if beforehand then we obviously have to use
@@ -230,6 +294,16 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
 	 */
       }
     } else if (rrtype == (qu->answer->type & adns_rrt_typemask)) {
+      if (wantedrrs >= wantedspace) {
+	newwanted= adns__alloc_mine(qu, sizeof(*wanted)*wantedspace*2);
+	if (!newwanted) { adns__query_fail(qu,adns_s_nomemory); return; }
+	memcpy(newwanted, wanted, sizeof(*wanted)*wantedrrs);
+	wanted= newwanted;
+	wantedspace *= 2;
+      }
+      wanted[wantedrrs].rdstart= rdstart;
+      wanted[wantedrrs].rdlength= rdlength;
+      wanted[wantedrrs].ttl= ttl;
       wantedrrs++;
     } else {
       adns__debug(ads,serv,qu,"ignoring answer RR"
@@ -254,7 +328,7 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
     for (rri= 0; rri<nscount; rri++) {
       rrstart= cbyte;
       st= adns__findrr(qu,serv, dgram,dglen,&cbyte,
-		       &rrtype,&rrclass,&ttl, &rdlength,&rdstart, 0);
+		       &rrtype,&rrclass,&ttl, &rdlength,&rdstart, 0, 0);
       if (st) { adns__query_fail(qu,st); return; }
       if (rrtype==-1) goto x_truncated;
       if (rrclass != DNS_CLASS_IN) {
@@ -271,7 +345,7 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
       /* We still wanted to look for the SOA so we could find the TTL. */
       adns__update_expires(qu,soattl,now);
 
-      if (qu->flags & adns_qf_search && !qu->cname_dgram) {
+      if (qu->flags & adns_qf_search && !qu->cname) {
 	adns__search_next(ads,qu,now);
       } else {
 	adns__query_fail(qu,adns_s_nxdomain);
@@ -312,6 +386,13 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
 
   /* Now, we have some RRs which we wanted. */
 
+  if (!qu->parent && !qu->interim_allocd && !(qu->flags & adns_qf_owner) &&
+      (qu->typei->typekey == adns_r_a || qu->typei->typekey == adns_r_aaaa ||
+       qu->typei->typekey == adns_r_addr)) {
+    procdgram_flat(qu, dgram, wanted, wantedrrs, now);
+    return;
+  }
+
   qu->answer->rrs.untyped= adns__alloc_interim(qu,qu->typei->rrsz*wantedrrs);
   if (!qu->answer->rrs.untyped) {
     adns__query_fail(qu,adns_s_nomemory);
@@ -319,7 +400,6 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
   }
 
   typei= qu->typei;
-  cbyte= anstart;
   rrsdata= qu->answer->rrs.bytes;
 
   pai.ads= qu->ads;
@@ -331,23 +411,18 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
   pai.nscount= nscount;
   pai.arcount= arcount;
   pai.now= now;
+  pai.glue= &glue;
+  glue.state= glue_unindexed;
+  glue.lookups= 0;
 
-  for (rri=0, nrrs=0; rri<ancount; rri++) {
-    st= adns__findrr(qu,serv, dgram,dglen,&cbyte,
-		     &rrtype,&rrclass,&ttl, &rdlength,&rdstart,
-		     &ownermatched);
-    assert(!st); assert(rrtype != -1);
-    if (rrclass != DNS_CLASS_IN ||
-	rrtype != (qu->answer->type & adns_rrt_typemask) ||
-	!ownermatched)
-      continue;
-    adns__update_expires(qu,ttl,now);
-    st= typei->parse(&pai, rdstart,rdstart+rdlength, rrsdata+nrrs*typei->rrsz);
+  for (nrrs=0; nrrs<wantedrrs; nrrs++) {
+    adns__update_expires(qu,wanted[nrrs].ttl,now);
+    rdstart= wanted[nrrs].rdstart;
+    st= typei->parse(&pai, rdstart,rdstart+wanted[nrrs].rdlength,
+		     rrsdata+nrrs*typei->rrsz);
     if (st) { adns__query_fail(qu,st); return; }
     if (rdstart==-1) goto x_truncated;
-    nrrs++;
   }
-  assert(nrrs==wantedrrs);
   qu->answer->nrrs= nrrs;
 
   /* This may have generated some child queries ... */
@@ -369,13 +444,13 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
   qu->flags |= adns_qf_usevc;
   
  x_restartquery:
-  if (qu->cname_dgram) {
+  if (qu->cname) {
     st= adns__mkquery_frdgram(qu->ads,&qu->vb,&qu->id,
-			      qu->cname_dgram,qu->cname_dglen,qu->cname_begin,
+			      qu->cname->dgram,qu->cname->dglen,qu->cname->begin,
 			      qu->answer->type, qu->flags);
     if (st) { adns__query_fail(qu,st); return; }
     
-    newquery= realloc(qu->query_dgram,qu->vb.used);
+    newquery= adns__realloc(ads,qu->query_dgram,qu->vb.used);
     if (!newquery) { adns__query_fail(qu,adns_s_nomemory); return; }
     
     qu->query_dgram= newquery;
@@ -388,3 +463,67 @@ void adns__procdgram(adns_state ads, const byte *dgram, int dglen,
   adns__reset_preserved(qu);
   adns__query_send(qu,now);
 }
+
+static int skipname(const byte *dgram, int dglen, int *cbyte_io) {
+  /* Steps over the domain at *cbyte_io without following compression
+   * pointers.  Returns 0 if it runs off the end.  Reports nothing;
+   * procdgram will complain about the reply if need be. */
+  int cbyte, lablen;
+
+  cbyte= *cbyte_io;
+  for (;;) {
+    if (cbyte >= dglen) return 0;
+    lablen= dgram[cbyte++];
+    if (!lablen) break;
+    if ((lablen & 0x0c0) == 0x0c0) {
+      if (cbyte >= dglen) return 0;
+      cbyte++;
+      break;
+    }
+    if (lablen & 0x0c0) return 0;
+    cbyte+= lablen;
+  }
+  *cbyte_io= cbyte;
+  return 1;
+}
+
+int adns__tcpkeepalive(const byte *dgram, int dglen) {
+  int cbyte, i, qdcount, ancount, nscount, arcount, type, rdlen, rdend;
+  int optcode, optlen, timeout;
+
+  if (dglen<DNS_HDRSIZE) return -1;
+  cbyte= 4;
+  GET_W(cbyte,qdcount);
+  GET_W(cbyte,ancount);
+  GET_W(cbyte,nscount);
+  GET_W(cbyte,arcount);
+  for (i=0; i<qdcount; i++) {
+    if (!skipname(dgram,dglen,&cbyte)) return -1;
+    if (cbyte+4 > dglen) return -1;
+    cbyte+= 4;
+  }
+  for (i=0; i<ancount+nscount+arcount; i++) {
+    if (!skipname(dgram,dglen,&cbyte)) return -1;
+    if (cbyte+10 > dglen) return -1;
+    GET_W(cbyte,type);
+    cbyte+= 6;
+    GET_W(cbyte,rdlen);
+    rdend= cbyte+rdlen;
+    if (rdend > dglen) return -1;
+    if (i >= ancount+nscount && type == DNS_TYPE_OPT) {
+      while (cbyte+4 <= rdend) {
+	GET_W(cbyte,optcode);
+	GET_W(cbyte,optlen);
+	if (cbyte+optlen > rdend) return -1;
+	if (optcode == DNS_EDNSOPT_TCPKEEPALIVE && optlen == 2) {
+	  GET_W(cbyte,timeout);
+	  return timeout*100;
+	}
+	cbyte+= optlen;
+      }
+      return -1;
+    }
+    cbyte= rdend;
+  }
+  return -1;
+}
@@ -41,30 +41,53 @@
 
 static void readconfig(adns_state ads, const char *filename, int warnmissing);
 
-static void addserver(adns_state ads, struct in_addr addr) {
+static struct server *addserver(adns_state ads,
+				const struct sockaddr *sa, int len) {
+  /* sa must be AF_INET or AF_INET6 and have its port set.  Returns
+   * the new server, or 0 if it was a duplicate or there are too many. */
   int i;
   struct server *ss;
+  char buf[ADNS__SOCKADDR_NTOA_BUFLEN];
   
   for (i=0; i<ads->nservers; i++) {
-    if (ads->servers[i].addr.s_addr == addr.s_addr) {
-      adns__debug(ads,-1,0,"duplicate nameserver %s ignored",inet_ntoa(addr));
-      return;
+    if (adns__sockaddr_equal(&ads->servers[i].addr.sa,sa,1)) {
+      adns__debug(ads,-1,0,"duplicate nameserver %s ignored",
+		  adns__sockaddr_ntoa(sa,buf));
+      return 0;
     }
   }
   
   if (ads->nservers>=MAXSERVERS) {
-    adns__diag(ads,-1,0,"too many nameservers, ignoring %s",inet_ntoa(addr));
-    return;
+    adns__diag(ads,-1,0,"too many nameservers, ignoring %s",
+	       adns__sockaddr_ntoa(sa,buf));
+    return 0;
   }
 
   ss= ads->servers+ads->nservers;
-  ss->addr= addr;
+  assert((size_t)len <= sizeof(ss->addr));
+  memcpy(&ss->addr,sa,len);
+  ss->len= len;
+  ss->srclen= 0;
+  ss->ifname[0]= 0;
+  ss->udpsocket= -1;
+  ss->udpovfl= 0;
   ads->nservers++;
+  return ss;
+}
+
+static void addserver_inet(adns_state ads, struct in_addr ia) {
+  struct sockaddr_in sin;
+
+  memset(&sin,0,sizeof(sin));
+  sin.sin_family= AF_INET;
+  sin.sin_addr= ia;
+  sin.sin_port= htons(DNS_PORT);
+  addserver(ads,(const struct sockaddr*)&sin,sizeof(sin));
 }
 
 static void freesearchlist(adns_state ads) {
-  if (ads->nsearchlist) free(*ads->searchlist);
-  free(ads->searchlist);
+  if (ads->nsearchlist) adns__free(ads,*ads->searchlist);
+  adns__free(ads,ads->searchlist);
 }
 
 static void saveerr(adns_state ads, int en) {
@@ -103,16 +126,129 @@ static int nextword(const char **bufp_io, const char **word_r, int *l_r) {
   return 1;
 }
 
+static int parseaddr(const char *word, int l, int port,
+		     adns__sockaddr *sa_r, int *len_r) {
+  /* Accepts a.b.c.d, a.b.c.d:port, an IPv6 address, or [v6addr]:port;
+   * the port may only be given if port (the default) is nonzero.  An
+   * IPv6 address may have a %scope suffix (an interface name or
+   * number).  Returns 0 if the word is not a valid address. */
+  char tbuf[INET6_ADDRSTRLEN+IFNAMSIZ+10], *addr, *colon, *pct, *ep;
+  unsigned long pv, scope;
+
+  if ((size_t)l >= sizeof(tbuf)) return 0;
+  memcpy(tbuf,word,l); tbuf[l]= 0;
+  memset(sa_r,0,sizeof(*sa_r));
+
+  colon= 0;
+  addr= tbuf;
+  if (tbuf[0] == '[') {
+    addr= tbuf+1;
+    colon= strchr(tbuf,']');
+    if (!colon) return 0;
+    *colon++= 0;
+    if (!*colon) colon= 0;
+    else if (*colon != ':') return 0;
+  } else {
+    /* Only an IPv6 address (which has no port here) has two colons. */
+    colon= strchr(tbuf,':');
+    if (colon && strchr(colon+1,':')) colon= 0;
+  }
+  if (colon) {
+    if (!port) return 0;
+    *colon++= 0;
+    pv= strtoul(colon,&ep,10);
+    if (!*colon || *ep || !pv || pv > 65535) return 0;
+    port= pv;
+  }
+
+  if (!strchr(addr,':')) {
+    if (!inet_aton(addr,&sa_r->inet.sin_addr)) return 0;
+    sa_r->inet.sin_family= AF_INET;
+    sa_r->inet.sin_port= htons(port);
+    *len_r= sizeof(sa_r->inet);
+  } else {
+    scope= 0;
+    pct= strchr(addr,'%');
+    if (pct) {
+      *pct++= 0;
+      scope= strtoul(pct,&ep,10);
+      if (!*pct || *ep) scope= if_nametoindex(pct);
+      if (!scope) return 0;
+    }
+    if (inet_pton(AF_INET6,addr,&sa_r->inet6.sin6_addr) != 1) return 0;
+    sa_r->inet6.sin6_family= AF_INET6;
+    sa_r->inet6.sin6_port= htons(port);
+    sa_r->inet6.sin6_scope_id= scope;
+    *len_r= sizeof(sa_r->inet6);
+  }
+  return 1;
+}
+
 static void ccf_nameserver(adns_state ads, const char *fn,
 			   int lno, const char *buf) {
-  struct in_addr ia;
-  
-  if (!inet_aton(buf,&ia)) {
+  const char *bufp, *word;
+  adns__sockaddr sa, src;
+  int l, len, srclen;
+  unsigned port;
+  char ifname[IFNAMSIZ];
+  char abuf[ADNS__SOCKADDR_NTOA_BUFLEN];
+  struct server *ss;
+
+  bufp= buf;
+  if (!nextword(&bufp,&word,&l) || !parseaddr(word,l,DNS_PORT,&sa,&len)) {
     configparseerr(ads,fn,lno,"invalid nameserver address `%s'",buf);
     return;
   }
-  adns__debug(ads,-1,0,"using nameserver %s",inet_ntoa(ia));
-  addserver(ads,ia);
+
+  srclen= 0;
+  ifname[0]= 0;
+  while (nextword(&bufp,&word,&l)) {
+    if (l==6 && !memcmp(word,"source",6)) {
+      if (!nextword(&bufp,&word,&l) || !parseaddr(word,l,0,&src,&srclen)) {
+	configparseerr(ads,fn,lno,"nameserver source needs an address"
+		       " (without a port)");
+	return;
+      }
+      if (src.sa.sa_family != sa.sa.sa_family) {
+	configparseerr(ads,fn,lno,"nameserver source address `%.*s'"
+		       " is not in the nameserver's address family",l,word);
+	return;
+      }
+    } else if (l==9 && !memcmp(word,"interface",9)) {
+      if (!nextword(&bufp,&word,&l) || l >= IFNAMSIZ) {
+	configparseerr(ads,fn,lno,"nameserver interface needs a name"
+		       " (of at most %d characters)",IFNAMSIZ-1);
+	return;
+      }
+#ifdef SO_BINDTODEVICE
+      memcpy(ifname,word,l); ifname[l]= 0;
+#else
+      configparseerr(ads,fn,lno,"binding to an interface is not supported"
+		     " on this system");
+      return;
+#endif
+    } else {
+      adns__diag(ads,-1,0,"%s:%d: unknown nameserver option `%.*s'"
+		 " ignored", fn,lno, l,word);
+    }
+  }
+
+  if (ifname[0] && sa.sa.sa_family == AF_INET6 &&
+      !sa.inet6.sin6_scope_id &&
+      IN6_IS_ADDR_LINKLOCAL(&sa.inet6.sin6_addr))
+    /* A link-local address is only meaningful on that interface. */
+    sa.inet6.sin6_scope_id= if_nametoindex(ifname);
+
+  port= ntohs(sa.sa.sa_family == AF_INET
+	      ? sa.inet.sin_port : sa.inet6.sin6_port);
+  adns__sockaddr_ntoa(&sa.sa,abuf);
+  if (port == DNS_PORT) adns__debug(ads,-1,0,"using nameserver %s",abuf);
+  else adns__debug(ads,-1,0,"using nameserver %s port %u",abuf,port);
+
+  ss= addserver(ads,&sa.sa,len);
+  if (!ss) return;
+  if (srclen) { memcpy(&ss->src,&src,srclen); ss->srclen= srclen; }
+  strcpy(ss->ifname,ifname);
 }
 
 static void ccf_search(adns_state ads, const char *fn,
@@ -128,11 +264,11 @@ static void ccf_search(adns_state ads, const char *fn,
   tl= 0;
   while (nextword(&bufp,&word,&l)) { count++; tl += l+1; }
 
-  newptrs= malloc(sizeof(char*)*count);
+  newptrs= adns__malloc(ads,sizeof(char*)*count);
   if (!newptrs) { saveerr(ads,errno); return; }
 
-  newchars= malloc(tl);
-  if (!newchars) { saveerr(ads,errno); free(newptrs); return; }
+  newchars= adns__malloc(ads,tl);
+  if (!newchars) { saveerr(ads,errno); adns__free(ads,newptrs); return; }
 
   bufp= buf;
   pp= newptrs;
@@ -148,24 +284,125 @@ static void ccf_search(adns_state ads, const char *fn,
   ads->searchlist= newptrs;
 }
 
+/* Sortlist trie.  Each address family has a path-compressed binary
+ * trie of the configured prefixes; every node holds a prefix, and
+ * the precedence (position in the sortlist) of the earliest entry
+ * for exactly that prefix, or INT_MAX if it is only a branch point.
+ * The precedence of an address is the smallest found on the path to
+ * it, so that as before the first matching sortlist entry wins.
+ */
+
+static int sortlist_bit(const byte *key, int bit) {
+  return (key[bit>>3] >> (7 - (bit&7))) & 1;
+}
+
+static int sortlist_prefixmatch(const byte *a, const byte *b, int bits) {
+  /* Returns the length of the common prefix of a and b, up to bits. */
+  int i;
+  byte diff;
+
+  for (i=0; i<bits; i+=8) {
+    diff= a[i>>3] ^ b[i>>3];
+    if (!diff) continue;
+    while (!(diff & 0x80)) { diff <<= 1; i++; }
+    return i < bits ? i : bits;
+  }
+  return bits;
+}
+
+static void sortlist_setprefix(struct sortlist_node *sn,
+			       const byte *key, int plen) {
+  memset(sn->prefix,0,sizeof(sn->prefix));
+  memcpy(sn->prefix,key,(plen+7)>>3);
+  if (plen & 7) sn->prefix[plen>>3] &= 0xff << (8 - (plen&7));
+  sn->plen= plen;
+}
+
+static int sortlist_insert(adns_state ads, struct sortlist_node **snp,
+			   const byte *key, int plen, int prec) {
+  /* Returns 0 on success or an errno value. */
+  struct sortlist_node *sn, *mid, *leaf;
+  int common;
+
+  for (;;) {
+    sn= *snp;
+    if (!sn) break;
+    common= sortlist_prefixmatch(sn->prefix,key, sn->plen<plen ? sn->plen : plen);
+    if (common < sn->plen) break;
+    if (plen == sn->plen) {
+      if (prec < sn->prec) sn->prec= prec;
+      return 0;
+    }
+    snp= &sn->child[sortlist_bit(key,sn->plen)];
+  }
+
+  leaf= adns__malloc(ads,sizeof(*leaf));  if (!leaf) return errno;
+  sortlist_setprefix(leaf,key,plen);
+  leaf->prec= prec;
+  leaf->child[0]= leaf->child[1]= 0;
+  if (!sn) { *snp= leaf; return 0; }
+
+  /* The new prefix and sn's diverge, or the new one is shorter. */
+  if (common == plen) {
+    leaf->child[sortlist_bit(sn->prefix,plen)]= sn;
+    *snp= leaf;
+    return 0;
+  }
+  mid= adns__malloc(ads,sizeof(*mid));
+  if (!mid) { adns__free(ads,leaf); return errno; }
+  sortlist_setprefix(mid,key,common);
+  mid->prec= INT_MAX;
+  mid->child[sortlist_bit(sn->prefix,common)]= sn;
+  mid->child[sortlist_bit(key,common)]= leaf;
+  *snp= mid;
+  return 0;
+}
+
+static void sortlist_freenode(adns_state ads, struct sortlist_node *sn) {
+  if (!sn) return;
+  sortlist_freenode(ads,sn->child[0]);
+  sortlist_freenode(ads,sn->child[1]);
+  adns__free(ads,sn);
+}
+
+static void freesortlist(adns_state ads) {
+  sortlist_freenode(ads,ads->sortlist_inet);
+  sortlist_freenode(ads,ads->sortlist_inet6);
+  ads->sortlist_inet= ads->sortlist_inet6= 0;
+  ads->nsortlist= 0;
+}
+
+int adns__sortlist_find(adns_state ads, int af, const void *addr) {
+  const struct sortlist_node *sn;
+  int bits, best;
+
+  switch (af) {
+  case AF_INET:  sn= ads->sortlist_inet;  bits= 32;   break;
+  case AF_INET6: sn= ads->sortlist_inet6; bits= 128;  break;
+  default: return ads->nsortlist;
+  }
+  best= ads->nsortlist;
+  while (sn && sortlist_prefixmatch(sn->prefix,addr,sn->plen) == sn->plen) {
+    if (sn->prec < best) best= sn->prec;
+    if (sn->plen == bits) break;
+    sn= sn->child[sortlist_bit(addr,sn->plen)];
+  }
+  return best;
+}
+
 static void ccf_sortlist(adns_state ads, const char *fn,
 			 int lno, const char *buf) {
   const char *word;
   char tbuf[200], *slash, *ep;
   struct in_addr base, mask;
-  int l;
-  unsigned long initial, baselocal;
+  struct in6_addr base6;
+  int l, r;
+  unsigned long initial, baselocal, masklocal;
 
   if (!buf) return;
   
-  ads->nsortlist= 0;
+  freesortlist(ads);
   while (nextword(&buf,&word,&l)) {
-    if (ads->nsortlist >= MAXSORTLIST) {
-      adns__diag(ads,-1,0,"too many sortlist entries,"
-		 " ignoring %.*s onwards",l,word);
-      return;
-    }
-
     if (l >= sizeof(tbuf)) {
       configparseerr(ads,fn,lno,"sortlist entry `%.*s' too long",l,word);
       continue;
@@ -174,6 +411,28 @@ static void ccf_sortlist(adns_state ads, const char *fn,
     memcpy(tbuf,word,l); tbuf[l]= 0;
     slash= strchr(tbuf,'/');
     if (slash) *slash++= 0;
+
+    if (strchr(tbuf,':')) {
+      if (inet_pton(AF_INET6,tbuf,&base6) != 1) {
+	configparseerr(ads,fn,lno,"invalid address `%s' in sortlist",tbuf);
+	continue;
+      }
+      if (!slash) {
+	configparseerr(ads,fn,lno,"IPv6 sortlist entry `%s'"
+		       " must specify prefix length",tbuf);
+	continue;
+      }
+      initial= strtoul(slash,&ep,10);
+      if (*ep || ep==slash || initial>128) {
+	configparseerr(ads,fn,lno,"mask length `%s' invalid",slash);
+	continue;
+      }
+      r= sortlist_insert(ads,&ads->sortlist_inet6,
+			 base6.s6_addr,initial,ads->nsortlist);
+      if (r) { saveerr(ads,r); return; }
+      ads->nsortlist++;
+      continue;
+    }
     
     if (!inet_aton(tbuf,&base)) {
       configparseerr(ads,fn,lno,"invalid address `%s' in sortlist",tbuf);
@@ -191,22 +450,29 @@ static void ccf_sortlist(adns_state ads, const char *fn,
 			 " overlaps address `%s'",slash,tbuf);
 	  continue;
 	}
+	masklocal= ntohl(mask.s_addr);
+	for (initial=0; initial<32 && (masklocal & 0x080000000UL); initial++)
+	  masklocal= (masklocal << 1) & 0x0ffffffffUL;
+	if (masklocal) {
+	  configparseerr(ads,fn,lno,"mask `%s' in sortlist"
+			 " is not contiguous",slash);
+	  continue;
+	}
       } else {
 	initial= strtoul(slash,&ep,10);
 	if (*ep || initial>32) {
 	  configparseerr(ads,fn,lno,"mask length `%s' invalid",slash);
 	  continue;
 	}
-	mask.s_addr= htonl((0x0ffffffffUL) << (32-initial));
       }
     } else {
       baselocal= ntohl(base.s_addr);
       if (!baselocal & 0x080000000UL) /* class A */
-	mask.s_addr= htonl(0x0ff000000UL);
+	initial= 8;
       else if ((baselocal & 0x0c0000000UL) == 0x080000000UL)
-	mask.s_addr= htonl(0x0ffff0000UL); /* class B */
+	initial= 16; /* class B */
       else if ((baselocal & 0x0f0000000UL) == 0x0e0000000UL)
-	mask.s_addr= htonl(0x0ff000000UL); /* class C */
+	initial= 8; /* class C */
       else {
 	configparseerr(ads,fn,lno, "network address `%s'"
 		       " in sortlist is not in classed ranges,"
@@ -215,17 +481,38 @@ static void ccf_sortlist(adns_state ads, const char *fn,
       }
     }
 
-    ads->sortlist[ads->nsortlist].base= base;
-    ads->sortlist[ads->nsortlist].mask= mask;
+    r= sortlist_insert(ads,&ads->sortlist_inet,
+		       (const byte*)&base.s_addr,initial,ads->nsortlist);
+    if (r) { saveerr(ads,r); return; }
     ads->nsortlist++;
   }
 }
 
+static int ccf_optnum(adns_state ads, const char *fn, int lno,
+		      const char *word, int l, const char *name,
+		      unsigned long min, unsigned long max, int *v_r) {
+  /* Returns 0 if word is not the option name (which includes the
+   * colon).  Otherwise stores the value in *v_r, or complains if it
+   * is malformed or out of range, and returns 1. */
+  unsigned long v;
+  char *ep;
+  int nl;
+
+  nl= strlen(name);
+  if (l<nl || memcmp(word,name,nl)) return 0;
+  v= strtoul(word+nl,&ep,10);
+  if (l==nl || ep != word+l || v < min || v > max) {
+    configparseerr(ads,fn,lno,"option `%.*s' malformed"
+		   " or has bad value",l,word);
+    return 1;
+  }
+  *v_r= v;
+  return 1;
+}
+
 static void ccf_options(adns_state ads, const char *fn,
 			int lno, const char *buf) {
   const char *word;
-  char *ep;
-  unsigned long v;
   int l;
 
   if (!buf) return;
@@ -235,14 +522,48 @@ static void ccf_options(adns_state ads, const char *fn,
       ads->iflags |= adns_if_debug;
       continue;
     }
-    if (l>=6 && !memcmp(word,"ndots:",6)) {
-      v= strtoul(word+6,&ep,10);
-      if (l==6 || ep != word+l || v > INT_MAX) {
-	configparseerr(ads,fn,lno,"option `%.*s' malformed"
-		       " or has bad value",l,word);
-	continue;
-      }
-      ads->searchndots= v;
+    if (ccf_optnum(ads,fn,lno,word,l,"ndots:",0,INT_MAX,
+		   &ads->searchndots) ||
+	ccf_optnum(ads,fn,lno,word,l,"adns_answerpool:",0,INT_MAX,
+		   &ads->anspool.max) ||
+	ccf_optnum(ads,fn,lno,word,l,"adns_tcpconns:",1,MAXTCPCONNS,
+		   &ads->ntcp) ||
+	ccf_optnum(ads,fn,lno,word,l,"adns_tcpwait:",1,INT_MAX,
+		   &ads->tcpwaitms) ||
+	ccf_optnum(ads,fn,lno,word,l,"adns_tcpconnect:",1,INT_MAX,
+		   &ads->tcpconnms) ||
+	ccf_optnum(ads,fn,lno,word,l,"adns_tcpidle:",0,INT_MAX,
+		   &ads->tcpidlems) ||
+	ccf_optnum(ads,fn,lno,word,l,"adns_tcpinflight:",0,INT_MAX,
+		   &ads->tcpinflight) ||
+	ccf_optnum(ads,fn,lno,word,l,"adns_udprcvbuf:",0,INT_MAX,
+		   &ads->udprcvbuf) ||
+	ccf_optnum(ads,fn,lno,word,l,"adns_udpsndbuf:",0,INT_MAX,
+		   &ads->udpsndbuf))
+      continue;
+    if (l==10 && !memcmp(word,"adns_uring",10)) {
+      ads->uringwanted= 1;
+      continue;
+    }
+    if (l==13 && !memcmp(word,"adns_udpdrops",13)) {
+#ifdef SO_RXQ_OVFL
+      ads->udpdropstats= 1;
+#else
+      configparseerr(ads,fn,lno,"option adns_udpdrops is not supported"
+		     " on this system");
+#endif
+      continue;
+    }
+    if (l==14 && !memcmp(word,"adns_keepalive",14)) {
+      ads->tcpkeepalive= 1;
+      continue;
+    }
+    if (l==16 && !memcmp(word,"adns_tcpfastopen",16)) {
+      ads->tcpfastopen= 1;
+      continue;
+    }
+    if (l==15 && !memcmp(word,"adns_tcpprewarm",15)) {
+      ads->tcpprewarm= 1;
       continue;
     }
     if (l>=12 && !memcmp(word,"adns_checkc:",12)) {
@@ -505,13 +826,68 @@ int adns__setnonblock(adns_state ads, int fd) {
   return 0;
 }
 
+int adns__server_bind(adns_state ads, int serv, int fd) {
+  const struct server *ss= &ads->servers[serv];
+  int r;
+
+#ifdef SO_BINDTODEVICE
+  if (ss->ifname[0]) {
+    r= setsockopt(fd,SOL_SOCKET,SO_BINDTODEVICE,
+		  ss->ifname,strlen(ss->ifname)+1);
+    if (r) return errno;
+  }
+#endif
+  if (ss->srclen) {
+    r= bind(fd,&ss->src.sa,ss->srclen);
+    if (r) return errno;
+  }
+  return 0;
+}
+
+static void udp_sockopts(adns_state ads, int fd) {
+  /* Applies the adns_udprcvbuf:, _udpsndbuf: and _udpdrops options to
+   * a new UDP socket.  Failures are reported but otherwise ignored. */
+#ifdef SO_RXQ_OVFL
+  int v;
+#endif
+
+  if (ads->udprcvbuf &&
+      setsockopt(fd,SOL_SOCKET,SO_RCVBUF,
+		 &ads->udprcvbuf,sizeof(ads->udprcvbuf)))
+    adns__diag(ads,-1,0,"cannot set UDP receive buffer size: %s",
+	       strerror(errno));
+  if (ads->udpsndbuf &&
+      setsockopt(fd,SOL_SOCKET,SO_SNDBUF,
+		 &ads->udpsndbuf,sizeof(ads->udpsndbuf)))
+    adns__diag(ads,-1,0,"cannot set UDP send buffer size: %s",
+	       strerror(errno));
+#ifdef SO_RXQ_OVFL
+  v= 1;
+  if (ads->udpdropstats &&
+      setsockopt(fd,SOL_SOCKET,SO_RXQ_OVFL,&v,sizeof(v)))
+    adns__diag(ads,-1,0,"cannot enable UDP drop counting: %s",
+	       strerror(errno));
+#endif
+}
+
 static int init_begin(adns_state *ads_r, adns_initflags flags,
-		      adns_logcallbackfn *logfn, void *logfndata) {
+		      adns_logcallbackfn *logfn, void *logfndata,
+		      const adns_allocator *allocator) {
   adns_state ads;
   pid_t pid;
-  
-  ads= malloc(sizeof(*ads)); if (!ads) return errno;
+  int i;
 
+  if (allocator) {
+    if (!allocator->mallocfn || !allocator->reallocfn || !allocator->freefn)
+      return EINVAL;
+    ads= allocator->mallocfn(allocator->ctx,sizeof(*ads));
+  } else {
+    ads= malloc(sizeof(*ads));
+  }
+  if (!ads) return errno;
+
+  if (allocator) ads->allocator= *allocator;
+  else memset(&ads->allocator,0,sizeof(ads->allocator));
   ads->iflags= flags;
   ads->logfn= logfn;
   ads->logfndata= logfndata;
@@ -522,15 +898,39 @@ static int init_begin(adns_state *ads_r, adns_initflags flags,
   LIST_INIT(ads->output);
   ads->forallnext= 0;
   ads->nextid= 0x311f;
-  ads->udpsocket= ads->tcpsocket= -1;
-  adns__vbuf_init(&ads->tcpsend);
-  adns__vbuf_init(&ads->tcprecv);
-  ads->tcprecv_skip= 0;
+  ads->udpsocket= ads->udpsocket6= -1;
   ads->nservers= ads->nsortlist= ads->nsearchlist= ads->tcpserver= 0;
+  ads->ntcp= 1;
+  ads->tcpproto= -1;
+  ads->tcpfastopen= ads->tcpprewarm= ads->tcpkeepalive= 0;
+  ads->tcpinflight= 0;
+  ads->udprcvbuf= ads->udpsndbuf= ads->udpdropstats= 0;
+  ads->udpdrops= 0;
+  ads->udpovfl= ads->udpovfl6= 0;
+  ads->uringwanted= 0;
+  ads->uring= 0;
+  ads->tcpwaitms= TCPWAITMS;
+  ads->tcpconnms= TCPCONNMS;
+  ads->tcpidlems= TCPIDLEMS;
+  for (i=0; i<MAXTCPCONNS; i++) {
+    ads->tcp[i].fd= -1;
+    ads->tcp[i].serv= ads->tcp[i].nqueries= ads->tcp[i].ninflight= 0;
+    ads->tcp[i].idlems= -1;
+    ads->tcp[i].recv_skip= ads->tcp[i].send_skip= 0;
+    ads->tcp[i].state= server_disconnected;
+    adns__vbuf_init(&ads->tcp[i].send,ads);
+    adns__vbuf_init(&ads->tcp[i].recv,ads);
+    timerclear(&ads->tcp[i].timeout);
+  }
+  ads->sortlist_inet= ads->sortlist_inet6= 0;
   ads->searchndots= 1;
-  ads->tcpstate= server_disconnected;
-  timerclear(&ads->tcptimeout);
   ads->searchlist= 0;
+  ads->qupool.slabs= 0;
+  ads->qupool.head= 0;
+  ads->qupool.nfree= ads->qupool.nlive= ads->qupool.hwm= 0;
+  ads->anspool.head= 0;
+  ads->anspool.nfree= 0;
+  ads->anspool.max= ANSWERPOOLMAX;
 
   pid= getpid();
   ads->rand48xsubi[0]= pid;
@@ -544,13 +944,16 @@ static int init_begin(adns_state *ads_r, adns_initflags flags,
 static int init_finish(adns_state ads) {
   struct in_addr ia;
   struct protoent *proto;
-  int r;
+  struct timeval now;
+  struct server *ss;
+  char abuf[ADNS__SOCKADDR_NTOA_BUFLEN];
+  int r, i;
   
   if (!ads->nservers) {
     if (ads->logfn && ads->iflags & adns_if_debug)
       adns__lprintf(ads,"adns: no nameservers, using localhost\n");
     ia.s_addr= htonl(INADDR_LOOPBACK);
-    addserver(ads,ia);
+    addserver_inet(ads,ia);
   }
 
   proto= getprotobyname("udp"); if (!proto) { r= ENOPROTOOPT; goto x_free; }
@@ -559,22 +962,80 @@ static int init_finish(adns_state ads) {
 
   r= adns__setnonblock(ads,ads->udpsocket);
   if (r) { r= errno; goto x_closeudp; }
+  udp_sockopts(ads,ads->udpsocket);
+
+  for (i=0; i<ads->nservers; i++)
+    if (ads->servers[i].addr.sa.sa_family == AF_INET6) break;
+  if (i < ads->nservers) {
+    /* Failure here only makes the IPv6 servers unusable. */
+    ads->udpsocket6= socket(AF_INET6,SOCK_DGRAM,proto->p_proto);
+    if (ads->udpsocket6<0) {
+      adns__diag(ads,-1,0,"cannot create IPv6 UDP socket: %s",
+		 strerror(errno));
+    } else {
+      r= adns__setnonblock(ads,ads->udpsocket6);
+      if (r) {
+	adns__diag(ads,-1,0,"cannot make IPv6 UDP socket nonblocking:"
+		   " %s",strerror(r));
+	close(ads->udpsocket6);
+	ads->udpsocket6= -1;
+      } else {
+	udp_sockopts(ads,ads->udpsocket6);
+      }
+    }
+  }
+
+  for (i=0; i<ads->nservers; i++) {
+    ss= &ads->servers[i];
+    if (!ss->srclen && !ss->ifname[0]) continue;
+    /* Failure here only makes this server unusable over UDP. */
+    ss->udpsocket= socket(ss->addr.sa.sa_family,SOCK_DGRAM,proto->p_proto);
+    if (ss->udpsocket<0) {
+      adns__diag(ads,-1,0,"cannot create UDP socket for nameserver %s: %s",
+		 adns__sockaddr_ntoa(&ss->addr.sa,abuf),strerror(errno));
+      continue;
+    }
+    r= adns__setnonblock(ads,ss->udpsocket);
+    if (!r) r= adns__server_bind(ads,i,ss->udpsocket);
+    if (r) {
+      adns__diag(ads,-1,0,"cannot bind UDP socket for nameserver %s: %s",
+		 adns__sockaddr_ntoa(&ss->addr.sa,abuf),strerror(r));
+      close(ss->udpsocket);
+      ss->udpsocket= -1;
+      continue;
+    }
+    udp_sockopts(ads,ss->udpsocket);
+  }
+
+  if (ads->uringwanted) {
+    r= adns__uring_init(ads);
+    if (r) adns__debug(ads,-1,0,"not using io_uring: %s",strerror(r));
+  }
+
+  proto= getprotobyname("tcp"); if (proto) ads->tcpproto= proto->p_proto;
+
+  if (ads->tcpprewarm) {
+    r= gettimeofday(&now,0);
+    if (!r) adns__tcp_tryconnect(ads,&ads->tcp[0],now);
+  }
   
   return 0;
 
  x_closeudp:
   close(ads->udpsocket);
  x_free:
-  free(ads);
+  freesortlist(ads);
+  adns__free(ads,ads);
   return r;
 }
 
 static void init_abort(adns_state ads) {
   if (ads->nsearchlist) {
-    free(ads->searchlist[0]);
-    free(ads->searchlist);
+    adns__free(ads,ads->searchlist[0]);
+    adns__free(ads,ads->searchlist);
   }
-  free(ads);
+  freesortlist(ads);
+  adns__free(ads,ads);
 }
 
 static void logfn_file(adns_state ads, void *logfndata,
@@ -583,12 +1044,13 @@ static void logfn_file(adns_state ads, void *logfndata,
 }
 
 static int init_files(adns_state *ads_r, adns_initflags flags,
-		      adns_logcallbackfn *logfn, void *logfndata) {
+		      adns_logcallbackfn *logfn, void *logfndata,
+		      const adns_allocator *allocator) {
   adns_state ads;
   const char *res_options, *adns_res_options;
   int r;
   
-  r= init_begin(&ads, flags, logfn, logfndata);
+  r= init_begin(&ads, flags, logfn, logfndata, allocator);
   if (r) return r;
   
   res_options= instrum_getenv(ads,"RES_OPTIONS");
@@ -625,16 +1087,18 @@ static int init_files(adns_state *ads_r, adns_initflags flags,
 }
 
 int adns_init(adns_state *ads_r, adns_initflags flags, FILE *diagfile) {
-  return init_files(ads_r, flags, logfn_file, diagfile ? diagfile : stderr);
+  return init_files(ads_r, flags, logfn_file, diagfile ? diagfile : stderr,
+		    0);
 }
 
 static int init_strcfg(adns_state *ads_r, adns_initflags flags,
 		       adns_logcallbackfn *logfn, void *logfndata,
+		       const adns_allocator *allocator,
 		       const char *configtext) {
   adns_state ads;
   int r;
 
-  r= init_begin(&ads, flags, logfn, logfndata);
+  r= init_begin(&ads, flags, logfn, logfndata, allocator);
   if (r) return r;
 
   readconfigtext(ads,configtext,"<supplied configuration text>");
@@ -653,23 +1117,53 @@ static int init_strcfg(adns_state *ads_r, adns_initflags flags,
 int adns_init_strcfg(adns_state *ads_r, adns_initflags flags,
 		     FILE *diagfile, const char *configtext) {
   return init_strcfg(ads_r, flags,
-		     diagfile ? logfn_file : 0, diagfile,
+		     diagfile ? logfn_file : 0, diagfile, 0,
 		     configtext);
 }
 
-int adns_init_logfn(adns_state *newstate_r, adns_initflags flags,
-		    const char *configtext /*0=>use default config files*/,
-		    adns_logcallbackfn *logfn /*0=>logfndata is a FILE* */,
-		    void *logfndata /*0 with logfn==0 => discard*/) {
+int adns_init_allocator(adns_state *newstate_r, adns_initflags flags,
+			const char *configtext /*0=>use default config files*/,
+			adns_logcallbackfn *logfn /*0=>logfndata is a FILE* */,
+			void *logfndata /*0 with logfn==0 => discard*/,
+			const adns_allocator *allocator /*0=>libc*/) {
   if (!logfn && logfndata)
     logfn= logfn_file;
   if (configtext)
-    return init_strcfg(newstate_r, flags, logfn, logfndata, configtext);
+    return init_strcfg(newstate_r, flags, logfn, logfndata, allocator,
+		       configtext);
   else
-    return init_files(newstate_r, flags, logfn, logfndata);
+    return init_files(newstate_r, flags, logfn, logfndata, allocator);
+}
+
+int adns_init_logfn(adns_state *newstate_r, adns_initflags flags,
+		    const char *configtext /*0=>use default config files*/,
+		    adns_logcallbackfn *logfn /*0=>logfndata is a FILE* */,
+		    void *logfndata /*0 with logfn==0 => discard*/) {
+  return adns_init_allocator(newstate_r, flags, configtext,
+			     logfn, logfndata, 0);
+}
+
+void adns_tcptimeouts(adns_state ads, int waitms, int connectms,
+		      int idlems) {
+  adns__consistency(ads,0,cc_entex);
+  if (waitms > 0) ads->tcpwaitms= waitms;
+  if (connectms > 0) ads->tcpconnms= connectms;
+  if (idlems >= 0) ads->tcpidlems= idlems;
+  adns__consistency(ads,0,cc_entex);
+}
+
+unsigned long adns_udpdrops(adns_state ads) {
+  unsigned long drops;
+
+  adns__consistency(ads,0,cc_entex);
+  drops= ads->udpdrops;
+  adns__consistency(ads,0,cc_entex);
+  return drops;
 }
 
 void adns_finish(adns_state ads) {
+  int i;
+
   adns__consistency(ads,0,cc_entex);
   for (;;) {
     if (ads->udpw.head) adns_cancel(ads->udpw.head);
@@ -678,12 +1172,20 @@ void adns_finish(adns_state ads) {
     else if (ads->output.head) adns_cancel(ads->output.head);
     else break;
   }
+  adns__uring_finish(ads);
   close(ads->udpsocket);
-  if (ads->tcpsocket >= 0) close(ads->tcpsocket);
-  adns__vbuf_free(&ads->tcpsend);
-  adns__vbuf_free(&ads->tcprecv);
+  if (ads->udpsocket6 >= 0) close(ads->udpsocket6);
+  for (i=0; i<ads->nservers; i++)
+    if (ads->servers[i].udpsocket >= 0) close(ads->servers[i].udpsocket);
+  for (i=0; i<MAXTCPCONNS; i++) {
+    if (ads->tcp[i].fd >= 0) close(ads->tcp[i].fd);
+    adns__vbuf_free(&ads->tcp[i].send);
+    adns__vbuf_free(&ads->tcp[i].recv);
+  }
   freesearchlist(ads);
-  free(ads);
+  freesortlist(ads);
+  adns__pools_free(ads);
+  adns__free(ads,ads);
 }
 
 void adns_forallqueries_begin(adns_state ads) {
@@ -118,23 +118,20 @@ adns_status adns__qdpl_normal(adns_state ads,
   return adns_s_ok;
 }
 
-adns_status adns__mkquery(adns_state ads, vbuf *vb, int *id_r,
-			  const char *owner, int ol,
-			  const typeinfo *typei, adns_rrtype type,
-			  adns_queryflags flags) {
-  int labelnum, ll, nbytes;
+static adns_status mkquery_labels(adns_state ads, byte **rqp_io,
+				  int *nbytes_io, int labelnum,
+				  const char *p, const char *pe,
+				  const typeinfo *typei,
+				  adns_queryflags flags) {
+  /* Appends the labels of the text domain p..pe at *rqp_io, which
+   * must have room for pe-p+1 more bytes. */
+  int ll, nbytes;
   byte label[255];
   byte *rqp;
-  const char *p, *pe;
   adns_status st;
 
-  st= mkquery_header(ads,vb,id_r,ol+2); if (st) return st;
-  
-  MKQUERY_START(vb);
-
-  p= owner; pe= owner+ol;
-  nbytes= 0;
-  labelnum= 0;
+  rqp= *rqp_io;
+  nbytes= *nbytes_io;
   while (p!=pe) {
     ll= sizeof(label);
     st= typei->qdparselabel(ads, &p,pe, labelnum++, label, &ll, flags, typei);
@@ -146,6 +143,26 @@ adns_status adns__mkquery(adns_state ads, vbuf *vb, int *id_r,
     MKQUERY_ADDB(ll);
     memcpy(rqp,label,ll); rqp+= ll;
   }
+  *rqp_io= rqp;
+  *nbytes_io= nbytes;
+  return adns_s_ok;
+}
+
+adns_status adns__mkquery(adns_state ads, vbuf *vb, int *id_r,
+			  const char *owner, int ol,
+			  const typeinfo *typei, adns_rrtype type,
+			  adns_queryflags flags) {
+  int nbytes;
+  byte *rqp;
+  adns_status st;
+
+  st= mkquery_header(ads,vb,id_r,ol+2); if (st) return st;
+  
+  MKQUERY_START(vb);
+
+  nbytes= 0;
+  st= mkquery_labels(ads,&rqp,&nbytes,0, owner,owner+ol, typei,flags);
+  if (st) return st;
   MKQUERY_ADDB(0);
 
   MKQUERY_STOP(vb);
@@ -155,6 +172,96 @@ adns_status adns__mkquery(adns_state ads, vbuf *vb, int *id_r,
   return adns_s_ok;
 }
 
+const byte adns__decimal_label[256][4]= {
+  "\0010", "\0011", "\0012", "\0013", "\0014", "\0015", "\0016", "\0017",
+  "\0018", "\0019", "\00210", "\00211", "\00212", "\00213", "\00214", "\00215",
+  "\00216", "\00217", "\00218", "\00219", "\00220", "\00221", "\00222", "\00223",
+  "\00224", "\00225", "\00226", "\00227", "\00228", "\00229", "\00230", "\00231",
+  "\00232", "\00233", "\00234", "\00235", "\00236", "\00237", "\00238", "\00239",
+  "\00240", "\00241", "\00242", "\00243", "\00244", "\00245", "\00246", "\00247",
+  "\00248", "\00249", "\00250", "\00251", "\00252", "\00253", "\00254", "\00255",
+  "\00256", "\00257", "\00258", "\00259", "\00260", "\00261", "\00262", "\00263",
+  "\00264", "\00265", "\00266", "\00267", "\00268", "\00269", "\00270", "\00271",
+  "\00272", "\00273", "\00274", "\00275", "\00276", "\00277", "\00278", "\00279",
+  "\00280", "\00281", "\00282", "\00283", "\00284", "\00285", "\00286", "\00287",
+  "\00288", "\00289", "\00290", "\00291", "\00292", "\00293", "\00294", "\00295",
+  "\00296", "\00297", "\00298", "\00299", "\003100", "\003101", "\003102", "\003103",
+  "\003104", "\003105", "\003106", "\003107", "\003108", "\003109", "\003110", "\003111",
+  "\003112", "\003113", "\003114", "\003115", "\003116", "\003117", "\003118", "\003119",
+  "\003120", "\003121", "\003122", "\003123", "\003124", "\003125", "\003126", "\003127",
+  "\003128", "\003129", "\003130", "\003131", "\003132", "\003133", "\003134", "\003135",
+  "\003136", "\003137", "\003138", "\003139", "\003140", "\003141", "\003142", "\003143",
+  "\003144", "\003145", "\003146", "\003147", "\003148", "\003149", "\003150", "\003151",
+  "\003152", "\003153", "\003154", "\003155", "\003156", "\003157", "\003158", "\003159",
+  "\003160", "\003161", "\003162", "\003163", "\003164", "\003165", "\003166", "\003167",
+  "\003168", "\003169", "\003170", "\003171", "\003172", "\003173", "\003174", "\003175",
+  "\003176", "\003177", "\003178", "\003179", "\003180", "\003181", "\003182", "\003183",
+  "\003184", "\003185", "\003186", "\003187", "\003188", "\003189", "\003190", "\003191",
+  "\003192", "\003193", "\003194", "\003195", "\003196", "\003197", "\003198", "\003199",
+  "\003200", "\003201", "\003202", "\003203", "\003204", "\003205", "\003206", "\003207",
+  "\003208", "\003209", "\003210", "\003211", "\003212", "\003213", "\003214", "\003215",
+  "\003216", "\003217", "\003218", "\003219", "\003220", "\003221", "\003222", "\003223",
+  "\003224", "\003225", "\003226", "\003227", "\003228", "\003229", "\003230", "\003231",
+  "\003232", "\003233", "\003234", "\003235", "\003236", "\003237", "\003238", "\003239",
+  "\003240", "\003241", "\003242", "\003243", "\003244", "\003245", "\003246", "\003247",
+  "\003248", "\003249", "\003250", "\003251", "\003252", "\003253", "\003254", "\003255"
+};
+
+int adns__revlabels(int af, const void *addr,
+		    byte labels_r[DNS_MAXREVLABELS], int *nlabels_r) {
+  static const char hexdigits[]= "0123456789abcdef";
+  const byte *ap= addr, *label;
+  byte *p;
+  int i;
+
+  p= labels_r;
+  switch (af) {
+  case AF_INET:
+    for (i=3; i>=0; i--) {
+      label= adns__decimal_label[ap[i]];
+      memcpy(p,label,label[0]+1); p+= label[0]+1;
+    }
+    *nlabels_r= 4;
+    break;
+  case AF_INET6:
+    for (i=15; i>=0; i--) {
+      *p++= 1; *p++= hexdigits[ap[i] & 0x0f];
+      *p++= 1; *p++= hexdigits[ap[i] >> 4];
+    }
+    *nlabels_r= 32;
+    break;
+  default:
+    abort();
+  }
+  return p - labels_r;
+}
+
+adns_status adns__mkquery_prefix(adns_state ads, vbuf *vb, int *id_r,
+				 const byte *labels, int ll, int nlabels,
+				 const char *zone, int zl,
+				 const typeinfo *typei, adns_rrtype type,
+				 adns_queryflags flags) {
+  int nbytes;
+  byte *rqp;
+  adns_status st;
+
+  st= mkquery_header(ads,vb,id_r,ll+zl+2); if (st) return st;
+
+  MKQUERY_START(vb);
+
+  memcpy(rqp,labels,ll); rqp+= ll;
+  nbytes= ll;
+  st= mkquery_labels(ads,&rqp,&nbytes,nlabels, zone,zone+zl, typei,flags);
+  if (st) return st;
+  MKQUERY_ADDB(0);
+
+  MKQUERY_STOP(vb);
+
+  st= mkquery_footer(vb,type);
+
+  return adns_s_ok;
+}
+
 adns_status adns__mkquery_frdgram(adns_state ads, vbuf *vb, int *id_r,
 				  const byte *qd_dgram, int qd_dglen,
 				  int qd_begin,
@@ -186,77 +293,112 @@ adns_status adns__mkquery_frdgram(adns_state ads, vbuf *vb, int *id_r,
   return adns_s_ok;
 }
 
+static byte keepalive_opt[]= {
+  0,                                  /* owner: root */
+  0, DNS_TYPE_OPT,
+  DNS_MAXUDP>>8, DNS_MAXUDP&0x0ff,    /* class: our UDP payload size */
+  0, 0, 0, 0,                         /* ext. RCODE, version 0, flags */
+  0, 4,                               /* RDLENGTH */
+  0, DNS_EDNSOPT_TCPKEEPALIVE, 0, 0   /* option with no timeout */
+};
+
 void adns__querysend_tcp(adns_query qu, struct timeval now) {
-  byte length[2];
-  struct iovec iov[2];
-  int wr, r;
+  byte length[2], header[DNS_HDRSIZE];
+  struct iovec iov[4];
+  int wr, r, i, niov, msglen;
   adns_state ads;
-
-  if (qu->ads->tcpstate != server_ok) return;
+  struct tcpconn *c;
 
   assert(qu->state == query_tcpw);
 
-  length[0]= (qu->query_dglen&0x0ff00U) >>8;
-  length[1]= (qu->query_dglen&0x0ff);
-
   ads= qu->ads;
-  if (!adns__vbuf_ensure(&ads->tcpsend,ads->tcpsend.used+qu->query_dglen+2))
+  if (qu->tcpconn == -1) {
+    adns__tcp_assign(qu);
+    if (qu->tcpconn == -1) return;
+  }
+  c= &ads->tcp[qu->tcpconn];
+  if (c->state != server_ok) return;
+  assert(!qu->tcpsent);
+  if (ads->tcpinflight && c->ninflight >= ads->tcpinflight) return;
+
+  iov[0].iov_base= length;
+  iov[0].iov_len= 2;
+  if (!ads->tcpkeepalive) {
+    iov[1].iov_base= qu->query_dgram;
+    iov[1].iov_len= qu->query_dglen;
+    niov= 2;
+  } else {
+    /* The same message with an edns-tcp-keepalive option appended;
+     * qu->query_dgram is still what we match the reply against. */
+    memcpy(header,qu->query_dgram,DNS_HDRSIZE);
+    header[11]= 1; /* ARCOUNT */
+    iov[1].iov_base= header;
+    iov[1].iov_len= DNS_HDRSIZE;
+    iov[2].iov_base= qu->query_dgram+DNS_HDRSIZE;
+    iov[2].iov_len= qu->query_dglen-DNS_HDRSIZE;
+    iov[3].iov_base= keepalive_opt;
+    iov[3].iov_len= sizeof(keepalive_opt);
+    niov= 4;
+  }
+  for (i=1, msglen=0; i<niov; i++) msglen+= iov[i].iov_len;
+  length[0]= (msglen&0x0ff00U) >>8;
+  length[1]= (msglen&0x0ff);
+
+  if (c->send_skip && c->send_skip >= c->send.used-c->send_skip) {
+    c->send.used -= c->send_skip;
+    memmove(c->send.buf,c->send.buf+c->send_skip,c->send.used);
+    c->send_skip= 0;
+  }
+  if (!adns__vbuf_ensure(&c->send,c->send.used+msglen+2))
     return;
 
   qu->retries++;
+  qu->tcpsent= 1;
+  c->ninflight++;
 
   /* Reset idle timeout. */
-  ads->tcptimeout.tv_sec= ads->tcptimeout.tv_usec= 0;
+  c->timeout.tv_sec= c->timeout.tv_usec= 0;
 
-  if (ads->tcpsend.used) {
+  if (c->send.used) {
     wr= 0;
   } else {
-    iov[0].iov_base= length;
-    iov[0].iov_len= 2;
-    iov[1].iov_base= qu->query_dgram;
-    iov[1].iov_len= qu->query_dglen;
-    adns__sigpipe_protect(qu->ads);
-    wr= writev(qu->ads->tcpsocket,iov,2);
-    adns__sigpipe_unprotect(qu->ads);
+    wr= adns__tcp_writev(ads,c->fd,iov,niov);
     if (wr < 0) {
       if (!(errno == EAGAIN || errno == EINTR || errno == ENOSPC ||
-	    errno == ENOBUFS || errno == ENOMEM)) {
-	adns__tcp_broken(ads,"write",strerror(errno));
+	    errno == ENOBUFS || errno == ENOMEM || errno == EINPROGRESS)) {
+	adns__tcp_broken(ads,c,"write",strerror(errno));
 	return;
       }
       wr= 0;
     }
   }
 
-  if (wr<2) {
-    r= adns__vbuf_append(&ads->tcpsend,length,2-wr); assert(r);
-    wr= 0;
-  } else {
-    wr-= 2;
-  }
-  if (wr<qu->query_dglen) {
-    r= adns__vbuf_append(&ads->tcpsend,qu->query_dgram+wr,qu->query_dglen-wr);
+  for (i=0; i<niov; i++) {
+    if (wr >= iov[i].iov_len) { wr-= iov[i].iov_len; continue; }
+    r= adns__vbuf_append(&c->send,(byte*)iov[i].iov_base+wr,
+			 iov[i].iov_len-wr);
     assert(r);
+    wr= 0;
   }
 }
 
-static void query_usetcp(adns_query qu, struct timeval now) {
+void adns__query_usetcp(adns_query qu, struct timeval now) {
   qu->state= query_tcpw;
   qu->timeout= now;
-  timevaladd(&qu->timeout,TCPWAITMS);
+  timevaladd(&qu->timeout,qu->ads->tcpwaitms);
   LIST_LINK_TAIL(qu->ads->tcpw,qu);
   adns__querysend_tcp(qu,now);
-  adns__tcp_tryconnect(qu->ads,now);
+  if (qu->tcpconn != -1)
+    adns__tcp_tryconnect(qu->ads,&qu->ads->tcp[qu->tcpconn],now);
 }
 
 void adns__query_send(adns_query qu, struct timeval now) {
-  struct sockaddr_in servaddr;
-  int serv, r;
+  int serv, r, fd, tries;
   adns_state ads;
 
   assert(qu->state == query_tosend);
   if ((qu->flags & adns_qf_usevc) || (qu->query_dglen > DNS_MAXUDP)) {
-    query_usetcp(qu,now);
+    adns__query_usetcp(qu,now);
     return;
   }
 
@@ -265,23 +407,30 @@ void adns__query_send(adns_query qu, struct timeval now) {
     return;
   }
 
+  /* Servers we have no UDP socket for (their own, or the IPv6 one)
+   * are passed over without using up a retry; we have already said
+   * why.  If that is all of them we give up at once. */
+  ads= qu->ads;
   serv= qu->udpnextserver;
-  memset(&servaddr,0,sizeof(servaddr));
+  for (tries=0; (fd= adns__server_socket(ads,serv)) < 0; tries++) {
+    if (tries+1 >= ads->nservers) {
+      adns__query_fail(qu,adns_s_allservfail);
+      return;
+    }
+    serv= (serv+1)%ads->nservers;
+  }
 
-  ads= qu->ads;
-  servaddr.sin_family= AF_INET;
-  servaddr.sin_addr= ads->servers[serv].addr;
-  servaddr.sin_port= htons(DNS_PORT);
-  
-  r= sendto(ads->udpsocket,qu->query_dgram,qu->query_dglen,0,
-	    (const struct sockaddr*)&servaddr,sizeof(servaddr));
-  if (r<0 && errno == EMSGSIZE) {
-    qu->retries= 0;
-    query_usetcp(qu,now);
-    return;
+  if (!adns__uring_send(ads,serv,fd,qu->query_dgram,qu->query_dglen)) {
+    r= sendto(fd,qu->query_dgram,qu->query_dglen,0,
+	      &ads->servers[serv].addr.sa,ads->servers[serv].len);
+    if (r<0 && errno == EMSGSIZE) {
+      qu->retries= 0;
+      adns__query_usetcp(qu,now);
+      return;
+    }
+    if (r<0 && errno != EAGAIN)
+      adns__warn(ads,serv,0,"sendto failed: %s",strerror(errno));
   }
-  if (r<0 && errno != EAGAIN)
-    adns__warn(ads,serv,0,"sendto failed: %s",strerror(errno));
   
   qu->timeout= now;
   timevaladd(&qu->timeout,UDPRETRYMS);
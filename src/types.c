@@ -37,6 +37,66 @@
 #define CSP_ADDSTR(s) do {			\
     if (!adns__vbuf_appendstr(vb,(s))) R_NOMEM;	\
   } while (0)
+#define CSP_RESERVE(n) do {					\
+    if (!adns__vbuf_ensure(vb,vb->used+(n))) R_NOMEM;		\
+  } while (0)
+
+/*
+ * Formatting for the convstring functions.  The csp_*q functions
+ * write straight into the vbuf without checking for space, so the
+ * caller must have done CSP_RESERVE for at least the lengths below.
+ */
+
+#define CSP_ULONGMAX 20 /* digits in the largest unsigned long */
+#define CSP_INADDRMAX 15
+#define CSP_IN6ADDRMAX (INET6_ADDRSTRLEN-1)
+
+static const char csp_hexdigits[]= "0123456789abcdef";
+
+static void csp_ulongq(vbuf *vb, unsigned long v) {
+  char buf[CSP_ULONGMAX];
+  int i;
+
+  i= sizeof(buf);
+  do { buf[--i]= '0' + v%10; v /= 10; } while (v);
+  adns__vbuf_appendq(vb,(const byte*)buf+i,sizeof(buf)-i);
+}
+
+static void csp_inaddrq(vbuf *vb, struct in_addr ia) {
+  const byte *p= (const byte*)&ia;
+  byte *q;
+  int i, v;
+
+  q= vb->buf+vb->used;
+  for (i=0; i<4; i++) {
+    if (i) *q++= '.';
+    v= p[i];
+    if (v >= 100) { *q++= '0' + v/100; v %= 100; *q++= '0' + v/10; }
+    else if (v >= 10) { *q++= '0' + v/10; }
+    *q++= '0' + v%10;
+  }
+  vb->used= q - vb->buf;
+}
+
+static void csp_in6addrq(vbuf *vb, const struct in6_addr *ia) {
+  char buf[INET6_ADDRSTRLEN];
+  const char *p;
+
+  p= inet_ntop(AF_INET6,ia,buf,sizeof(buf)); assert(p);
+  adns__vbuf_appendq(vb,(const byte*)buf,strlen(buf));
+}
+
+static void csp_hexq(vbuf *vb, const byte *p, int len) {
+  /* Writes 2*len bytes. */
+  byte *q;
+
+  q= vb->buf+vb->used;
+  while (len-- > 0) {
+    *q++= csp_hexdigits[*p >> 4];
+    *q++= csp_hexdigits[*p++ & 0x0f];
+  }
+  vb->used= q - vb->buf;
+}
 
 /*
  * order of sections:
@@ -48,7 +108,8 @@
  * _manyistr                  (mf,cs)
  * _txt                       (pa)
  * _inaddr                    (pa,dip,di)
- * _addr                      (pa,di,csp,cs)
+ * _in6addr                   (pa,di,sk,cs)
+ * _addr                      (pa,sk,di,csp,cs +qs,icb)
  * _domain                    (pap)
  * _host_raw                  (pa)
  * _hostaddr                  (pap,pa,dip,di,mfp,mf,csp,cs +pap_findaddrs)
@@ -114,24 +175,24 @@ static adns_status pap_qstring(const parseinfo *pai, int *cbyte_io, int max,
 
 static adns_status csp_qstring(vbuf *vb, const char *dp, int len) {
   unsigned char ch;
-  char buf[10];
   int cn;
 
-  CSP_ADDSTR("\"");
+  CSP_RESERVE(len*4 + 2);
+  adns__vbuf_appendq(vb,"\"",1);
   for (cn=0; cn<len; cn++) {
     ch= *dp++;
     if (ch == '\\') {
-      CSP_ADDSTR("\\\\");
+      adns__vbuf_appendq(vb,"\\\\",2);
     } else if (ch == '"') {
-      CSP_ADDSTR("\\\"");
+      adns__vbuf_appendq(vb,"\\\"",2);
     } else if (ch >= 32 && ch <= 126) {
-      if (!adns__vbuf_append(vb,&ch,1)) R_NOMEM;
+      adns__vbuf_appendq(vb,&ch,1);
     } else {
-      sprintf(buf,"\\x%02x",ch);
-      CSP_ADDSTR(buf);
+      adns__vbuf_appendq(vb,"\\x",2);
+      csp_hexq(vb,&ch,1);
     }
   }
-  CSP_ADDSTR("\"");
+  adns__vbuf_appendq(vb,"\"",1);
   
   return adns_s_ok;
 }
@@ -251,24 +312,13 @@ static adns_status pa_inaddr(const parseinfo *pai, int cbyte,
   return adns_s_ok;
 }
 
-static int search_sortlist(adns_state ads, struct in_addr ad) {
-  const struct sortlist *slp;
-  int i;
-  
-  for (i=0, slp=ads->sortlist;
-       i<ads->nsortlist &&
-	 !((ad.s_addr & slp->mask.s_addr) == slp->base.s_addr);
-       i++, slp++);
-  return i;
-}
-
 static int dip_inaddr(adns_state ads, struct in_addr a, struct in_addr b) {
   int ai, bi;
   
   if (!ads->nsortlist) return 0;
 
-  ai= search_sortlist(ads,a);
-  bi= search_sortlist(ads,b);
+  ai= adns__sortlist_find(ads,AF_INET,&a);
+  bi= adns__sortlist_find(ads,AF_INET,&b);
   return bi<ai;
 }
 
@@ -279,17 +329,49 @@ static int di_inaddr(adns_state ads,
   return dip_inaddr(ads,*ap,*bp);
 }
 
+static int sk_inaddr(adns_state ads, const void *datap) {
+  return adns__sortlist_find(ads,AF_INET,datap);
+}
+
 static adns_status cs_inaddr(vbuf *vb, const void *datap) {
   const struct in_addr *rrp= datap, rr= *rrp;
-  const char *ia;
 
-  ia= inet_ntoa(rr); assert(ia);
-  CSP_ADDSTR(ia);
+  CSP_RESERVE(CSP_INADDRMAX);
+  csp_inaddrq(vb,rr);
   return adns_s_ok;
 }
 
 /*
- * _addr   (pa,di,csp,cs)
+ * _in6addr   (pa,di,sk,cs)
+ */
+
+static adns_status pa_in6addr(const parseinfo *pai, int cbyte,
+			      int max, void *datap) {
+  struct in6_addr *storeto= datap;
+
+  if (max-cbyte != 16) return adns_s_invaliddata;
+  memcpy(storeto, pai->dgram + cbyte, 16);
+  return adns_s_ok;
+}
+
+static int sk_in6addr(adns_state ads, const void *datap) {
+  return adns__sortlist_find(ads,AF_INET6,datap);
+}
+
+static int di_in6addr(adns_state ads,
+		      const void *datap_a, const void *datap_b) {
+  if (!ads->nsortlist) return 0;
+  return sk_in6addr(ads,datap_b) < sk_in6addr(ads,datap_a);
+}
+
+static adns_status cs_in6addr(vbuf *vb, const void *datap) {
+  CSP_RESERVE(CSP_IN6ADDRMAX);
+  csp_in6addrq(vb,datap);
+  return adns_s_ok;
+}
+
+/*
+ * _addr   (pa,sk,di,csp,cs +pa_addr6, qs_addr,icb_addr)
  */
 
 static adns_status pa_addr(const parseinfo *pai, int cbyte,
@@ -305,32 +387,58 @@ static adns_status pa_addr(const parseinfo *pai, int cbyte,
   return adns_s_ok;
 }
 
-static int di_addr(adns_state ads, const void *datap_a, const void *datap_b) {
-  const adns_rr_addr *ap= datap_a, *bp= datap_b;
+static adns_status pa_addr6(const parseinfo *pai, int cbyte,
+			    int max, void *datap) {
+  adns_rr_addr *storeto= datap;
+  const byte *dgram= pai->dgram;
 
-  assert(ap->addr.sa.sa_family == AF_INET);
-  return dip_inaddr(ads, ap->addr.inet.sin_addr, bp->addr.inet.sin_addr);
+  if (max-cbyte != 16) return adns_s_invaliddata;
+  storeto->len= sizeof(storeto->addr.inet6);
+  memset(&storeto->addr,0,sizeof(storeto->addr.inet6));
+  storeto->addr.inet6.sin6_family= AF_INET6;
+  memcpy(&storeto->addr.inet6.sin6_addr,dgram+cbyte,16);
+  return adns_s_ok;
 }
 
-static int div_addr(void *context, const void *datap_a, const void *datap_b) {
-  const adns_state ads= context;
+static int sk_addr(adns_state ads, const void *datap) {
+  const adns_rr_addr *rrp= datap;
 
-  return di_addr(ads, datap_a, datap_b);
-}		     
+  switch (rrp->addr.sa.sa_family) {
+  case AF_INET:
+    return adns__sortlist_find(ads,AF_INET,&rrp->addr.inet.sin_addr);
+  case AF_INET6:
+    return adns__sortlist_find(ads,AF_INET6,&rrp->addr.inet6.sin6_addr);
+  default:
+    return ads->nsortlist;
+  }
+}
 
-static adns_status csp_addr(vbuf *vb, const adns_rr_addr *rrp) {
-  const char *ia;
-  char buf[30];
+static int dip_addr(adns_state ads,
+		    const adns_rr_addr *ap, const adns_rr_addr *bp) {
+  if (!ads->nsortlist) return 0;
+  return sk_addr(ads,bp) < sk_addr(ads,ap);
+}
+
+static int di_addr(adns_state ads, const void *datap_a, const void *datap_b) {
+  return dip_addr(ads, datap_a, datap_b);
+}
 
+static adns_status csp_addr(vbuf *vb, const adns_rr_addr *rrp) {
   switch (rrp->addr.inet.sin_family) {
   case AF_INET:
-    CSP_ADDSTR("INET ");
-    ia= inet_ntoa(rrp->addr.inet.sin_addr); assert(ia);
-    CSP_ADDSTR(ia);
+    CSP_RESERVE(5 + CSP_INADDRMAX);
+    adns__vbuf_appendq(vb,"INET ",5);
+    csp_inaddrq(vb,rrp->addr.inet.sin_addr);
+    break;
+  case AF_INET6:
+    CSP_RESERVE(6 + CSP_IN6ADDRMAX);
+    adns__vbuf_appendq(vb,"INET6 ",6);
+    csp_in6addrq(vb,&rrp->addr.inet6.sin6_addr);
     break;
   default:
-    sprintf(buf,"AF=%u",rrp->addr.sa.sa_family);
-    CSP_ADDSTR(buf);
+    CSP_RESERVE(3 + CSP_ULONGMAX);
+    adns__vbuf_appendq(vb,"AF=",3);
+    csp_ulongq(vb,rrp->addr.sa.sa_family);
     break;
   }
   return adns_s_ok;
@@ -342,6 +450,137 @@ static adns_status cs_addr(vbuf *vb, const void *datap) {
   return csp_addr(vb,rrp);
 }
 
+static adns_queryflags addr_families(adns_queryflags flags) {
+  /* Returns the adns_qf_want_* bits for the address families wanted. */
+  if (!(flags & adns_qf_want_ipv6)) return adns_qf_want_ipv4;
+  return flags & adns_qf_want_allaf;
+}
+
+static adns_status addr_failstatus(adns_status a, adns_status b) {
+  /* Combines the failures of the subqueries of an addr query: the
+   * less permanent one wins, but nodata says the name exists. */
+  if (a == adns_s_nxdomain) return b;
+  if (b == adns_s_nxdomain) return a;
+  return a < b ? a : b;
+}
+
+static void icb_addr(adns_query parent, adns_query child) {
+  adns_answer *pans= parent->answer, *cans= child->answer;
+  adns_state ads= parent->ads;
+  struct timeval tv_buf;
+  const struct timeval *now;
+  size_t sz;
+  int l;
+
+  if (parent->expires > child->expires) parent->expires= child->expires;
+
+  if (cans->cname && !pans->cname) {
+    l= strlen(cans->cname)+1;
+    pans->cname= adns__alloc_preserved(parent,l);
+    if (!pans->cname) goto x_nomem;
+    memcpy(pans->cname,cans->cname,l);
+  }
+
+  /* While the subqueries are outstanding the addresses found so far
+   * are in parent->vb (IPv4 first), and pans->status is the combined
+   * failure status (initially nxdomain, see qs_addr). */
+  if (cans->status) {
+    pans->status= addr_failstatus(pans->status,cans->status);
+  } else {
+    sz= cans->nrrs*sizeof(adns_rr_addr);
+    if (!adns__vbuf_ensure(&parent->vb,parent->vb.used+sz)) goto x_nomem;
+    if (child->typei->typekey == adns_r_addr) {
+      memmove(parent->vb.buf+sz,parent->vb.buf,parent->vb.used);
+      memcpy(parent->vb.buf,cans->rrs.bytes,sz);
+    } else {
+      memcpy(parent->vb.buf+parent->vb.used,cans->rrs.bytes,sz);
+    }
+    parent->vb.used += sz;
+  }
+
+  if (parent->children.head) {
+    LIST_LINK_TAIL(ads->childw,parent);
+    return;
+  }
+
+  if (parent->vb.used) {
+    pans->rrs.untyped= adns__alloc_interim(parent,parent->vb.used);
+    if (!pans->rrs.untyped) goto x_nomem;
+    memcpy(pans->rrs.untyped,parent->vb.buf,parent->vb.used);
+    pans->nrrs= parent->vb.used/sizeof(adns_rr_addr);
+    pans->status= adns_s_ok;
+    adns__query_done(parent);
+  } else if (pans->status == adns_s_nxdomain && !pans->cname &&
+	     (parent->flags & adns_qf_search)) {
+    now= 0;
+    adns__must_gettimeofday(ads,&now,&tv_buf);
+    if (!now) { adns__query_fail(parent,adns_s_systemfail); return; }
+    adns__search_next(ads,parent,*now);
+  } else {
+    adns__query_fail(parent,pans->status);
+  }
+  return;
+
+ x_nomem:
+  adns__query_fail(parent,adns_s_nomemory);
+}
+
+static adns_status addr_submit(adns_query qu, adns_rrtype type,
+			       adns_queryflags flags, struct timeval now) {
+  qcontext ctx;
+  adns_query cqu;
+  adns_status st;
+  int id;
+
+  st= adns__mkquery_frdgram(qu->ads, &qu->vb, &id,
+			    qu->query_dgram, qu->query_dglen, DNS_HDRSIZE,
+			    type, flags);
+  if (st) return st;
+
+  ctx.ext= 0;
+  ctx.callback= icb_addr;
+  memset(&ctx.info,0,sizeof(ctx.info));
+
+  st= adns__internal_submit(qu->ads, &cqu, adns__findtype(type),
+			    &qu->vb, id, flags, now, &ctx);
+  if (st) return st;
+
+  cqu->parent= qu;
+  LIST_LINK_TAIL_PART(qu->children,cqu,siblings.);
+  return adns_s_ok;
+}
+
+static void qs_addr(adns_query qu, struct timeval now) {
+  /* If IPv6 addresses are wanted we send no query of our own, but
+   * look the name up with an A and/or an AAAA subquery, in parallel,
+   * and merge their answers (in icb_addr).  Searching happens here,
+   * in the parent, as does following a CNAME in the query domain
+   * (separately in each subquery). */
+  adns_queryflags fams, cflags;
+  adns_status st;
+
+  fams= addr_families(qu->flags);
+  if (fams == adns_qf_want_ipv4) { adns__query_send(qu,now); return; }
+
+  cflags= (qu->flags & ~(adns_qf_search|adns_qf_owner|adns_qf_want_allaf))
+    | adns_qf_quoteok_query;
+  if (fams & adns_qf_want_ipv4) {
+    st= addr_submit(qu, adns_r_addr, cflags|adns_qf_want_ipv4, now);
+    if (st) goto x_fail;
+  }
+  st= addr_submit(qu, adns__r_addr6, cflags, now);
+  if (st) goto x_fail;
+
+  qu->answer->status= adns_s_nxdomain;
+  qu->vb.used= 0;
+  qu->state= query_childw;
+  LIST_LINK_TAIL(qu->ads->childw,qu);
+  return;
+
+ x_fail:
+  adns__query_fail(qu,st);
+}
+
 /*
  * _domain      (pap,csp,cs)
  * _dom_raw     (pa)
@@ -411,42 +650,218 @@ static adns_status pa_host_raw(const parseinfo *pai, int cbyte,
  * _hostaddr   (pap,pa,dip,di,mfp,mf,csp,cs +icb_hostaddr, pap_findaddrs)
  */
 
-static adns_status pap_findaddrs(const parseinfo *pai, adns_rr_hostaddr *ha,
-				 int *cbyte_io, int count, int dmstart) {
-  int rri, naddrs;
-  int type, class, rdlen, rdstart, ownermatched;
+static adns_status pap_findaddrs_rr(const parseinfo *pai, int *cbyte_io,
+				    int dmstart, ownermemo *memo, int rrtype,
+				    int *naddrs_io, int *matched_r) {
+  /* Looks at the RR at *cbyte_io and, if it is an address (of type
+   * rrtype, A or AAAA) for the domain at dmstart, adds it to the
+   * *naddrs_io in pai->qu->vb. */
+  int type, class, rdlen, rdstart, naddrs;
   unsigned long ttl;
   adns_status st;
+
+  st= adns__findrr_anychk(pai->qu, pai->serv, pai->dgram,
+			  pai->dglen, cbyte_io,
+			  &type, &class, &ttl, &rdlen, &rdstart,
+			  pai->dgram, pai->dglen, dmstart, matched_r,
+			  memo);
+  if (st) return st;
+  if (!*matched_r || class != DNS_CLASS_IN || type != rrtype) {
+    *matched_r= 0;
+    return adns_s_ok;
+  }
+  naddrs= *naddrs_io;
+  if (!adns__vbuf_ensure(&pai->qu->vb, (naddrs+1)*sizeof(adns_rr_addr)))
+    R_NOMEM;
+  adns__update_expires(pai->qu,ttl,pai->now);
+  st= (rrtype == adns_r_a ? pa_addr : pa_addr6)
+    (pai, rdstart,rdstart+rdlen,
+     pai->qu->vb.buf + naddrs*sizeof(adns_rr_addr));
+  if (st) return st;
+  *naddrs_io= naddrs+1;
+  return adns_s_ok;
+}
+
+static adns_status pap_findaddrs_scan(const parseinfo *pai, int *cbyte_io,
+				      int count, int dmstart, int rrtype,
+				      int *naddrs_io, int *found_r) {
+  /* Finds the first run of addresses for dmstart in the count RRs
+   * starting at *cbyte_io. */
+  int rri, found, matched;
+  ownermemo memo;
+  adns_status st;
   
-  for (rri=0, naddrs=-1; rri<count; rri++) {
-    st= adns__findrr_anychk(pai->qu, pai->serv, pai->dgram,
-			    pai->dglen, cbyte_io,
-			    &type, &class, &ttl, &rdlen, &rdstart,
-			    pai->dgram, pai->dglen, dmstart, &ownermatched);
+  adns__ownermemo_init(&memo,pai->dgram,pai->dglen,dmstart);
+  for (rri=0, found=0; rri<count; rri++) {
+    st= pap_findaddrs_rr(pai, cbyte_io, dmstart, &memo, rrtype,
+			 naddrs_io, &matched);
     if (st) return st;
-    if (!ownermatched || class != DNS_CLASS_IN || type != adns_r_a) {
-      if (naddrs>0) break; else continue;
+    if (!matched) {
+      if (found) break; else continue;
     }
-    if (naddrs == -1) {
-      naddrs= 0;
+    found= 1;
+  }
+  *found_r= found;
+  return adns_s_ok;
+}
+
+static adns_status glue_hashowner(const parseinfo *pai, int cbyte,
+				  unsigned long *hash_r) {
+  /* FNV-1a over the labels, case-folded as for adns__findrr_anychk. */
+  findlabel_state fls;
+  int lablen, labstart, ch;
+  unsigned long hash;
+  adns_status st;
+
+  adns__findlabel_start(&fls, pai->ads, pai->serv, pai->qu,
+			pai->dgram, pai->dglen, pai->dglen, cbyte, 0);
+  hash= 2166136261UL;
+  do {
+    st= adns__findlabel_next(&fls,&lablen,&labstart);
+    if (st) return st;
+    if (lablen<0) return adns_s_invalidresponse;
+    hash= ((hash ^ lablen) * 16777619UL) & 0x0ffffffffUL;
+    while (lablen-- > 0) {
+      ch= pai->dgram[labstart++]; if (ctype_alpha(ch)) ch &= ~32;
+      hash= ((hash ^ ch) * 16777619UL) & 0x0ffffffffUL;
     }
-    if (!adns__vbuf_ensure(&pai->qu->vb, (naddrs+1)*sizeof(adns_rr_addr)))
-      R_NOMEM;
-    adns__update_expires(pai->qu,ttl,pai->now);
-    st= pa_addr(pai, rdstart,rdstart+rdlen,
-		pai->qu->vb.buf + naddrs*sizeof(adns_rr_addr));
+  } while (lablen);
+  *hash_r= hash;
+  return adns_s_ok;
+}
+
+static void glue_build(const parseinfo *pai) {
+  glueindex *gi= pai->glue;
+  int rri, cbyte, type, class, nbuckets, b;
+  unsigned long ttl;
+  adns_status st;
+
+  gi->state= glue_unindexable;
+  gi->nrrs= pai->nscount + pai->arcount;
+  for (nbuckets=1; nbuckets < gi->nrrs; nbuckets <<= 1);
+  gi->mask= nbuckets-1;
+  gi->rrstart= adns__alloc_mine(pai->qu, sizeof(int)*gi->nrrs);
+  gi->next= adns__alloc_mine(pai->qu, sizeof(int)*gi->nrrs);
+  gi->bucket= adns__alloc_mine(pai->qu, sizeof(int)*nbuckets);
+  gi->hash= adns__alloc_mine(pai->qu, sizeof(unsigned long)*gi->nrrs);
+  if (!gi->rrstart || !gi->next || !gi->bucket || !gi->hash) return;
+
+  for (rri=0, cbyte=pai->nsstart; rri<gi->nrrs; rri++) {
+    gi->rrstart[rri]= cbyte;
+    st= glue_hashowner(pai, cbyte, &gi->hash[rri]);
+    if (st) return;
+    st= adns__findrr_anychk(pai->qu, pai->serv, pai->dgram, pai->dglen,
+			    &cbyte, &type, &class, &ttl, 0, 0, 0,0,0,0, 0);
+    if (st || type == -1) return;
+  }
+
+  for (b=0; b<nbuckets; b++) gi->bucket[b]= -1;
+  for (rri=gi->nrrs-1; rri>=0; rri--) {
+    b= gi->hash[rri] & gi->mask;
+    gi->next[rri]= gi->bucket[b];
+    gi->bucket[b]= rri;
+  }
+  gi->state= glue_indexed;
+}
+
+static adns_status pap_findaddrs_indexed(const parseinfo *pai,
+					 int rrlo, int rrhi, int dmstart,
+					 unsigned long hash, int rrtype,
+					 int *naddrs_io, int *found_r) {
+  /* Like pap_findaddrs_scan on RRs rrlo..rrhi-1, using the index. */
+  const glueindex *gi= pai->glue;
+  int rri, found, matched, cbyte;
+  ownermemo memo;
+  adns_status st;
+
+  adns__ownermemo_init(&memo,pai->dgram,pai->dglen,dmstart);
+  found= 0;
+  for (rri= gi->bucket[hash & gi->mask]; rri != -1; rri= gi->next[rri]) {
+    if (rri < rrlo || gi->hash[rri] != hash) continue;
+    if (rri >= rrhi) break;
+    cbyte= gi->rrstart[rri];
+    st= pap_findaddrs_rr(pai, &cbyte, dmstart, &memo, rrtype,
+			 naddrs_io, &matched);
+    if (st) return st;
+    if (matched) { found= 1; break; }
+  }
+  if (found) {
+    /* The run continues for as long as the following RRs match. */
+    for (rri++; rri<rrhi; rri++) {
+      cbyte= gi->rrstart[rri];
+      st= pap_findaddrs_rr(pai, &cbyte, dmstart, &memo, rrtype,
+			   naddrs_io, &matched);
+      if (st) return st;
+      if (!matched) break;
+    }
+  }
+  *found_r= found;
+  return adns_s_ok;
+}
+
+static adns_status pap_findaddrs(const parseinfo *pai, adns_rr_hostaddr *ha,
+				 int dmstart, adns_queryflags fams,
+				 adns_queryflags *found_r) {
+  /* Looks for the addresses of the domain at dmstart, first in the
+   * authority section and then in the additional section, separately
+   * for each of the families in fams.  *found_r says which families
+   * were found; if any were, ha is filled in. */
+  static const struct { adns_queryflags fam; int rrtype; } addrfams[]= {
+    { adns_qf_want_ipv4, adns_r_a    },
+    { adns_qf_want_ipv6, adns_r_aaaa }
+  };
+  glueindex *gi= pai->glue;
+  int naddrs, cbyte, found, fi;
+  unsigned long hash= 0;
+  adns_queryflags foundfams;
+  adns_status st;
+
+  if (gi->state == glue_unindexed && gi->lookups++ > 0)
+    glue_build(pai);
+
+  if (gi->state == glue_indexed) {
+    st= glue_hashowner(pai, dmstart, &hash);
     if (st) return st;
-    naddrs++;
   }
-  if (naddrs >= 0) {
+
+  naddrs= 0;
+  foundfams= 0;
+  for (fi=0; fi<sizeof(addrfams)/sizeof(*addrfams); fi++) {
+    if (!(fams & addrfams[fi].fam)) continue;
+    if (gi->state == glue_indexed) {
+      st= pap_findaddrs_indexed(pai, 0, pai->nscount, dmstart, hash,
+				addrfams[fi].rrtype, &naddrs, &found);
+      if (st) return st;
+      if (!found) {
+	st= pap_findaddrs_indexed(pai, pai->nscount, gi->nrrs, dmstart, hash,
+				  addrfams[fi].rrtype, &naddrs, &found);
+	if (st) return st;
+      }
+    } else {
+      cbyte= pai->nsstart;
+      st= pap_findaddrs_scan(pai, &cbyte, pai->nscount, dmstart,
+			     addrfams[fi].rrtype, &naddrs, &found);
+      if (st) return st;
+      if (!found) {
+	st= pap_findaddrs_scan(pai, &cbyte, pai->arcount, dmstart,
+			       addrfams[fi].rrtype, &naddrs, &found);
+	if (st) return st;
+      }
+    }
+    if (found) foundfams |= addrfams[fi].fam;
+  }
+  *found_r= foundfams;
+
+  if (foundfams) {
     ha->addrs= adns__alloc_interim(pai->qu, naddrs*sizeof(adns_rr_addr));
     if (!ha->addrs) R_NOMEM;
     memcpy(ha->addrs, pai->qu->vb.buf, naddrs*sizeof(adns_rr_addr));
     ha->naddrs= naddrs;
     ha->astatus= adns_s_ok;
 
-    adns__isort(ha->addrs, naddrs, sizeof(adns_rr_addr), pai->qu->vb.buf,
-		div_addr, pai->ads);
+    if (!adns__sort_bykey(pai->ads, ha->addrs, naddrs, sizeof(adns_rr_addr),
+			  &pai->qu->vb, sk_addr))
+      R_NOMEM;
   }
   return adns_s_ok;
 }
@@ -455,14 +870,37 @@ static void icb_hostaddr(adns_query parent, adns_query child) {
   adns_answer *cans= child->answer;
   adns_rr_hostaddr *rrp= child->ctx.info.hostaddr;
   adns_state ads= parent->ads;
+  adns_rr_addr *addrs;
   adns_status st;
+  int n, first;
 
   st= cans->status;
-  rrp->astatus= st;
-  rrp->naddrs= (st>0 && st<=adns_s_max_tempfail) ? -1 : cans->nrrs;
-  rrp->addrs= cans->rrs.addr;
-  adns__transfer_interim(child, parent, rrp->addrs,
-			 rrp->naddrs*sizeof(adns_rr_addr));
+  if (rrp->naddrs > 0) {
+    /* The glue had addresses of some of the families we wanted. */
+    if (!st && cans->nrrs) {
+      n= rrp->naddrs + cans->nrrs;
+      addrs= adns__alloc_interim(parent, n*sizeof(adns_rr_addr));
+      if (!addrs) { adns__query_fail(parent,adns_s_nomemory); return; }
+      first= cans->rrs.addr[0].addr.sa.sa_family == AF_INET ? 0 : rrp->naddrs;
+      memcpy(addrs+first, cans->rrs.addr, cans->nrrs*sizeof(adns_rr_addr));
+      memcpy(addrs+(first ? 0 : cans->nrrs), rrp->addrs,
+	     rrp->naddrs*sizeof(adns_rr_addr));
+      if (!adns__sort_bykey(ads, addrs, n, sizeof(adns_rr_addr),
+			    &parent->vb, sk_addr)) {
+	adns__query_fail(parent,adns_s_nomemory);
+	return;
+      }
+      rrp->addrs= addrs;
+      rrp->naddrs= n;
+      if (parent->expires > child->expires) parent->expires= child->expires;
+    }
+  } else {
+    rrp->astatus= st;
+    rrp->naddrs= (st>0 && st<=adns_s_max_tempfail) ? -1 : cans->nrrs;
+    rrp->addrs= cans->rrs.addr;
+    adns__transfer_interim(child, parent, rrp->addrs,
+			   rrp->naddrs*sizeof(adns_rr_addr));
+  }
 
   if (parent->children.head) {
     LIST_LINK_TAIL(ads->childw,parent);
@@ -478,7 +916,7 @@ static adns_status pap_hostaddr(const parseinfo *pai, int *cbyte_io,
   qcontext ctx;
   int id;
   adns_query nqu;
-  adns_queryflags nflags;
+  adns_queryflags nflags, fams, found;
 
   dmstart= cbyte= *cbyte_io;
   st= pap_domain(pai, &cbyte, max, &rrp->host,
@@ -490,15 +928,10 @@ static adns_status pap_hostaddr(const parseinfo *pai, int *cbyte_io,
   rrp->naddrs= -1;
   rrp->addrs= 0;
 
-  cbyte= pai->nsstart;
-
-  st= pap_findaddrs(pai, rrp, &cbyte, pai->nscount, dmstart);
+  fams= addr_families(pai->qu->flags);
+  st= pap_findaddrs(pai, rrp, dmstart, fams, &found);
   if (st) return st;
-  if (rrp->naddrs != -1) return adns_s_ok;
-
-  st= pap_findaddrs(pai, rrp, &cbyte, pai->arcount, dmstart);
-  if (st) return st;
-  if (rrp->naddrs != -1) return adns_s_ok;
+  if (!(fams & ~found)) return adns_s_ok;
 
   st= adns__mkquery_frdgram(pai->ads, &pai->qu->vb, &id,
 			    pai->dgram, pai->dglen, dmstart,
@@ -509,7 +942,7 @@ static adns_status pap_hostaddr(const parseinfo *pai, int *cbyte_io,
   ctx.callback= icb_hostaddr;
   ctx.info.hostaddr= rrp;
   
-  nflags= adns_qf_quoteok_query;
+  nflags= adns_qf_quoteok_query | (fams & ~found);
   if (!(pai->qu->flags & adns_qf_cname_loose)) nflags |= adns_qf_cname_forbid;
   
   st= adns__internal_submit(pai->ads, &nqu, adns__findtype(adns_r_addr),
@@ -539,11 +972,7 @@ static int dip_hostaddr(adns_state ads,
   if (ap->astatus != bp->astatus) return ap->astatus;
   if (ap->astatus) return 0;
 
-  assert(ap->addrs[0].addr.sa.sa_family == AF_INET);
-  assert(bp->addrs[0].addr.sa.sa_family == AF_INET);
-  return dip_inaddr(ads,
-		    ap->addrs[0].addr.inet.sin_addr,
-		    bp->addrs[0].addr.inet.sin_addr);
+  return dip_addr(ads, &ap->addrs[0], &bp->addrs[0]);
 }
 
 static int di_hostaddr(adns_state ads,
@@ -571,7 +1000,6 @@ static void mf_hostaddr(adns_query qu, void *datap) {
 static adns_status csp_hostaddr(vbuf *vb, const adns_rr_hostaddr *rrp) {
   const char *errstr;
   adns_status st;
-  char buf[20];
   int i;
 
   st= csp_domain(vb,rrp->host);  if (st) return st;
@@ -579,8 +1007,10 @@ static adns_status csp_hostaddr(vbuf *vb, const adns_rr_hostaddr *rrp) {
   CSP_ADDSTR(" ");
   CSP_ADDSTR(adns_errtypeabbrev(rrp->astatus));
 
-  sprintf(buf," %d ",rrp->astatus);
-  CSP_ADDSTR(buf);
+  CSP_RESERVE(CSP_ULONGMAX + 2);
+  adns__vbuf_appendq(vb," ",1);
+  csp_ulongq(vb,rrp->astatus);
+  adns__vbuf_appendq(vb," ",1);
 
   CSP_ADDSTR(adns_errabbrev(rrp->astatus));
   CSP_ADDSTR(" ");
@@ -678,10 +1108,10 @@ static void mf_inthostaddr(adns_query qu, void *datap) {
 
 static adns_status cs_inthostaddr(vbuf *vb, const void *datap) {
   const adns_rr_inthostaddr *rrp= datap;
-  char buf[10];
 
-  sprintf(buf,"%u ",rrp->i);
-  CSP_ADDSTR(buf);
+  CSP_RESERVE(CSP_ULONGMAX + 1);
+  csp_ulongq(vb,(unsigned)rrp->i);
+  adns__vbuf_appendq(vb," ",1);
 
   return csp_hostaddr(vb,&rrp->ha);
 }
@@ -692,10 +1122,10 @@ static adns_status cs_inthostaddr(vbuf *vb, const void *datap) {
 
 static adns_status cs_inthost(vbuf *vb, const void *datap) {
   const adns_rr_intstr *rrp= datap;
-  char buf[10];
 
-  sprintf(buf,"%u ",rrp->i);
-  CSP_ADDSTR(buf);
+  CSP_RESERVE(CSP_ULONGMAX + 1);
+  csp_ulongq(vb,(unsigned)rrp->i);
+  adns__vbuf_appendq(vb," ",1);
   return csp_domain(vb,rrp->str);
 }
 
@@ -707,7 +1137,7 @@ static void icb_ptr(adns_query parent, adns_query child) {
   adns_answer *cans= child->answer;
   const adns_rr_addr *queried, *found;
   adns_state ads= parent->ads;
-  int i;
+  int i, matched;
 
   if (cans->status == adns_s_nxdomain || cans->status == adns_s_nodata) {
     adns__query_fail(parent,adns_s_inconsistent);
@@ -718,9 +1148,16 @@ static void icb_ptr(adns_query parent, adns_query child) {
   }
 
   queried= &parent->ctx.info.ptr_parent_addr;
-  for (i=0, found=cans->rrs.addr; i<cans->nrrs; i++, found++) {
-    if (queried->len == found->len &&
-	!memcmp(&queried->addr,&found->addr,queried->len)) {
+  for (i=0; i<cans->nrrs; i++) {
+    if (cans->type == adns_r_aaaa) {
+      matched= !memcmp(&queried->addr.inet6.sin6_addr,
+		       &cans->rrs.in6addr[i], 16);
+    } else {
+      found= &cans->rrs.addr[i];
+      matched= queried->len == found->len &&
+	!memcmp(&queried->addr,&found->addr,queried->len);
+    }
+    if (matched) {
       if (!parent->children.head) {
 	adns__query_done(parent);
 	return;
@@ -734,18 +1171,97 @@ static void icb_ptr(adns_query parent, adns_query child) {
   adns__query_fail(parent,adns_s_inconsistent);
 }
 
-static adns_status pa_ptr(const parseinfo *pai, int dmstart,
-			  int max, void *datap) {
-  static const char *const (expectdomain[])= { DNS_INADDR_ARPA };
+static int pap_ptr_hexnibble(int c) {
+  if (ctype_digit(c)) return c-'0';
+  if (c>='a' && c<='f') return c-'a'+10;
+  if (c>='A' && c<='F') return c-'A'+10;
+  return -1;
+}
+
+static adns_status pap_ptr_queryaddr(adns_query qu, adns_rr_addr *ap) {
+  /* Works out which address was being looked up from the query name,
+   * which must be d.c.b.a.in-addr.arpa or the 32 nibbles in ip6.arpa.
+   * This is only needed if the query did not come from
+   * adns_submit_reverse*, which store the address directly. */
+  static const char *const (inaddr_arpa[])= { DNS_INADDR_ARPA };
+  static const char *const (ip6_arpa[])= { DNS_IP6_ARPA };
+  enum { maxlabels= 32+2 };
   
-  char **rrp= datap;
+  const char *const *expectdomain;
+  const byte *dgram= qu->query_dgram;
   adns_status st;
-  adns_rr_addr *ap;
   findlabel_state fls;
   char *ep;
-  byte ipv[4];
+  byte ipv[16];
   char labbuf[4];
-  int cbyte, i, lablen, labstart, l, id;
+  int labstarts[maxlabels], lablens[maxlabels];
+  int i, nlabels, lablen, labstart, l, nib;
+
+  adns__findlabel_start(&fls, qu->ads, -1, qu,
+			qu->query_dgram, qu->query_dglen,
+			qu->query_dglen, DNS_HDRSIZE, 0);
+  for (nlabels=0; ; nlabels++) {
+    st= adns__findlabel_next(&fls,&lablen,&labstart); assert(!st);
+    if (!lablen) break;
+    if (nlabels >= maxlabels) return adns_s_querydomainwrong;
+    labstarts[nlabels]= labstart;
+    lablens[nlabels]= lablen;
+  }
+
+  memset(ap,0,sizeof(*ap));
+  switch (nlabels) {
+  case 4+2:
+    for (i=0; i<4; i++) {
+      lablen= lablens[i]; labstart= labstarts[i];
+      if (lablen<=0 || lablen>3) return adns_s_querydomainwrong;
+      memcpy(labbuf, dgram + labstart, lablen);
+      labbuf[lablen]= 0;
+      ipv[3-i]= strtoul(labbuf,&ep,10);
+      if (*ep) return adns_s_querydomainwrong;
+      if (lablen>1 && dgram[labstart]=='0')
+	return adns_s_querydomainwrong;
+    }
+    expectdomain= inaddr_arpa;
+    ap->len= sizeof(struct sockaddr_in);
+    ap->addr.inet.sin_family= AF_INET;
+    memcpy(&ap->addr.inet.sin_addr,ipv,4);
+    break;
+  case 32+2:
+    for (i=0; i<32; i++) {
+      if (lablens[i] != 1) return adns_s_querydomainwrong;
+      nib= pap_ptr_hexnibble(dgram[labstarts[i]]);
+      if (nib<0) return adns_s_querydomainwrong;
+      if (!(i & 1)) ipv[15-i/2]= nib;
+      else ipv[15-i/2] |= nib << 4;
+    }
+    expectdomain= ip6_arpa;
+    ap->len= sizeof(struct sockaddr_in6);
+    ap->addr.inet6.sin6_family= AF_INET6;
+    memcpy(&ap->addr.inet6.sin6_addr,ipv,16);
+    break;
+  default:
+    return adns_s_querydomainwrong;
+  }
+
+  for (i=0; i<2; i++) {
+    lablen= lablens[nlabels-2+i];
+    l= strlen(expectdomain[i]);
+    if (lablen != l ||
+	memcmp(dgram + labstarts[nlabels-2+i], expectdomain[i], l)) {
+      ap->len= 0;
+      return adns_s_querydomainwrong;
+    }
+  }
+  return adns_s_ok;
+}
+
+static adns_status pa_ptr(const parseinfo *pai, int dmstart,
+			  int max, void *datap) {
+  char **rrp= datap;
+  adns_status st;
+  adns_rr_addr *ap;
+  adns_rrtype fwdtype;
+  int cbyte, id;
   adns_query nqu;
   qcontext ctx;
 
@@ -757,45 +1273,20 @@ static adns_status pa_ptr(const parseinfo *pai, int dmstart,
 
   ap= &pai->qu->ctx.info.ptr_parent_addr;
   if (!ap->len) {
-    adns__findlabel_start(&fls, pai->ads, -1, pai->qu,
-			  pai->qu->query_dgram, pai->qu->query_dglen,
-			  pai->qu->query_dglen, DNS_HDRSIZE, 0);
-    for (i=0; i<4; i++) {
-      st= adns__findlabel_next(&fls,&lablen,&labstart); assert(!st);
-      if (lablen<=0 || lablen>3) return adns_s_querydomainwrong;
-      memcpy(labbuf, pai->qu->query_dgram + labstart, lablen);
-      labbuf[lablen]= 0;
-      ipv[3-i]= strtoul(labbuf,&ep,10);
-      if (*ep) return adns_s_querydomainwrong;
-      if (lablen>1 && pai->qu->query_dgram[labstart]=='0')
-	return adns_s_querydomainwrong;
-    }
-    for (i=0; i<sizeof(expectdomain)/sizeof(*expectdomain); i++) {
-      st= adns__findlabel_next(&fls,&lablen,&labstart); assert(!st);
-      l= strlen(expectdomain[i]);
-      if (lablen != l ||
-	  memcmp(pai->qu->query_dgram + labstart, expectdomain[i], l))
-	return adns_s_querydomainwrong;
-    }
-    st= adns__findlabel_next(&fls,&lablen,0); assert(!st);
-    if (lablen) return adns_s_querydomainwrong;
-    
-    ap->len= sizeof(struct sockaddr_in);
-    memset(&ap->addr,0,sizeof(ap->addr.inet));
-    ap->addr.inet.sin_family= AF_INET;
-    ap->addr.inet.sin_addr.s_addr=
-      htonl((ipv[0]<<24) | (ipv[1]<<16) | (ipv[2]<<8) | (ipv[3]));
+    st= pap_ptr_queryaddr(pai->qu, ap);
+    if (st) return st;
   }
+  fwdtype= ap->addr.sa.sa_family == AF_INET6 ? adns_r_aaaa : adns_r_addr;
 
   st= adns__mkquery_frdgram(pai->ads, &pai->qu->vb, &id,
 			    pai->dgram, pai->dglen, dmstart,
-			    adns_r_addr, adns_qf_quoteok_query);
+			    fwdtype, adns_qf_quoteok_query);
   if (st) return st;
 
   ctx.ext= 0;
   ctx.callback= icb_ptr;
   memset(&ctx.info,0,sizeof(ctx.info));
-  st= adns__internal_submit(pai->ads, &nqu, adns__findtype(adns_r_addr),
+  st= adns__internal_submit(pai->ads, &nqu, adns__findtype(fwdtype),
 			    &pai->qu->vb, id,
 			    adns_qf_quoteok_query, pai->now, &ctx);
   if (st) return st;
@@ -988,7 +1479,6 @@ static void mf_soa(adns_query qu, void *datap) {
 
 static adns_status cs_soa(vbuf *vb, const void *datap) {
   const adns_rr_soa *rrp= datap;
-  char buf[20];
   int i;
   adns_status st;
   
@@ -996,9 +1486,10 @@ static adns_status cs_soa(vbuf *vb, const void *datap) {
   CSP_ADDSTR(" ");
   st= csp_mailbox(vb,rrp->rname);  if (st) return st;
 
+  CSP_RESERVE(5 * (CSP_ULONGMAX + 1));
   for (i=0; i<5; i++) {
-    sprintf(buf," %lu",(&rrp->serial)[i]);
-    CSP_ADDSTR(buf);
+    adns__vbuf_appendq(vb," ",1);
+    csp_ulongq(vb,(&rrp->serial)[i]);
   }
 
   return adns_s_ok;
@@ -1100,9 +1591,10 @@ static int di_srv(adns_state ads, const void *datap_a, const void *datap_b) {
 
 static adns_status csp_srv_begin(vbuf *vb, const adns_rr_srvha *rrp
 				   /* might be adns_rr_srvraw* */) {
-  char buf[30];
-  sprintf(buf,"%u %u %u ", rrp->priority, rrp->weight, rrp->port);
-  CSP_ADDSTR(buf);
+  CSP_RESERVE(3 * (CSP_ULONGMAX + 1));
+  csp_ulongq(vb,(unsigned)rrp->priority);  adns__vbuf_appendq(vb," ",1);
+  csp_ulongq(vb,(unsigned)rrp->weight);    adns__vbuf_appendq(vb," ",1);
+  csp_ulongq(vb,(unsigned)rrp->port);      adns__vbuf_appendq(vb," ",1);
   return adns_s_ok;
 }
 
@@ -1211,24 +1703,24 @@ static adns_status pa_opaque(const parseinfo *pai, int cbyte,
 
 static adns_status cs_opaque(vbuf *vb, const void *datap) {
   const adns_rr_byteblock *rrp= datap;
-  char buf[10];
   int l;
   unsigned char *p;
 
-  sprintf(buf,"\\# %d",rrp->len);
-  CSP_ADDSTR(buf);
+  CSP_RESERVE(3 + CSP_ULONGMAX + rrp->len*3);
+  adns__vbuf_appendq(vb,"\\# ",3);
+  csp_ulongq(vb,(unsigned)rrp->len);
   
   for (l= rrp->len, p= rrp->data;
        l>=4;
        l -= 4, p += 4) {
-    sprintf(buf," %02x%02x%02x%02x",p[0],p[1],p[2],p[3]);
-    CSP_ADDSTR(buf);
+    adns__vbuf_appendq(vb," ",1);
+    csp_hexq(vb,p,4);
   }
   for (;
        l>0;
        l--, p++) {
-    sprintf(buf," %02x",*p);
-    CSP_ADDSTR(buf);
+    adns__vbuf_appendq(vb," ",1);
+    csp_hexq(vb,p,1);
   }
   return adns_s_ok;
 }
@@ -1254,6 +1746,9 @@ static void mf_flat(adns_query qu, void *data) { }
 #define FLAT_TYPE(code,rrt,fmt,memb,parser,comparer,printer)	\
  { adns_r_##code, rrt,fmt,TYPESZ_M(memb), mf_flat,		\
      printer,parser,comparer, adns__qdpl_normal,0 }
+#define ADDR_TYPE(code,rrt,fmt,memb,parser,comparer,printer,sortkey,qsend) \
+ { adns_r_##code, rrt,fmt,TYPESZ_M(memb), mf_flat,		      \
+     printer,parser,comparer, adns__qdpl_normal,0,sortkey,qsend }
 #define XTRA_TYPE(code,rrt,fmt,memb,parser,comparer,printer,qdpl,postsort) \
  { adns_r_##code, rrt,fmt,TYPESZ_M(memb), mf_##memb,			   \
     printer,parser,comparer,qdpl,postsort }
@@ -1262,7 +1757,8 @@ static const typeinfo typeinfos[] = {
 /* Must be in ascending order of rrtype ! */
 /* mem-mgmt code  rrt     fmt   member   parser      comparer  printer */
 
-FLAT_TYPE(a,      "A",     0,   inaddr,  pa_inaddr,  di_inaddr,cs_inaddr     ),
+ADDR_TYPE(a,      "A",     0,   inaddr,  pa_inaddr,  di_inaddr,cs_inaddr,
+	                                                       sk_inaddr,0),
 DEEP_TYPE(ns_raw, "NS",   "raw",str,     pa_host_raw,0,        cs_domain     ),
 DEEP_TYPE(cname,  "CNAME", 0,   str,     pa_dom_raw, 0,        cs_domain     ),
 DEEP_TYPE(soa_raw,"SOA",  "raw",soa,     pa_soa,     0,        cs_soa        ),
@@ -1271,13 +1767,19 @@ DEEP_TYPE(hinfo,  "HINFO", 0, intstrpair,pa_hinfo,   0,        cs_hinfo      ),
 DEEP_TYPE(mx_raw, "MX",   "raw",intstr,  pa_mx_raw,  di_mx_raw,cs_inthost    ),
 DEEP_TYPE(txt,    "TXT",   0,   manyistr,pa_txt,     0,        cs_txt        ),
 DEEP_TYPE(rp_raw, "RP",   "raw",strpair, pa_rp,      0,        cs_rp         ),
+ADDR_TYPE(aaaa,   "AAAA",  0,   in6addr, pa_in6addr, di_in6addr,cs_in6addr,
+	                                                      sk_in6addr,0),
 XTRA_TYPE(srv_raw,"SRV",  "raw",srvraw , pa_srvraw,  di_srv,   cs_srvraw,
 	                                               qdpl_srv, postsort_srv),
 
-FLAT_TYPE(addr,   "A",  "addr", addr,    pa_addr,    di_addr,  cs_addr       ),
+ADDR_TYPE(addr,   "A",  "addr", addr,    pa_addr,    di_addr,  cs_addr,
+	                                                 sk_addr,qs_addr),
 DEEP_TYPE(ns,     "NS", "+addr",hostaddr,pa_hostaddr,di_hostaddr,cs_hostaddr ),
 DEEP_TYPE(ptr,    "PTR","checked",str,   pa_ptr,     0,        cs_domain     ),
 DEEP_TYPE(mx,     "MX", "+addr",inthostaddr,pa_mx,   di_mx,    cs_inthostaddr),
+/* internal, only used as a subquery by qs_addr */
+{ adns__r_addr6,"AAAA","addr",TYPESZ_M(addr), mf_flat,
+                   cs_addr,    pa_addr6,   di_addr, adns__qdpl_normal,0,sk_addr },
 XTRA_TYPE(srv,    "SRV","+addr",srvha,   pa_srvha,   di_srv,   cs_srvha,
           	                                       qdpl_srv, postsort_srv),
 
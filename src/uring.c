@@ -0,0 +1,569 @@
+/*
+ * uring.c
+ * - optional io_uring backend for UDP I/O
+ */
+/*
+ *  This file is part of adns, which is
+ *    Copyright (C) 1997-2000,2003,2006  Ian Jackson
+ *    Copyright (C) 1999-2000,2003,2006  Tony Finch
+ *    Copyright (C) 1991 Massachusetts Institute of Technology
+ *  (See the file INSTALL for full details.)
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2, or (at your option)
+ *  any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software Foundation,
+ *  Inc., 59 Temple Place - Suite 330, Boston, MA 02111-1307, USA.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "internal.h"
+
+#ifdef HAVE_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* We talk to the kernel directly rather than using liburing.  Each
+ * UDP socket has a multishot recvmsg outstanding, which takes its
+ * buffers from a ring of URINGBUFS we provide; each completion is one
+ * datagram.  Queries' datagrams are copied into send slots and queued
+ * as sendmsg requests, which are all submitted together.
+ *
+ * The regression test harness redefines io_uring_setup,
+ * io_uring_enter, io_uring_register, mmap and munmap, and gives us a
+ * ring of its own: it records the entries we submit and the
+ * completions the kernel posts, and plays them back.
+ */
+
+#define URINGBUFSZ (sizeof(struct io_uring_recvmsg_out) + \
+		    sizeof(adns__sockaddr) + ADNS__UDP_CMSGSPACE + DNS_MAXUDP)
+#define URING_BGID 0 /* our buffer group */
+#define URING_UD_SHIFT 2 /* user_data is (index<<URING_UD_SHIFT) | ... */
+#define URING_UD_RECV 0 /* ... one of these */
+#define URING_UD_SEND 1
+#define URING_UD_CANCEL 2
+
+struct adns__uring {
+  int fd;
+  void *sqring, *cqring;
+  size_t ringsz;
+  struct io_uring_sqe *sqes;
+  size_t sqessz;
+  unsigned *sqhead, *sqtail, *sqarray, sqmask, sqentries;
+  unsigned sqnext; /* our tail; the kernel's is set by adns__uring_submit */
+  unsigned *cqhead, *cqtail, cqmask;
+  struct io_uring_cqe *cqes;
+  struct io_uring_buf_ring *br; /* followed in the same mapping by ... */
+  byte *bufs; /* ... the URINGBUFS receive buffers */
+  size_t brsz;
+  unsigned short brtail;
+  struct msghdr recvhdr; /* for every multishot recvmsg */
+  int nrecv;
+  struct uring_recv {
+    int fd, af;
+    int armed; /* the kernel has (or will have) a receive going */
+    int failed; /* we gave up, and read fd in the ordinary way */
+    unsigned *ovfl;
+  } recv[2+MAXSERVERS];
+  int sendfree; /* free list of send slots, -1 if all in use */
+  int nsending; /* send slots in use, ie not yet completed */
+  struct uring_send {
+    int next; /* in free list */
+    int serv;
+    struct msghdr msg;
+    struct iovec iov;
+    adns__sockaddr addr;
+    byte buf[DNS_MAXUDP];
+  } send[URINGSENDS];
+};
+
+#ifndef io_uring_setup
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup,entries,p);
+}
+#endif
+
+#ifndef io_uring_enter
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+			  unsigned flags) {
+  return syscall(__NR_io_uring_enter,fd,to_submit,min_complete,flags,
+		 (void*)0,(size_t)0);
+}
+#endif
+
+#ifndef io_uring_register
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+			     unsigned nr_args) {
+  return syscall(__NR_io_uring_register,fd,opcode,arg,nr_args);
+}
+#endif
+
+static struct io_uring_sqe *uring_sqe(struct adns__uring *u) {
+  /* Returns the next free SQE, cleared, or 0 if the queue is full. */
+  struct io_uring_sqe *sqe;
+  unsigned i;
+
+  if (u->sqnext - __atomic_load_n(u->sqhead,__ATOMIC_ACQUIRE)
+      >= u->sqentries)
+    return 0;
+  i= u->sqnext & u->sqmask;
+  sqe= &u->sqes[i];
+  memset(sqe,0,sizeof(*sqe));
+  u->sqarray[i]= i;
+  u->sqnext++;
+  return sqe;
+}
+
+static int uring_enter(struct adns__uring *u, int wait) {
+  /* Gives the kernel every entry it has not yet consumed and, if
+   * wait, waits for at least one completion.  Returns 0 or an errno
+   * value. */
+  unsigned pending;
+
+  /* Count everything the kernel has not yet consumed, not just what
+   * we have not yet published: if an earlier io_uring_enter took only
+   * some of the entries (or failed with EAGAIN or EBUSY), the rest are
+   * still between head and tail, and nothing else will submit them. */
+  pending= u->sqnext - __atomic_load_n(u->sqhead,__ATOMIC_ACQUIRE);
+  if (!pending && !wait) return 0;
+  if (*u->sqtail != u->sqnext)
+    __atomic_store_n(u->sqtail,u->sqnext,__ATOMIC_RELEASE);
+  if (io_uring_enter(u->fd,pending,wait ? 1 : 0,
+		     wait ? IORING_ENTER_GETEVENTS : 0) < 0)
+    return errno;
+  return 0;
+}
+
+static void uring_putbuf(struct adns__uring *u, int bid) {
+  /* Hands receive buffer bid (back) to the kernel; it is not told
+   * until the tail is published (see uring_publishbufs). */
+  struct io_uring_buf *b;
+
+  b= &u->br->bufs[u->brtail & (URINGBUFS-1)];
+  b->addr= (unsigned long)(u->bufs + bid*URINGBUFSZ);
+  b->len= URINGBUFSZ;
+  b->bid= bid;
+  u->brtail++;
+}
+
+static void uring_publishbufs(struct adns__uring *u) {
+  __atomic_store_n(&u->br->tail,u->brtail,__ATOMIC_RELEASE);
+}
+
+static void uring_armrecv(struct adns__uring *u, int i) {
+  struct uring_recv *rs= &u->recv[i];
+  struct io_uring_sqe *sqe;
+
+  sqe= uring_sqe(u);
+  if (!sqe) return; /* we will try again at the next uring_submit */
+  sqe->opcode= IORING_OP_RECVMSG;
+  sqe->fd= rs->fd;
+  sqe->addr= (unsigned long)&u->recvhdr;
+  sqe->len= 1;
+  sqe->flags= IOSQE_BUFFER_SELECT;
+  sqe->buf_group= URING_BGID;
+  sqe->ioprio= IORING_RECV_MULTISHOT;
+  sqe->user_data= (i<<URING_UD_SHIFT) | URING_UD_RECV;
+  rs->armed= 1;
+}
+
+static void uring_addrecv(struct adns__uring *u, int fd, int af,
+			  unsigned *ovfl) {
+  struct uring_recv *rs;
+
+  if (fd < 0) return;
+  assert(u->nrecv < (int)(sizeof(u->recv)/sizeof(u->recv[0])));
+  rs= &u->recv[u->nrecv];
+  rs->fd= fd;
+  rs->af= af;
+  rs->armed= rs->failed= 0;
+  rs->ovfl= ovfl;
+  uring_armrecv(u,u->nrecv++);
+}
+
+static void uring_free(adns_state ads, struct adns__uring *u) {
+  if (u->fd >= 0) close(u->fd);
+  if (u->sqring != MAP_FAILED) munmap(u->sqring,u->ringsz);
+  if (u->sqes != MAP_FAILED) munmap(u->sqes,u->sqessz);
+  if (u->br != MAP_FAILED) munmap(u->br,u->brsz);
+  adns__free(ads,u);
+}
+
+int adns__uring_init(adns_state ads) {
+  struct adns__uring *u;
+  struct io_uring_params p;
+  struct io_uring_buf_reg reg;
+  size_t cqsz;
+  byte *ring;
+  int r, i;
+
+  u= adns__malloc(ads,sizeof(*u));  if (!u) return errno;
+  memset(u,0,sizeof(*u));
+  u->sqring= u->cqring= MAP_FAILED;
+  u->sqes= MAP_FAILED;
+  u->br= MAP_FAILED;
+
+  memset(&p,0,sizeof(p));
+  u->fd= io_uring_setup(URINGENTRIES,&p);
+  if (u->fd < 0) { r= errno; goto x_free; }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(p.features & IORING_FEAT_NODROP)) {
+    r= ENOSYS; goto x_free;
+  }
+
+  u->ringsz= p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  cqsz= p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if (cqsz > u->ringsz) u->ringsz= cqsz;
+  u->sqring= mmap(0,u->ringsz,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+		  u->fd,IORING_OFF_SQ_RING);
+  if (u->sqring == MAP_FAILED) { r= errno; goto x_free; }
+  u->cqring= u->sqring;
+  u->sqessz= p.sq_entries*sizeof(struct io_uring_sqe);
+  u->sqes= mmap(0,u->sqessz,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_POPULATE,
+		u->fd,IORING_OFF_SQES);
+  if (u->sqes == MAP_FAILED) { r= errno; goto x_free; }
+
+  ring= u->sqring;
+  u->sqhead= (unsigned*)(ring + p.sq_off.head);
+  u->sqtail= (unsigned*)(ring + p.sq_off.tail);
+  u->sqarray= (unsigned*)(ring + p.sq_off.array);
+  u->sqmask= *(unsigned*)(ring + p.sq_off.ring_mask);
+  u->sqentries= p.sq_entries;
+  u->sqnext= *u->sqtail;
+  ring= u->cqring;
+  u->cqhead= (unsigned*)(ring + p.cq_off.head);
+  u->cqtail= (unsigned*)(ring + p.cq_off.tail);
+  u->cqmask= *(unsigned*)(ring + p.cq_off.ring_mask);
+  u->cqes= (struct io_uring_cqe*)(ring + p.cq_off.cqes);
+
+  /* The buffer ring must be page-aligned, so it and the buffers get
+   * a mapping of their own. */
+  u->brsz= URINGBUFS*sizeof(struct io_uring_buf) + URINGBUFS*URINGBUFSZ;
+  u->br= mmap(0,u->brsz,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  if (u->br == MAP_FAILED) { r= errno; goto x_free; }
+  u->bufs= (byte*)u->br + URINGBUFS*sizeof(struct io_uring_buf);
+  memset(&reg,0,sizeof(reg));
+  reg.ring_addr= (unsigned long)u->br;
+  reg.ring_entries= URINGBUFS;
+  reg.bgid= URING_BGID;
+  if (io_uring_register(u->fd,IORING_REGISTER_PBUF_RING,&reg,1))
+    { r= errno; goto x_free; }
+  u->brtail= 0;
+  for (i=0; i<URINGBUFS; i++) uring_putbuf(u,i);
+  uring_publishbufs(u);
+
+  memset(&u->recvhdr,0,sizeof(u->recvhdr));
+  u->recvhdr.msg_namelen= sizeof(adns__sockaddr);
+  u->recvhdr.msg_controllen= ads->udpdropstats ? ADNS__UDP_CMSGSPACE : 0;
+
+  u->sendfree= -1;
+  u->nsending= 0;
+  for (i=URINGSENDS-1; i>=0; i--) {
+    u->send[i].next= u->sendfree;
+    u->sendfree= i;
+  }
+
+  u->nrecv= 0;
+  uring_addrecv(u,ads->udpsocket,AF_INET,&ads->udpovfl);
+  uring_addrecv(u,ads->udpsocket6,AF_INET6,&ads->udpovfl6);
+  for (i=0; i<ads->nservers; i++)
+    uring_addrecv(u,ads->servers[i].udpsocket,
+		  ads->servers[i].addr.sa.sa_family,
+		  &ads->servers[i].udpovfl);
+
+  ads->uring= u;
+  adns__uring_submit(ads);
+  return 0;
+
+ x_free:
+  uring_free(ads,u);
+  return r;
+}
+
+static int uring_busy(struct adns__uring *u) {
+  int i;
+
+  if (u->nsending) return 1;
+  for (i=0; i<u->nrecv; i++)
+    if (u->recv[i].armed) return 1;
+  return 0;
+}
+
+static void uring_discard(struct adns__uring *u) {
+  /* Consumes the completions in the ring, keeping track only of
+   * which slots the kernel has finished with. */
+  struct io_uring_cqe *cqe;
+  unsigned head;
+  unsigned long long ud;
+  int i;
+
+  for (;;) {
+    head= *u->cqhead;
+    if (head == __atomic_load_n(u->cqtail,__ATOMIC_ACQUIRE)) break;
+    cqe= &u->cqes[head & u->cqmask];
+    ud= cqe->user_data;
+    i= ud >> URING_UD_SHIFT;
+    switch (ud & ((1<<URING_UD_SHIFT)-1)) {
+    case URING_UD_SEND:
+      u->nsending--;
+      break;
+    case URING_UD_RECV:
+      if (!(cqe->flags & IORING_CQE_F_MORE)) u->recv[i].armed= 0;
+      break;
+    }
+    __atomic_store_n(u->cqhead,head+1,__ATOMIC_RELEASE);
+  }
+}
+
+void adns__uring_finish(adns_state ads) {
+  struct adns__uring *u= ads->uring;
+  struct io_uring_sqe *sqe;
+  int r;
+
+  if (!u) return;
+  ads->uring= 0;
+
+  /* The kernel may still be using our memory: the receive buffers
+   * and u->recvhdr for the multishot receives, which are always
+   * outstanding, and the send slots for sends not yet completed.
+   * Closing the ring does not wait for those to stop, so we cancel
+   * them all and wait for their completions.  If we cannot, we leak
+   * the memory rather than free it from under the kernel. */
+  r= 0;
+  if (uring_busy(u)) {
+    sqe= uring_sqe(u);
+    if (!sqe && !(r= uring_enter(u,0))) sqe= uring_sqe(u);
+    if (!sqe) goto x_leak;
+    sqe->opcode= IORING_OP_ASYNC_CANCEL;
+    sqe->fd= -1;
+    sqe->cancel_flags= IORING_ASYNC_CANCEL_ANY;
+    sqe->user_data= URING_UD_CANCEL;
+    do {
+      r= uring_enter(u,1);
+      if (r && r != EINTR) goto x_leak;
+      uring_discard(u);
+    } while (uring_busy(u));
+  }
+  uring_free(ads,u);
+  return;
+
+ x_leak:
+  adns__diag(ads,-1,0,"io_uring could not be shut down: %s",
+	     strerror(r ? r : EBUSY));
+  close(u->fd);
+}
+
+int adns__uring_fd(adns_state ads) {
+  return ads->uring ? ads->uring->fd : -1;
+}
+
+int adns__uring_receiving(adns_state ads, int fd) {
+  struct adns__uring *u= ads->uring;
+  int i;
+
+  if (!u) return 0;
+  for (i=0; i<u->nrecv; i++)
+    if (u->recv[i].fd == fd) return !u->recv[i].failed;
+  return 0;
+}
+
+int adns__uring_send(adns_state ads, int serv, int fd,
+		     const byte *dgram, int dglen) {
+  struct adns__uring *u= ads->uring;
+  struct uring_send *ss;
+  struct io_uring_sqe *sqe;
+  int i;
+
+  if (!u || u->sendfree < 0 || dglen > DNS_MAXUDP) return 0;
+  sqe= uring_sqe(u);
+  if (!sqe) {
+    adns__uring_submit(ads);
+    sqe= uring_sqe(u);
+    if (!sqe) return 0;
+  }
+  i= u->sendfree;
+  ss= &u->send[i];
+  u->sendfree= ss->next;
+
+  ss->serv= serv;
+  memcpy(ss->buf,dgram,dglen);
+  memcpy(&ss->addr,&ads->servers[serv].addr,ads->servers[serv].len);
+  ss->iov.iov_base= ss->buf;
+  ss->iov.iov_len= dglen;
+  memset(&ss->msg,0,sizeof(ss->msg));
+  ss->msg.msg_name= &ss->addr;
+  ss->msg.msg_namelen= ads->servers[serv].len;
+  ss->msg.msg_iov= &ss->iov;
+  ss->msg.msg_iovlen= 1;
+
+  sqe->opcode= IORING_OP_SENDMSG;
+  sqe->fd= fd;
+  sqe->addr= (unsigned long)&ss->msg;
+  sqe->len= 1;
+  sqe->user_data= (i<<URING_UD_SHIFT) | URING_UD_SEND;
+  u->nsending++;
+  return 1;
+}
+
+void adns__uring_submit(adns_state ads) {
+  struct adns__uring *u= ads->uring;
+  int i, r;
+
+  if (!u) return;
+  for (i=0; i<u->nrecv; i++)
+    if (!u->recv[i].armed && !u->recv[i].failed) uring_armrecv(u,i);
+
+  r= uring_enter(u,0);
+  if (r && r != EINTR && r != EAGAIN && r != EBUSY)
+    adns__diag(ads,-1,0,"io_uring submission failed: %s",strerror(r));
+}
+
+static void uring_recvd(adns_state ads, struct uring_recv *rs,
+			byte *buf, int len, struct timeval now) {
+  /* buf is a receive buffer, of which the kernel has filled len
+   * bytes, laid out as described by u->recvhdr. */
+  struct adns__uring *u= ads->uring;
+  const struct io_uring_recvmsg_out *out;
+  struct msghdr cmsgs;
+  adns__sockaddr addr;
+  byte *name, *control, *payload;
+  int payloadlen;
+
+  out= (const struct io_uring_recvmsg_out*)buf;
+  name= buf + sizeof(*out);
+  control= name + u->recvhdr.msg_namelen;
+  payload= control + u->recvhdr.msg_controllen;
+  if (payload > buf+len) {
+    adns__warn(ads,-1,0,"io_uring gave us a short receive buffer");
+    return;
+  }
+  payloadlen= out->payloadlen;
+  if (payloadlen > buf+len-payload) payloadlen= buf+len-payload;
+
+  if (out->controllen) {
+    memset(&cmsgs,0,sizeof(cmsgs));
+    cmsgs.msg_control= control;
+    cmsgs.msg_controllen= out->controllen;
+    adns__udp_ovfl(ads,&cmsgs,rs->ovfl);
+  }
+  memset(&addr,0,sizeof(addr));
+  memcpy(&addr,name,
+	 out->namelen < sizeof(addr) ? out->namelen : sizeof(addr));
+  adns__udp_dgram(ads,rs->fd,rs->af,payload,payloadlen,
+		  &addr,out->namelen,now);
+}
+
+static void uring_sendtoobig(adns_state ads, struct uring_send *ss,
+			     struct timeval now) {
+  /* The kernel would not send ss's datagram.  As when sendto says so
+   * (see adns__query_send), its query, if it is still waiting for a
+   * reply, switches to TCP. */
+  adns_query qu;
+
+  for (qu= ads->udpw.head; qu; qu= qu->next) {
+    if (!(qu->udpsent & (1<<ss->serv))) continue;
+    if (qu->query_dglen != (int)ss->iov.iov_len) continue;
+    if (memcmp(qu->query_dgram,ss->buf,qu->query_dglen)) continue;
+    LIST_UNLINK(ads->udpw,qu);
+    qu->retries= 0;
+    adns__query_usetcp(qu,now);
+    return;
+  }
+}
+
+int adns__uring_reap(adns_state ads, struct timeval now) {
+  struct adns__uring *u= ads->uring;
+  struct io_uring_cqe *cqe;
+  struct uring_recv *rs;
+  struct uring_send *ss;
+  unsigned head;
+  unsigned long long ud;
+  int res, bid, i;
+  unsigned flags;
+
+  if (!u) return 0;
+  for (;;) {
+    head= *u->cqhead;
+    if (head == __atomic_load_n(u->cqtail,__ATOMIC_ACQUIRE)) break;
+    cqe= &u->cqes[head & u->cqmask];
+    ud= cqe->user_data;
+    res= cqe->res;
+    flags= cqe->flags;
+    __atomic_store_n(u->cqhead,head+1,__ATOMIC_RELEASE);
+    i= ud >> URING_UD_SHIFT;
+
+    if ((ud & ((1<<URING_UD_SHIFT)-1)) == URING_UD_SEND) {
+      ss= &u->send[i];
+      if (res == -EMSGSIZE)
+	uring_sendtoobig(ads,ss,now);
+      else if (res < 0 && res != -EAGAIN)
+	adns__warn(ads,ss->serv,0,"sendto failed: %s",strerror(-res));
+      ss->next= u->sendfree;
+      u->sendfree= i;
+      u->nsending--;
+      continue;
+    }
+
+    rs= &u->recv[i];
+    if (!(flags & IORING_CQE_F_MORE)) rs->armed= 0;
+    if (flags & IORING_CQE_F_BUFFER) {
+      bid= flags >> IORING_CQE_BUFFER_SHIFT;
+      if (res >= 0) uring_recvd(ads,rs,u->bufs + bid*URINGBUFSZ,res,now);
+      uring_putbuf(u,bid);
+      uring_publishbufs(u);
+    } else if (res < 0 && res != -ENOBUFS && res != -EINTR &&
+	       res != -EAGAIN && res != -ECANCELED) {
+      /* Eg, a kernel without multishot recvmsg.  This socket will be
+       * read in the ordinary way instead. */
+      adns__diag(ads,-1,0,"io_uring receive failed: %s",strerror(-res));
+      rs->failed= 1;
+    }
+  }
+  adns__uring_submit(ads);
+  return 0;
+}
+
+#else /* !HAVE_IO_URING */
+
+int adns__uring_init(adns_state ads) { return ENOSYS; }
+void adns__uring_finish(adns_state ads) { }
+int adns__uring_fd(adns_state ads) { return -1; }
+int adns__uring_receiving(adns_state ads, int fd) { return 0; }
+int adns__uring_send(adns_state ads, int serv, int fd,
+		     const byte *dgram, int dglen) { return 0; }
+void adns__uring_submit(adns_state ads) { }
+int adns__uring_reap(adns_state ads, struct timeval now) { return 0; }
+
+#endif
+
+int adns_uring_fd(adns_state ads) {
+  return adns__uring_fd(ads);
+}
+
+int adns_uring_process(adns_state ads, const struct timeval *now) {
+  struct timeval tv_buf;
+  int r;
+
+  adns__consistency(ads,0,cc_entex);
+  r= 0;
+  adns__must_gettimeofday(ads,&now,&tv_buf);
+  if (now) r= adns__uring_reap(ads,*now);
+  adns__consistency(ads,0,cc_entex);
+  return r;
+}